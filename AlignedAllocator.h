@@ -0,0 +1,74 @@
+#ifndef _RT_ALIGNED_ALLOCATOR_H_
+#define _RT_ALIGNED_ALLOCATOR_H_
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/**
+ * Standard allocator handing out blocks aligned to ALIGN bytes, for
+ * arrays whose elements should not straddle more cache lines than
+ * their size makes them.
+ */
+template <class T, size_t ALIGN>
+class AlignedAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U> struct rebind {
+        typedef AlignedAllocator<U, ALIGN> other;
+    };
+
+    AlignedAllocator() {}
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U, ALIGN>&) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void* = 0) {
+        void* p;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), ALIGN);
+        if (!p)
+#else
+        if (posix_memalign(&p, ALIGN, n * sizeof(T)) != 0)
+#endif
+            throw std::bad_alloc();
+        return static_cast<pointer>(p);
+    }
+
+    void deallocate(pointer p, size_type) {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+    void construct(pointer p, const T& v) { new (p) T(v); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <class T, class U, size_t ALIGN>
+bool operator==(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) {
+    return true;
+}
+
+template <class T, class U, size_t ALIGN>
+bool operator!=(const AlignedAllocator<T, ALIGN>&, const AlignedAllocator<U, ALIGN>&) {
+    return false;
+}
+
+#endif
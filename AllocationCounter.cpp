@@ -0,0 +1,52 @@
+#include "AllocationCounter.h"
+
+#include <cstdlib>
+#include <new>
+
+#ifdef RT_COUNT_ALLOCATIONS
+
+static __thread unsigned long allocations = 0;
+
+static void* CountedAlloc(std::size_t n) {
+    allocations++;
+    void* p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(std::size_t n) throw(std::bad_alloc) {
+    return CountedAlloc(n);
+}
+
+void* operator new[](std::size_t n) throw(std::bad_alloc) {
+    return CountedAlloc(n);
+}
+
+void operator delete(void* p) throw() {
+    free(p);
+}
+
+void operator delete[](void* p) throw() {
+    free(p);
+}
+
+unsigned long ThreadAllocations() {
+    return allocations;
+}
+
+bool CountingAllocations() {
+    return true;
+}
+
+#else
+
+unsigned long ThreadAllocations() {
+    return 0;
+}
+
+bool CountingAllocations() {
+    return false;
+}
+
+#endif
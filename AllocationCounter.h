@@ -0,0 +1,13 @@
+#ifndef _RT_ALLOCATION_COUNTER_H_
+#define _RT_ALLOCATION_COUNTER_H_
+
+/**
+ * Heap allocations made with operator new by the calling thread so
+ * far. They are only counted in builds with RT_COUNT_ALLOCATIONS,
+ * which replaces the global operator new; otherwise this is always 0.
+ */
+unsigned long ThreadAllocations();
+
+bool CountingAllocations();
+
+#endif
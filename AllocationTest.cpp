@@ -0,0 +1,116 @@
+// Traces frames of a fixed scene with the counting operator new (see
+// AllocationCounter.h) and fails if tracing tiles still allocates once
+// the first RayTracer::ALLOCATION_WARMUP frames have sized the pools.
+
+#include <Logging/Logger.h>
+#include <Logging/StreamLogger.h>
+#include <Scene/SceneNode.h>
+#include <Scene/ShapeNode.h>
+#include <Shapes/Sphere.h>
+#include <Shapes/Plane.h>
+#include <Math/Math.h>
+#include <Resources/EmptyTextureResource.h>
+
+#include "RayTracer.h"
+#include "AllocationCounter.h"
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+
+using namespace OpenEngine::Logging;
+using namespace OpenEngine::Scene;
+
+// steady frames checked after the warmup
+static const unsigned int FRAMES = 5;
+
+// the viewer's start scene, with soft shadows so shadow packets and
+// refinement are traced too
+static ISceneNode* MakeScene(vector<RayTracer::Light>& lights) {
+    SceneNode* root = new SceneNode();
+
+    ShapeNode* mirror = new ShapeNode(new Shapes::Sphere(Vector<3,float>(20,10,-100), 15));
+    mirror->shape->mat->diffuse = Vector<4,float>(1.0,0,0,1.0);
+    mirror->shape->mat->specular = Vector<4,float>(1);
+    mirror->shape->mat->shininess = 20;
+    mirror->shape->reflection = 1.0;
+    root->AddNode(mirror);
+
+    ShapeNode* blue = new ShapeNode(new Shapes::Sphere(Vector<3,float>(-20,10,-100), 15));
+    blue->shape->mat->diffuse = Vector<4,float>(0,0,1.0,1.0);
+    blue->shape->reflection = .5;
+    root->AddNode(blue);
+
+    ShapeNode* glass = new ShapeNode(new Shapes::Sphere(Vector<3,float>(0,10,-80), 15));
+    glass->shape->mat->diffuse = Vector<4,float>(0.005);
+    glass->shape->mat->specular = Vector<4,float>(1);
+    glass->shape->mat->shininess = 30;
+    glass->shape->transparent = true;
+    glass->shape->refraction = 2.42;
+    glass->shape->reflection = 0.2;
+    root->AddNode(glass);
+
+    root->AddNode(new ShapeNode(new Shapes::Plane(Vector<3,float>(0,-10,0),
+                                                  Vector<3,float>(0,-10,1),
+                                                  Vector<3,float>(1,-10,0))));
+
+    RayTracer::Light sun;
+    sun.pos = Vector<3,float>(0,100,0);
+    sun.color = Vector<4,float>(.5,.5,.5,1);
+    lights.push_back(sun);
+
+    RayTracer::Light lamp;
+    lamp.type = RayTracer::Light::SPHERE;
+    lamp.pos = Vector<3,float>(30,40,-60);
+    lamp.color = Vector<4,float>(.5,.5,.5,1);
+    lamp.radius = 5;
+    lights.push_back(lamp);
+    return root;
+}
+
+int main() {
+    Logger::AddLogger(new StreamLogger(&std::cout));
+
+    if (!CountingAllocations()) {
+        logger.error << "AllocationTest needs RT_COUNT_ALLOCATIONS" << logger.end;
+        return EXIT_FAILURE;
+    }
+
+    vector<RayTracer::Light> lights;
+    ISceneNode* root = MakeScene(lights);
+
+    EmptyTextureResourcePtr tex = EmptyTextureResource::Create(320, 240, 24);
+    tex->Load();
+    RayTracer* rt = new RayTracer(tex, NULL, root);
+    rt->SetLights(lights);
+
+    // camera at the origin looking down -z, 60 degrees across
+    Matrix<4,4,float> iv, proj;
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            iv(i,j) = proj(i,j) = i == j ? 1 : 0;
+    proj(0,0) = proj(1,1) = 1 / tan(PI / 6);
+    rt->SetView(iv, proj);
+
+    // Run() traces through Trace(), as in the viewer
+    rt->Start();
+    while (rt->GetFrameStats().frame < RayTracer::ALLOCATION_WARMUP + FRAMES)
+        Thread::Sleep(1000);
+    rt->run = false;
+    rt->Wait();
+
+    RayTracer::FrameStats st = rt->GetFrameStats();
+    delete rt;
+    delete root;
+
+    if (st.steadyAllocations) {
+        logger.error << "FAILED: " << st.steadyAllocations
+                     << " heap allocations while tracing tiles after "
+                     << RayTracer::ALLOCATION_WARMUP << " frames" << logger.end;
+        return EXIT_FAILURE;
+    }
+    logger.info << "OK: no heap allocations while tracing tiles in "
+                << st.frame - RayTracer::ALLOCATION_WARMUP
+                << " steady frames" << logger.end;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+#include "Arena.h"
+
+#include <algorithm>
+
+// everything handed out is aligned for any built in type
+static const size_t ALIGN = 16;
+
+Arena::Arena(size_t blockSize)
+    : block(0), used(0), blockSize(blockSize), peak(0) {}
+
+Arena::Arena(const Arena& other)
+    : block(0), used(0), blockSize(other.blockSize), peak(0) {}
+
+Arena& Arena::operator=(const Arena& other) {
+    if (this != &other) {
+        Free();
+        blockSize = other.blockSize;
+        peak = 0;
+    }
+    return *this;
+}
+
+Arena::~Arena() {
+    Free();
+}
+
+void Arena::Free() {
+    for (unsigned int i=0;i<blocks.size();i++)
+        ::operator delete(blocks[i].data);
+    blocks.clear();
+    block = 0;
+    used = 0;
+}
+
+size_t Arena::Held() const {
+    size_t n = used;
+    for (unsigned int i=0;i<block && i<blocks.size();i++)
+        n += blocks[i].size;
+    return n;
+}
+
+void Arena::Grow(size_t bytes) {
+    // move on to the next block that fits, adding one if none does
+    for (block++; block<blocks.size(); block++) {
+        if (blocks[block].size >= bytes) {
+            used = 0;
+            return;
+        }
+    }
+    Block b;
+    b.size = max(blockSize, bytes);
+    b.data = static_cast<char*>(::operator new(b.size));
+    blocks.push_back(b);
+    block = blocks.size() - 1;
+    used = 0;
+}
+
+void* Arena::Allocate(size_t bytes) {
+    bytes = (bytes + ALIGN - 1) & ~(ALIGN - 1);
+    if (blocks.empty() || used + bytes > blocks[block].size)
+        Grow(bytes);
+    void* p = blocks[block].data + used;
+    used += bytes;
+    peak = max(peak, Held());
+    return p;
+}
+
+Arena::Mark Arena::GetMark() const {
+    Mark m;
+    m.block = block;
+    m.used = used;
+    return m;
+}
+
+void Arena::Rewind(Mark m) {
+    block = m.block;
+    used = m.used;
+}
+
+void Arena::Reset() {
+    if (blocks.size() > 1) {
+        // skipped block tails count towards the peak, so one block of
+        // that size holds whatever the arena held
+        size_t size = peak;
+        Free();
+        Block b;
+        b.size = max(blockSize, size);
+        b.data = static_cast<char*>(::operator new(b.size));
+        blocks.push_back(b);
+    }
+    block = 0;
+    used = 0;
+    peak = 0;
+}
+
+size_t Arena::Capacity() const {
+    size_t n = 0;
+    for (unsigned int i=0;i<blocks.size();i++)
+        n += blocks[i].size;
+    return n;
+}
@@ -0,0 +1,115 @@
+#ifndef _RT_ARENA_H_
+#define _RT_ARENA_H_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Bump allocator for transient tracing data. Allocate() hands out
+ * memory from large blocks and nothing is freed on its own: Rewind()
+ * drops everything allocated since a Mark, Reset() drops it all.
+ *
+ * Reset() folds the blocks into one big enough for everything the
+ * arena held at its peak, so a frame that needs no more than the last
+ * one allocates nothing from the heap.
+ *
+ * Only for types that do not need their destructor run. An arena is
+ * used by one thread at a time; copies start out empty.
+ */
+class Arena {
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    vector<Block> blocks;
+    unsigned int block;  // the one being bumped
+    size_t used;         // in that block
+    size_t blockSize;
+    size_t peak;
+
+    size_t Held() const;
+    void Grow(size_t bytes);
+    void Free();
+
+public:
+    struct Mark {
+        unsigned int block;
+        size_t used;
+    };
+
+    Arena(size_t blockSize = 64 * 1024);
+    Arena(const Arena& other);
+    Arena& operator=(const Arena& other);
+    ~Arena();
+
+    void* Allocate(size_t bytes);
+
+    // n default constructed Ts
+    template <class T> T* Allocate(size_t n) {
+        T* p = static_cast<T*>(Allocate(n * sizeof(T)));
+        for (size_t i=0;i<n;i++)
+            new (p + i) T();
+        return p;
+    }
+
+    Mark GetMark() const;
+    void Rewind(Mark m);
+    void Reset();
+
+    size_t Capacity() const;
+};
+
+/**
+ * Standard allocator on top of an Arena, for containers that only live
+ * until the arena is reset. Deallocation is a no-op.
+ */
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U> struct rebind {
+        typedef ArenaAllocator<U> other;
+    };
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* arena) : arena(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& o) : arena(o.arena) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+
+    pointer allocate(size_type n, const void* = 0) {
+        return static_cast<pointer>(arena->Allocate(n * sizeof(T)));
+    }
+    void deallocate(pointer, size_type) {}
+
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+    void construct(pointer p, const T& v) { new (p) T(v); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+    return a.arena != b.arena;
+}
+
+#endif
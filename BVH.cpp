@@ -0,0 +1,554 @@
+#include "BVH.h"
+#include "LazyBVH.h"
+
+#include <cmath>
+
+static const unsigned int SAH_BINS = 12;
+static const unsigned int MAX_LEAF_SIZE = 8;
+// below this depth nodes are split in the middle, which bounds the
+// depth of the tree and so the traversal stack
+static const unsigned int MAX_SAH_DEPTH = 32;
+static const unsigned int LBVH_LEAF_SIZE = 4;
+// parallel builds cut the tree into about this many tasks per thread,
+// of at least MIN_TASK_SIZE objects
+static const unsigned int TASKS_PER_THREAD = 8;
+static const unsigned int MIN_TASK_SIZE = 1024;
+
+static float Area(const Vector<3,float>& bmin, const Vector<3,float>& bmax) {
+    Vector<3,float> d = bmax - bmin;
+    return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+static void Grow(Vector<3,float>& bmin, Vector<3,float>& bmax,
+                 const Vector<3,float>& omin, const Vector<3,float>& omax) {
+    for (unsigned int i=0;i<3;i++) {
+        bmin[i] = min(bmin[i], omin[i]);
+        bmax[i] = max(bmax[i], omax[i]);
+    }
+}
+
+// A subtree of a parallel build, with its own node list. Inner nodes
+// point into that list, leaves into the shared refs.
+struct BVH::Task {
+    unsigned int first, last;
+    unsigned int depth;
+    vector<Node> nodes;
+};
+
+class BVH::Worker : public Thread {
+    Ref* refs;
+    const unsigned int* codes;
+    vector<Task>& tasks;
+    unsigned int& next;
+    Mutex& lock;
+public:
+    Worker(Ref* refs, const unsigned int* codes, vector<Task>& tasks,
+           unsigned int& next, Mutex& lock)
+        : refs(refs), codes(codes), tasks(tasks), next(next), lock(lock) {}
+
+    // takes tasks until none are left
+    void Run() {
+        for (;;) {
+            lock.Lock();
+            unsigned int i = next++;
+            lock.Unlock();
+            if (i >= tasks.size())
+                return;
+            Task& t = tasks[i];
+            t.nodes.reserve(2 * (t.last - t.first));
+            BuildNode(t.nodes, refs, codes, t.first, t.last, t.depth);
+        }
+    }
+};
+
+// 10 bits of x spread out to every third bit
+static unsigned int SpreadBits(unsigned int x) {
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+static bool CodeBefore(const pair<unsigned int, unsigned int>& a,
+                       const pair<unsigned int, unsigned int>& b) {
+    return a.first < b.first;
+}
+
+BVH::BVH()
+    : buildCost(0)
+    , cost(0)
+    , method(SAH)
+    , buildThreads(1)
+    , buildTime(0) {}
+
+void BVH::Build(const vector<Object>& objects, Method method, unsigned int threads) {
+    Timer timer;
+    timer.Reset();
+    timer.Start();
+    this->method = method;
+    buildThreads = threads;
+
+    nodes.clear();
+    prims.clear();
+    unbounded.clear();
+
+    vector<Ref> refs;
+    for (unsigned int i=0;i<objects.size();i++) {
+        const Object& o = objects[i];
+        if (!o.bounded) {
+            unbounded.push_back(i);
+            continue;
+        }
+        Ref r;
+        r.object = i;
+        r.bmin = o.bmin;
+        r.bmax = o.bmax;
+        r.center = (o.bmin + o.bmax) * 0.5;
+        refs.push_back(r);
+    }
+
+    unsigned int n = refs.size();
+    vector<unsigned int> codes;
+    if (n && method == LBVH)
+        SortMorton(refs, codes);
+    const unsigned int* c = codes.empty() ? NULL : &codes[0];
+
+    unsigned int grain = max(MIN_TASK_SIZE, n / (threads * TASKS_PER_THREAD));
+    if (threads <= 1 || n <= grain) {
+        nodes.reserve(2 * n);
+        if (n)
+            BuildNode(nodes, &refs[0], c, 0, n, 0);
+    } else {
+        vector<Node> top;
+        vector<Task> tasks;
+        BuildTop(top, &refs[0], c, 0, n, 0, grain, tasks);
+
+        unsigned int next = 0;
+        Mutex lock;
+        vector<Worker*> workers;
+        for (unsigned int i=1;i<threads && i<tasks.size();i++) {
+            workers.push_back(new Worker(&refs[0], c, tasks, next, lock));
+            workers.back()->Start();
+        }
+        Worker(&refs[0], c, tasks, next, lock).Run();
+        for (unsigned int i=0;i<workers.size();i++) {
+            workers[i]->Wait();
+            delete workers[i];
+        }
+
+        nodes.reserve(2 * n);
+        Splice(top, 0, tasks);
+    }
+    for (unsigned int i=0;i<n;i++)
+        prims.push_back(refs[i].object);
+
+    buildCost = cost = SAHCost();
+    wide.Build(*this);
+    timer.Stop();
+    Time t = timer.GetElapsedTime();
+    buildTime = t.sec + t.usec * 1e-6f;
+}
+
+void BVH::SortMorton(vector<Ref>& refs, vector<unsigned int>& codes) {
+    Vector<3,float> cmin = refs[0].center, cmax = refs[0].center;
+    for (unsigned int i=1;i<refs.size();i++)
+        Grow(cmin, cmax, refs[i].center, refs[i].center);
+
+    vector<pair<unsigned int, unsigned int> > keys(refs.size());
+    for (unsigned int i=0;i<refs.size();i++) {
+        unsigned int code = 0;
+        for (unsigned int a=0;a<3;a++) {
+            float extent = cmax[a] - cmin[a];
+            unsigned int cell = extent > 0
+                ? (unsigned int)((refs[i].center[a] - cmin[a]) / extent * 1023.0f) : 0;
+            code |= SpreadBits(cell) << (2 - a);
+        }
+        keys[i] = make_pair(code, i);
+    }
+    sort(keys.begin(), keys.end(), CodeBefore);
+
+    vector<Ref> sorted(refs.size());
+    codes.resize(refs.size());
+    for (unsigned int i=0;i<keys.size();i++) {
+        sorted[i] = refs[keys[i].second];
+        codes[i] = keys[i].first;
+    }
+    refs.swap(sorted);
+}
+
+// The codes are sorted and share their bits above the highest one
+// where the first and last differ, so that bit splits them in two.
+unsigned int BVH::MortonSplit(const unsigned int* codes, unsigned int n) {
+    if (n <= LBVH_LEAF_SIZE)
+        return 0;
+    unsigned int diff = codes[0] ^ codes[n-1];
+    if (diff == 0)
+        return n/2;
+    unsigned int bit = 1u << (31 - __builtin_clz(diff));
+
+    // codes[lo] has the bit clear, codes[hi] has it set
+    unsigned int lo = 0, hi = n - 1;
+    while (hi - lo > 1) {
+        unsigned int mid = (lo + hi) / 2;
+        if (codes[mid] & bit)
+            hi = mid;
+        else
+            lo = mid;
+    }
+    return hi;
+}
+
+void BVH::Bounds(const Ref* refs, unsigned int n,
+                 Vector<3,float>& bmin, Vector<3,float>& bmax) {
+    bmin = refs[0].bmin;
+    bmax = refs[0].bmax;
+    for (unsigned int i=1;i<n;i++)
+        Grow(bmin, bmax, refs[i].bmin, refs[i].bmax);
+}
+
+unsigned int BVH::Split(Ref* refs, unsigned int n,
+                        const Vector<3,float>& bmin, const Vector<3,float>& bmax,
+                        unsigned int depth) {
+    if (n <= 2)
+        return 0;
+
+    Vector<3,float> cmin = refs[0].center, cmax = refs[0].center;
+    for (unsigned int i=1;i<n;i++)
+        Grow(cmin, cmax, refs[i].center, refs[i].center);
+
+    // binned SAH over the centroids, on every axis
+    float bestCost = n * Area(bmin, bmax);
+    int bestAxis = -1;
+    unsigned int bestBin = 0;
+    for (unsigned int axis=0;axis<3 && depth<MAX_SAH_DEPTH;axis++) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0)
+            continue;
+
+        unsigned int count[SAH_BINS];
+        Vector<3,float> binMin[SAH_BINS], binMax[SAH_BINS];
+        for (unsigned int b=0;b<SAH_BINS;b++)
+            count[b] = 0;
+        for (unsigned int i=0;i<n;i++) {
+            unsigned int b = min(SAH_BINS - 1, (unsigned int)
+                                 ((refs[i].center[axis] - cmin[axis]) / extent * SAH_BINS));
+            if (count[b]++ == 0) {
+                binMin[b] = refs[i].bmin;
+                binMax[b] = refs[i].bmax;
+            } else
+                Grow(binMin[b], binMax[b], refs[i].bmin, refs[i].bmax);
+        }
+
+        // sweep from the right, then evaluate each split from the left
+        float rightArea[SAH_BINS];
+        unsigned int rightCount[SAH_BINS];
+        Vector<3,float> rmin, rmax;
+        unsigned int rn = 0;
+        for (unsigned int b=SAH_BINS;b-- > 1;) {
+            if (count[b]) {
+                if (rn == 0) {
+                    rmin = binMin[b];
+                    rmax = binMax[b];
+                } else
+                    Grow(rmin, rmax, binMin[b], binMax[b]);
+                rn += count[b];
+            }
+            rightCount[b] = rn;
+            rightArea[b] = rn ? Area(rmin, rmax) : 0;
+        }
+        Vector<3,float> lmin, lmax;
+        unsigned int ln = 0;
+        for (unsigned int b=0;b+1<SAH_BINS;b++) {
+            if (count[b]) {
+                if (ln == 0) {
+                    lmin = binMin[b];
+                    lmax = binMax[b];
+                } else
+                    Grow(lmin, lmax, binMin[b], binMax[b]);
+                ln += count[b];
+            }
+            if (ln == 0 || rightCount[b+1] == 0)
+                continue;
+            float c = ln * Area(lmin, lmax) + rightCount[b+1] * rightArea[b+1];
+            if (c < bestCost) {
+                bestCost = c;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    if (bestAxis < 0 && n <= MAX_LEAF_SIZE)
+        return 0;
+
+    // without a useful split the list is halved to bound the leaf size
+    if (bestAxis < 0)
+        return n/2;
+
+    float extent = cmax[bestAxis] - cmin[bestAxis];
+    unsigned int i = 0, j = n;
+    while (i < j) {
+        unsigned int b = min(SAH_BINS - 1, (unsigned int)
+                             ((refs[i].center[bestAxis] - cmin[bestAxis]) / extent * SAH_BINS));
+        if (b <= bestBin)
+            i++;
+        else
+            swap(refs[i], refs[--j]);
+    }
+    return i;
+}
+
+unsigned int BVH::BuildNode(vector<Node>& out, Ref* refs, const unsigned int* codes,
+                            unsigned int first, unsigned int last,
+                            unsigned int depth) {
+    unsigned int idx = out.size();
+    out.push_back(Node());
+
+    Vector<3,float> bmin, bmax;
+    Bounds(refs + first, last - first, bmin, bmax);
+    out[idx].bmin = bmin;
+    out[idx].bmax = bmax;
+    out[idx].start = first;
+    out[idx].count = last - first;
+
+    unsigned int split = codes
+        ? MortonSplit(codes + first, last - first)
+        : Split(refs + first, last - first, bmin, bmax, depth);
+    if (split == 0)
+        return idx;
+
+    BuildNode(out, refs, codes, first, first + split, depth+1);
+    unsigned int right = BuildNode(out, refs, codes, first + split, last, depth+1);
+    out[idx].start = right;
+    out[idx].count = 0;
+    return idx;
+}
+
+// Like BuildNode, but leaves ranges of at most grain objects to tasks.
+unsigned int BVH::BuildTop(vector<Node>& out, Ref* refs, const unsigned int* codes,
+                           unsigned int first, unsigned int last,
+                           unsigned int depth, unsigned int grain,
+                           vector<Task>& tasks) {
+    unsigned int idx = out.size();
+    out.push_back(Node());
+
+    unsigned int split = 0;
+    if (last - first > grain) {
+        Vector<3,float> bmin, bmax;
+        Bounds(refs + first, last - first, bmin, bmax);
+        out[idx].bmin = bmin;
+        out[idx].bmax = bmax;
+        split = codes
+            ? MortonSplit(codes + first, last - first)
+            : Split(refs + first, last - first, bmin, bmax, depth);
+    }
+    if (split == 0) {
+        Task t;
+        t.first = first;
+        t.last = last;
+        t.depth = depth;
+        out[idx].start = tasks.size();
+        out[idx].count = TASK;
+        tasks.push_back(t);
+        return idx;
+    }
+
+    BuildTop(out, refs, codes, first, first + split, depth+1, grain, tasks);
+    unsigned int right = BuildTop(out, refs, codes, first + split, last, depth+1, grain, tasks);
+    out[idx].start = right;
+    out[idx].count = 0;
+    return idx;
+}
+
+// Copies the top of the tree depth first into nodes, with the task
+// subtrees in place of their markers.
+void BVH::Splice(const vector<Node>& top, unsigned int i, const vector<Task>& tasks) {
+    const Node& n = top[i];
+    if (n.count == TASK) {
+        const vector<Node>& sub = tasks[n.start].nodes;
+        unsigned int offset = nodes.size();
+        for (unsigned int k=0;k<sub.size();k++) {
+            nodes.push_back(sub[k]);
+            if (!sub[k].count)
+                nodes.back().start += offset;
+        }
+        return;
+    }
+    unsigned int idx = nodes.size();
+    nodes.push_back(n);
+    Splice(top, i + 1, tasks);
+    unsigned int right = nodes.size();
+    Splice(top, n.start, tasks);
+    nodes[idx].start = right;
+}
+
+void BVH::Refit(const vector<Object>& objects) {
+    // children always come after their parent
+    for (unsigned int i=nodes.size();i-- > 0;) {
+        Node& node = nodes[i];
+        if (node.count) {
+            const Object& o = objects[prims[node.start]];
+            node.bmin = o.bmin;
+            node.bmax = o.bmax;
+            for (unsigned int k=1;k<node.count;k++) {
+                const Object& ok = objects[prims[node.start + k]];
+                Grow(node.bmin, node.bmax, ok.bmin, ok.bmax);
+            }
+        } else {
+            const Node& l = nodes[i+1];
+            const Node& r = nodes[node.start];
+            node.bmin = l.bmin;
+            node.bmax = l.bmax;
+            Grow(node.bmin, node.bmax, r.bmin, r.bmax);
+        }
+    }
+    cost = SAHCost();
+    wide.Refit(*this);
+}
+
+float BVH::SAHCost() const {
+    if (nodes.empty())
+        return 0;
+    float rootArea = Area(nodes[0].bmin, nodes[0].bmax);
+    if (rootArea <= 0)
+        return prims.size();
+
+    // one unit per box test, one per primitive test
+    float c = 0;
+    for (unsigned int i=0;i<nodes.size();i++) {
+        const Node& node = nodes[i];
+        float a = Area(node.bmin, node.bmax) / rootArea;
+        c += a * (node.count ? node.count : 1);
+    }
+    return c;
+}
+
+bool BVH::HitsBox(const Ray& r, const Vector<3,float>& invDir,
+                  const Vector<3,float>& bmin, const Vector<3,float>& bmax,
+                  float maxT) {
+    float t0 = 0, t1 = maxT;
+    for (unsigned int i=0;i<3;i++) {
+        float tNear = (bmin[i] - r.origin[i]) * invDir[i];
+        float tFar = (bmax[i] - r.origin[i]) * invDir[i];
+        if (tNear > tFar)
+            swap(tNear, tFar);
+        t0 = max(t0, tNear);
+        t1 = min(t1, tFar);
+        if (t0 > t1)
+            return false;
+    }
+    return true;
+}
+
+void BVHUpdater::Builder::Run() {
+    result.Build(objects, method);
+
+    updater->builderLock.Lock();
+    done = true;
+    updater->builderLock.Unlock();
+}
+
+BVHUpdater::BVHUpdater()
+    : builder(NULL)
+    , builderStale(false)
+    , lazy(NULL)
+    , rebuildFactor(1.5)
+    , lazyThreshold(100000)
+    , method(BVH::SAH)
+    , threads(1)
+    , refits(0)
+    , rebuilds(0)
+    , backgroundRebuilds(0)
+    , lazyBuilds(0)
+    , adoptions(0) {}
+
+BVHUpdater::~BVHUpdater() {
+    if (builder) {
+        builder->Wait();
+        delete builder;
+    }
+    delete lazy;
+}
+
+bool BVHUpdater::BuilderDone() {
+    builderLock.Lock();
+    bool done = builder->done;
+    builderLock.Unlock();
+    return done;
+}
+
+bool BVHUpdater::SwapBuilder() {
+    if (!builder || !BuilderDone())
+        return false;
+    builder->Wait();
+    bool swap = !builderStale;
+    if (swap) {
+        bvh = builder->result;
+        delete lazy;
+        lazy = NULL;
+        backgroundRebuilds++;
+    }
+    delete builder;
+    builder = NULL;
+    return swap;
+}
+
+void BVHUpdater::StartBuilder(const vector<SceneSnapshot::Object>& objects) {
+    builder = new Builder(this);
+    builder->objects = objects;
+    builder->method = method;
+    builderStale = false;
+    builder->Start();
+}
+
+void BVHUpdater::Adopt(const BVHUpdater& other) {
+    bvh = other.bvh;
+    delete lazy;
+    lazy = NULL;
+    // a build still running is for objects from before
+    builderStale = true;
+    adoptions++;
+}
+
+void BVHUpdater::Poll(const vector<SceneSnapshot::Object>& objects) {
+    if (SwapBuilder())
+        bvh.Refit(objects);
+    // a stale tree was dropped, the lazy one must not stay for good
+    if (!builder && lazy)
+        StartBuilder(objects);
+}
+
+void BVHUpdater::Update(const vector<SceneSnapshot::Object>& objects, bool topologyChanged) {
+    if (topologyChanged && objects.size() >= lazyThreshold) {
+        // the first frames only split what they look at
+        if (!lazy)
+            lazy = new LazyBVH();
+        lazy->Build(objects);
+        bvh = BVH();
+        builderStale = true;
+        lazyBuilds++;
+    } else if (topologyChanged) {
+        bvh.Build(objects, method, threads);
+        delete lazy;
+        lazy = NULL;
+        builderStale = true;
+        rebuilds++;
+    }
+
+    SwapBuilder();
+
+    if (!topologyChanged) {
+        // a swapped in tree was built from older bounds, so it is
+        // refitted as well
+        if (lazy)
+            lazy->Refit(objects);
+        else
+            bvh.Refit(objects);
+        refits++;
+    }
+
+    if (!builder && (lazy || bvh.cost > bvh.buildCost * rebuildFactor))
+        StartBuilder(objects);
+}
@@ -0,0 +1,188 @@
+#ifndef _RT_BVH_H_
+#define _RT_BVH_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Ray.h>
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Utils/Timer.h>
+#include <vector>
+
+#include "SceneSnapshot.h"
+#include "WideBVH.h"
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Utils;
+
+using namespace std;
+
+/**
+ * Bounding volume hierarchy over the bounded objects of a snapshot,
+ * built with the binned surface area heuristic, or as an LBVH for
+ * speed. Objects without bounds (planes) are kept in a list every ray
+ * has to test.
+ *
+ * Builds run on several threads: the top of the tree is split on the
+ * calling thread until there are plenty of subtrees, which are then
+ * built as tasks side by side and spliced in.
+ *
+ * Nodes are stored depth first: the left child of an inner node is
+ * the next node and start is the right child. Leaves refer to
+ * prims[start .. start+count).
+ *
+ * The binary tree is what is built and refitted; rays traverse the
+ * compressed 8-wide copy in wide, which both keep up to date.
+ */
+class BVH {
+public:
+    typedef SceneSnapshot::Object Object;
+
+    // enough for any tree Build() makes
+    static const unsigned int STACK_SIZE = 96;
+
+    // Top down binned SAH, or objects sorted along a Morton curve
+    // through their centers and split where the codes differ first
+    // (LBVH): much faster to build, but traced slower.
+    enum Method { SAH, LBVH };
+
+    struct Node {
+        Vector<3,float> bmin;
+        Vector<3,float> bmax;
+        unsigned int start;
+        unsigned int count;  // 0 for inner nodes
+    };
+
+    vector<Node> nodes;
+    vector<unsigned int> prims;      // object indices
+    vector<unsigned int> unbounded;  // object indices
+    WideBVH wide;
+
+    // SAH cost right after the last build and after the last refit
+    float buildCost;
+    float cost;
+
+    // how the last build went
+    Method method;
+    unsigned int buildThreads;
+    float buildTime;  // seconds
+
+    BVH();
+
+    void Build(const vector<Object>& objects, Method method = SAH,
+               unsigned int threads = 1);
+
+    // Moves the node bounds along with the objects, bottom up. The
+    // tree must have been built from the same objects in the same
+    // order.
+    void Refit(const vector<Object>& objects);
+
+    float SAHCost() const;
+
+    static bool HitsBox(const Ray& r, const Vector<3,float>& invDir,
+                        const Vector<3,float>& bmin, const Vector<3,float>& bmax,
+                        float maxT);
+
+    struct Ref {
+        unsigned int object;
+        Vector<3,float> bmin;
+        Vector<3,float> bmax;
+        Vector<3,float> center;
+    };
+
+    static void Bounds(const Ref* refs, unsigned int n,
+                       Vector<3,float>& bmin, Vector<3,float>& bmax);
+
+    // Picks a binned SAH split of refs inside the box bmin..bmax and
+    // partitions them around it. Returns how many go left, 0 if they
+    // are best kept as one leaf.
+    static unsigned int Split(Ref* refs, unsigned int n,
+                              const Vector<3,float>& bmin, const Vector<3,float>& bmax,
+                              unsigned int depth);
+
+private:
+    struct Task;
+    class Worker;
+
+    // where a task's subtree goes in the top of the tree
+    static const unsigned int TASK = 0xffffffff;
+
+    // codes are the refs' Morton codes for an LBVH, NULL for SAH
+    static unsigned int BuildNode(vector<Node>& out, Ref* refs, const unsigned int* codes,
+                                  unsigned int first, unsigned int last,
+                                  unsigned int depth);
+    static unsigned int BuildTop(vector<Node>& out, Ref* refs, const unsigned int* codes,
+                                 unsigned int first, unsigned int last,
+                                 unsigned int depth, unsigned int grain,
+                                 vector<Task>& tasks);
+    void Splice(const vector<Node>& top, unsigned int i, const vector<Task>& tasks);
+    static void SortMorton(vector<Ref>& refs, vector<unsigned int>& codes);
+    static unsigned int MortonSplit(const unsigned int* codes, unsigned int n);
+};
+
+class LazyBVH;
+
+/**
+ * Keeps a BVH up to date with the scene. Moved objects only refit the
+ * tree; once refitting has degraded its SAH cost past rebuildFactor
+ * times the cost it was built with, a fresh tree is built on a
+ * background thread and swapped in when ready. Added or removed
+ * objects rebuild at once, unless there are lazyThreshold or more of
+ * them: then rays use a LazyBVH until the full tree is built in the
+ * background, and bvh is empty meanwhile.
+ */
+class BVHUpdater {
+    class Builder : public Thread {
+        BVHUpdater* updater;
+    public:
+        vector<SceneSnapshot::Object> objects;
+        BVH::Method method;
+        BVH result;
+        bool done;
+
+        Builder(BVHUpdater* updater) : updater(updater), method(BVH::SAH), done(false) {}
+        void Run();
+    };
+
+    Builder* builder;
+    bool builderStale;  // objects were added or removed since it started
+    Mutex builderLock;
+
+    bool BuilderDone();
+    bool SwapBuilder();
+    void StartBuilder(const vector<SceneSnapshot::Object>& objects);
+
+public:
+    BVH bvh;
+    LazyBVH* lazy;  // NULL once bvh is complete
+
+    float rebuildFactor;
+    unsigned int lazyThreshold;
+
+    // for rebuilds on the spot, background ones use a single thread
+    BVH::Method method;
+    unsigned int threads;
+
+    // totals, for the frame log
+    unsigned int refits;
+    unsigned int rebuilds;
+    unsigned int backgroundRebuilds;
+    unsigned int lazyBuilds;
+    unsigned int adoptions;
+
+    BVHUpdater();
+    ~BVHUpdater();
+
+    void Update(const vector<SceneSnapshot::Object>& objects, bool topologyChanged);
+
+    // takes a copy of another updater's complete tree, for the same
+    // objects, instead of building it again
+    void Adopt(const BVHUpdater& other);
+
+    // swaps in a finished background tree when nothing moved, and
+    // starts another while rays still use a LazyBVH
+    void Poll(const vector<SceneSnapshot::Object>& objects);
+};
+
+#endif
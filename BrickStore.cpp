@@ -0,0 +1,638 @@
+#include "BrickStore.h"
+#include "Intersect.h"
+
+#include <Logging/Logger.h>
+#include <algorithm>
+#include <cstring>
+#include <sys/types.h>
+
+static const char MAGIC[8] = {'R','T','B','R','I','C','K','S'};
+static const unsigned int VERSION = 1;
+
+// The header after the magic is the version, the sphere size, the
+// number of materials and of bricks, then the directory offset. The
+// last two are filled in by Writer::Close().
+static const long long BRICKS_AT = sizeof(MAGIC) + 3 * sizeof(unsigned int);
+
+struct MaterialRecord {
+    float diffuse[4];
+    float specular[4];
+    float shininess;
+    float reflection;
+    float refraction;
+    unsigned int kind;
+};
+
+// what the calling thread missed, and whether it waits for the disk
+static __thread bool missed = false;
+static __thread bool blocking = false;
+
+BrickStore::Writer::Writer() : file(NULL) {}
+
+BrickStore::Writer::~Writer() {
+    if (file)
+        Close();
+}
+
+bool BrickStore::Writer::Open(string filename, const vector<ShadeMaterial>& materials) {
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        logger.error << "Could not open brick file " << filename << logger.end;
+        return false;
+    }
+    directory.clear();
+    unsigned int header[4] = { VERSION, sizeof(Sphere), (unsigned int)materials.size(), 0 };
+    long long dir = 0;
+    fwrite(MAGIC, 1, sizeof(MAGIC), file);
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&dir, sizeof(dir), 1, file);
+    for (unsigned int i=0;i<materials.size();i++) {
+        const ShadeMaterial& m = materials[i];
+        MaterialRecord rec;
+        for (unsigned int k=0;k<4;k++) {
+            rec.diffuse[k] = m.diffuse[k];
+            rec.specular[k] = m.specular[k];
+        }
+        rec.shininess = m.shininess;
+        rec.reflection = m.reflection;
+        rec.refraction = m.refraction;
+        rec.kind = m.kind;
+        fwrite(&rec, sizeof(rec), 1, file);
+    }
+    return true;
+}
+
+bool BrickStore::Writer::Add(const vector<Sphere>& spheres) {
+    if (spheres.empty())
+        return true;
+    if (spheres.size() > BRICK_SIZE || directory.size() == MAX_BRICKS) {
+        logger.error << "Brick of " << spheres.size() << " spheres does not fit"
+                     << logger.end;
+        return false;
+    }
+    DirEntry e;
+    for (unsigned int a=0;a<3;a++) {
+        e.bmin[a] = spheres[0].center[a] - spheres[0].radius;
+        e.bmax[a] = spheres[0].center[a] + spheres[0].radius;
+    }
+    for (unsigned int i=1;i<spheres.size();i++) {
+        const Sphere& s = spheres[i];
+        for (unsigned int a=0;a<3;a++) {
+            e.bmin[a] = min(e.bmin[a], s.center[a] - s.radius);
+            e.bmax[a] = max(e.bmax[a], s.center[a] + s.radius);
+        }
+    }
+    e.count = spheres.size();
+    e.pad = 0;
+    e.offset = ftello(file);
+    directory.push_back(e);
+    return fwrite(&spheres[0], sizeof(Sphere), spheres.size(), file) == spheres.size();
+}
+
+bool BrickStore::Writer::Close() {
+    long long dir = ftello(file);
+    unsigned int bricks = directory.size();
+    bool ok = directory.empty() ||
+        fwrite(&directory[0], sizeof(DirEntry), bricks, file) == bricks;
+    ok = ok && fseeko(file, BRICKS_AT, SEEK_SET) == 0 &&
+        fwrite(&bricks, sizeof(bricks), 1, file) == 1 &&
+        fwrite(&dir, sizeof(dir), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+    if (!ok)
+        logger.error << "Could not write brick file" << logger.end;
+    return ok;
+}
+
+BrickStore::BrickStore()
+    : file(NULL), queueHead(0), queued(0),
+      resident(0), reserved(0), pass(0), loads(0), passLoads(0),
+      evictions(0), run(false), budget(256ul << 20) {}
+
+BrickStore::~BrickStore() {
+    if (file)
+        Close();
+}
+
+bool BrickStore::Open(string name) {
+    FILE* f = fopen(name.c_str(), "rb");
+    if (!f) {
+        logger.error << "Could not open brick file " << name << logger.end;
+        return false;
+    }
+
+    char magic[8];
+    unsigned int header[4];
+    long long dir;
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1 ||
+        fread(&dir, sizeof(dir), 1, f) != 1 ||
+        header[0] != VERSION || header[1] != sizeof(Sphere) ||
+        header[2] == 0 || header[3] > MAX_BRICKS) {
+        logger.error << name << " is not a brick file" << logger.end;
+        fclose(f);
+        return false;
+    }
+
+    vector<ShadeMaterial> mats(header[2]);
+    for (unsigned int i=0;i<mats.size();i++) {
+        MaterialRecord rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            logger.error << "Could not read the materials of " << name << logger.end;
+            fclose(f);
+            return false;
+        }
+        ShadeMaterial& m = mats[i];
+        m.diffuse = Vector<4,float>(rec.diffuse[0], rec.diffuse[1],
+                                    rec.diffuse[2], rec.diffuse[3]);
+        m.specular = Vector<4,float>(rec.specular[0], rec.specular[1],
+                                     rec.specular[2], rec.specular[3]);
+        m.shininess = rec.shininess;
+        m.reflection = rec.reflection;
+        m.refraction = rec.refraction;
+        m.kind = rec.kind % ShadeMaterial::KINDS;
+    }
+
+    vector<DirEntry> entries(header[3]);
+    if (fseeko(f, dir, SEEK_SET) != 0 ||
+        (!entries.empty() &&
+         fread(&entries[0], sizeof(DirEntry), entries.size(), f) != entries.size())) {
+        logger.error << "Could not read the brick directory of " << name << logger.end;
+        fclose(f);
+        return false;
+    }
+
+    if (file)
+        Close();
+    file = f;
+    filename = name;
+    materials = mats;
+
+    // the top tree is a BVH over objects that are just the brick boxes
+    bricks.resize(entries.size());
+    vector<Object> boxes(entries.size());
+    unsigned long spheres = 0;
+    for (unsigned int i=0;i<entries.size();i++) {
+        const DirEntry& e = entries[i];
+        Brick& b = bricks[i];
+        b.bmin = Vector<3,float>(e.bmin[0], e.bmin[1], e.bmin[2]);
+        b.bmax = Vector<3,float>(e.bmax[0], e.bmax[1], e.bmax[2]);
+        b.offset = e.offset;
+        b.count = e.count < BRICK_SIZE ? e.count : BRICK_SIZE;
+        b.state = ABSENT;
+        b.lastUse = 0;
+        b.data = NULL;
+        spheres += b.count;
+
+        Object& o = boxes[i];
+        o.source = o.shape = NULL;
+        o.bounded = true;
+        o.bmin = b.bmin;
+        o.bmax = b.bmax;
+        o.kind = Object::OTHER;
+        o.radius = 0;
+    }
+    top.Build(boxes);
+
+    resident = reserved = 0;
+    pass = loads = passLoads = evictions = 0;
+    queue.assign(bricks.size(), 0);
+    queueHead = queued = 0;
+    logger.info << "Bricks: " << name << " holds " << spheres << " spheres in "
+                << bricks.size() << " bricks" << logger.end;
+
+    run = true;
+    Start();
+    return true;
+}
+
+void BrickStore::Close() {
+    lock.Lock();
+    run = false;
+    lock.Unlock();
+    Wait();
+
+    for (unsigned int i=0;i<bricks.size();i++)
+        delete bricks[i].data;
+    bricks.clear();
+    top = BVH();
+    queue.clear();
+    queueHead = queued = 0;
+    fclose(file);
+    file = NULL;
+}
+
+// An upper bound on what Read() allocates for a brick, so the loader
+// can tell whether it fits before reading it.
+unsigned long BrickStore::Footprint(unsigned int count) {
+    unsigned long n = count;
+    return sizeof(Resident) +
+        n * (sizeof(Object) + sizeof(unsigned int)) +
+        2 * n * (sizeof(BVH::Node) + sizeof(unsigned int)) +
+        2 * n * (sizeof(WideBVH::Node) + sizeof(WideBVH::Source) + sizeof(unsigned int));
+}
+
+const BrickStore::Resident* BrickStore::Get(unsigned int b) {
+    Brick& k = bricks[b];
+    if (__atomic_load_n(&k.state, __ATOMIC_ACQUIRE) != RESIDENT) {
+        if (!blocking) {
+            Request(b);
+            return NULL;
+        }
+        LoadNow(b);
+    }
+    __atomic_store_n(&k.lastUse, __atomic_load_n(&pass, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    return k.data;
+}
+
+void BrickStore::Request(unsigned int b) {
+    Brick& k = bricks[b];
+    if (__atomic_load_n(&k.state, __ATOMIC_RELAXED) != ABSENT)
+        return;
+    lock.Lock();
+    if (k.state == ABSENT) {
+        __atomic_store_n(&k.state, (unsigned char)QUEUED, __ATOMIC_RELAXED);
+        queue[(queueHead + queued++) % queue.size()] = b;
+    }
+    lock.Unlock();
+}
+
+// The i'th oldest request. Called with the lock held.
+unsigned int BrickStore::Queued(unsigned int i) const {
+    return queue[(queueHead + i) % queue.size()];
+}
+
+// Takes a request out of the queue, keeping the order of the others.
+// Called with the lock held.
+void BrickStore::Unqueue(unsigned int b) {
+    unsigned int i = 0;
+    while (i < queued && Queued(i) != b)
+        i++;
+    if (i == queued)
+        return;
+    for (;i+1<queued;i++)
+        queue[(queueHead + i) % queue.size()] = Queued(i + 1);
+    queued--;
+}
+
+BrickStore::Resident* BrickStore::Read(unsigned int b) {
+    const Brick& k = bricks[b];
+    vector<Sphere> spheres(k.count);
+    fileLock.Lock();
+    bool ok = k.count == 0 ||
+        (fseeko(file, k.offset, SEEK_SET) == 0 &&
+         fread(&spheres[0], sizeof(Sphere), k.count, file) == k.count);
+    fileLock.Unlock();
+
+    // an unreadable brick is loaded empty, so rays stop asking for it
+    Resident* res = new Resident();
+    if (!ok) {
+        logger.error << "Could not read brick " << b << " of " << filename << logger.end;
+        spheres.clear();
+    }
+    res->objects.resize(spheres.size());
+    res->materials.resize(spheres.size());
+    for (unsigned int i=0;i<spheres.size();i++) {
+        const Sphere& s = spheres[i];
+        Object& o = res->objects[i];
+        o.source = o.shape = NULL;
+        o.bounded = true;
+        o.kind = Object::SPHERE;
+        o.point = Vector<3,float>(s.center[0], s.center[1], s.center[2]);
+        o.radius = s.radius;
+        o.bmin = o.point - Vector<3,float>(s.radius);
+        o.bmax = o.point + Vector<3,float>(s.radius);
+        res->materials[i] = s.material < materials.size() ? s.material : 0;
+    }
+    res->bvh.Build(res->objects);
+
+    const BVH& t = res->bvh;
+    res->bytes = sizeof(Resident) +
+        res->objects.capacity() * sizeof(Object) +
+        res->materials.capacity() * sizeof(unsigned int) +
+        t.nodes.capacity() * sizeof(BVH::Node) +
+        t.prims.capacity() * sizeof(unsigned int) +
+        t.wide.nodes.capacity() * sizeof(WideBVH::Node) +
+        t.wide.prims.capacity() * sizeof(unsigned int) +
+        t.wide.sources.capacity() * sizeof(WideBVH::Source);
+    return res;
+}
+
+void BrickStore::Publish(unsigned int b, Resident* data) {
+    Brick& k = bricks[b];
+    lock.Lock();
+    reserved -= Footprint(k.count);
+    resident += data->bytes;
+    k.data = data;
+    __atomic_store_n(&k.state, (unsigned char)RESIDENT, __ATOMIC_RELEASE);
+    loads++;
+    lock.Unlock();
+}
+
+static bool UsedBefore(const pair<unsigned int, unsigned int>& a,
+                       const pair<unsigned int, unsigned int>& b) {
+    return a.first < b.first;
+}
+
+// Drops the least recently used bricks until need more bytes fit in
+// the budget. Called with the lock held, while no thread traverses
+// the bricks.
+bool BrickStore::Evict(unsigned long need) {
+    if (resident + reserved + need <= budget)
+        return true;
+    vector<pair<unsigned int, unsigned int> > lru;
+    for (unsigned int i=0;i<bricks.size();i++)
+        if (bricks[i].state == RESIDENT)
+            lru.push_back(make_pair(bricks[i].lastUse, i));
+    sort(lru.begin(), lru.end(), UsedBefore);
+    for (unsigned int i=0;i<lru.size() && resident + reserved + need > budget;i++) {
+        Brick& k = bricks[lru[i].second];
+        __atomic_store_n(&k.state, (unsigned char)ABSENT, __ATOMIC_RELAXED);
+        resident -= k.data->bytes;
+        delete k.data;
+        k.data = NULL;
+        evictions++;
+    }
+    return resident + reserved + need <= budget;
+}
+
+// Loads a brick on the calling thread, making room for it first.
+void BrickStore::LoadNow(unsigned int b) {
+    Brick& k = bricks[b];
+    lock.Lock();
+    __atomic_fetch_add(&pass, 1, __ATOMIC_RELAXED);
+    if (k.state == LOADING) {
+        // the loader has it
+        lock.Unlock();
+        while (__atomic_load_n(&k.state, __ATOMIC_ACQUIRE) != RESIDENT)
+            Thread::Sleep(100);
+        return;
+    }
+    if (k.state == RESIDENT) {
+        lock.Unlock();
+        return;
+    }
+    if (k.state == QUEUED)
+        Unqueue(b);
+    __atomic_store_n(&k.state, (unsigned char)LOADING, __ATOMIC_RELAXED);
+    unsigned long need = Footprint(k.count);
+    Evict(need);
+    reserved += need;
+    lock.Unlock();
+
+    Publish(b, Read(b));
+}
+
+void BrickStore::NearestIn(const Resident& res, unsigned int b, const Ray& r,
+                           const Vector<3,float>& invDir, Hit side,
+                           float& nearestT, unsigned int& nearestId) {
+    const WideBVH& wide = res.bvh.wide;
+    if (wide.nodes.empty())
+        return;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    stack[sp].index = 0;
+    stack[sp].count = 0;
+    stack[sp++].t = 0;
+    while (sp) {
+        const WideBVH::Entry e = stack[--sp];
+        if (e.t >= nearestT)
+            continue;
+        if (e.count) {
+            for (unsigned int k=0;k<e.count;k++) {
+                unsigned int i = wide.prims[e.index + k];
+                float t;
+                if (IntersectObject(res.objects[i], r, side, nearestT, t)) {
+                    nearestT = t;
+                    nearestId = ID | b << BRICK_BITS | i;
+                }
+            }
+            continue;
+        }
+        float t[WideBVH::WIDTH];
+        unsigned int hits = WideBVH::HitChildren(wide.nodes[e.index], r, invDir, nearestT, t);
+        sp = WideBVH::Push(wide.nodes[e.index], hits, t, stack, sp);
+    }
+}
+
+bool BrickStore::OccludedIn(const Resident& res, const Ray& r,
+                            const Vector<3,float>& invDir, float maxT) {
+    const WideBVH& wide = res.bvh.wide;
+    if (wide.nodes.empty())
+        return false;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    stack[sp].index = 0;
+    stack[sp].count = 0;
+    stack[sp++].t = 0;
+    while (sp) {
+        const WideBVH::Entry e = stack[--sp];
+        if (e.count) {
+            for (unsigned int k=0;k<e.count;k++) {
+                float t;
+                if (IntersectObject(res.objects[wide.prims[e.index + k]], r, HIT_OUT, maxT, t))
+                    return true;
+            }
+            continue;
+        }
+        float t[WideBVH::WIDTH];
+        unsigned int hits = WideBVH::HitChildren(wide.nodes[e.index], r, invDir, maxT, t);
+        sp = WideBVH::Push(wide.nodes[e.index], hits, t, stack, sp);
+    }
+    return false;
+}
+
+void BrickStore::Nearest(const Ray& r, const Vector<3,float>& invDir, Hit side,
+                         float& nearestT, unsigned int& nearestId) {
+    const WideBVH& wide = top.wide;
+    if (wide.nodes.empty())
+        return;
+
+    // a brick that was not there only matters if the ray enters it
+    // before the hit it found
+    float missT = nearestT;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    stack[sp].index = 0;
+    stack[sp].count = 0;
+    stack[sp++].t = 0;
+    while (sp) {
+        const WideBVH::Entry e = stack[--sp];
+        if (e.t >= nearestT)
+            continue;
+        if (e.count) {
+            for (unsigned int k=0;k<e.count;k++) {
+                unsigned int b = wide.prims[e.index + k];
+                if (!BVH::HitsBox(r, invDir, bricks[b].bmin, bricks[b].bmax, nearestT))
+                    continue;
+                const Resident* res = Get(b);
+                if (res)
+                    NearestIn(*res, b, r, invDir, side, nearestT, nearestId);
+                else
+                    missT = min(missT, e.t);
+            }
+            continue;
+        }
+        float t[WideBVH::WIDTH];
+        unsigned int hits = WideBVH::HitChildren(wide.nodes[e.index], r, invDir, nearestT, t);
+        sp = WideBVH::Push(wide.nodes[e.index], hits, t, stack, sp);
+    }
+    if (missT < nearestT)
+        missed = true;
+}
+
+bool BrickStore::Occluded(const Ray& r, const Vector<3,float>& invDir, float maxT) {
+    const WideBVH& wide = top.wide;
+    if (wide.nodes.empty())
+        return false;
+
+    bool miss = false;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    stack[sp].index = 0;
+    stack[sp].count = 0;
+    stack[sp++].t = 0;
+    while (sp) {
+        const WideBVH::Entry e = stack[--sp];
+        if (e.count) {
+            for (unsigned int k=0;k<e.count;k++) {
+                unsigned int b = wide.prims[e.index + k];
+                if (!BVH::HitsBox(r, invDir, bricks[b].bmin, bricks[b].bmax, maxT))
+                    continue;
+                const Resident* res = Get(b);
+                if (!res)
+                    miss = true;
+                else if (OccludedIn(*res, r, invDir, maxT))
+                    return true;
+            }
+            continue;
+        }
+        float t[WideBVH::WIDTH];
+        unsigned int hits = WideBVH::HitChildren(wide.nodes[e.index], r, invDir, maxT, t);
+        sp = WideBVH::Push(wide.nodes[e.index], hits, t, stack, sp);
+    }
+    missed = missed || miss;
+    return false;
+}
+
+Vector<3,float> BrickStore::NormalAt(unsigned int id, Vector<3,float> p) {
+    const Resident* res = Get((id & ~ID) >> BRICK_BITS);
+    if (!res) {
+        missed = true;
+        return Vector<3,float>(0,1,0);
+    }
+    return (p - res->objects[id & (BRICK_SIZE - 1)].point).GetNormalize();
+}
+
+const ShadeMaterial& BrickStore::Material(unsigned int id) {
+    const Resident* res = Get((id & ~ID) >> BRICK_BITS);
+    if (!res) {
+        missed = true;
+        return materials[0];
+    }
+    return materials[res->materials[id & (BRICK_SIZE - 1)]];
+}
+
+void BrickStore::ClearMissed() {
+    missed = false;
+}
+
+bool BrickStore::Missed() {
+    return missed;
+}
+
+void BrickStore::SetBlocking(bool b) {
+    blocking = b;
+}
+
+bool BrickStore::Pending() {
+    lock.Lock();
+    bool pending = queued > 0 || reserved > 0;
+    lock.Unlock();
+    return pending;
+}
+
+unsigned int BrickStore::EndPass() {
+    lock.Lock();
+    __atomic_fetch_add(&pass, 1, __ATOMIC_RELAXED);
+    unsigned long need = 0;
+    for (unsigned int i=0;i<queued;i++)
+        need += Footprint(bricks[Queued(i)].count);
+    Evict(min(need, budget));
+    lock.Unlock();
+
+    // until the loader is idle, or waits for room
+    for (;;) {
+        lock.Lock();
+        bool busy = reserved > 0 ||
+            (queued > 0 &&
+             (resident + Footprint(bricks[Queued(0)].count) <= budget || resident == 0));
+        unsigned int n = loads - passLoads;
+        if (!busy)
+            passLoads = loads;
+        lock.Unlock();
+        if (!busy)
+            return n;
+        Thread::Sleep(1000);
+    }
+}
+
+void BrickStore::SetBudget(unsigned long bytes) {
+    lock.Lock();
+    budget = bytes;
+    lock.Unlock();
+}
+
+unsigned long BrickStore::ResidentBytes() {
+    lock.Lock();
+    unsigned long n = resident;
+    lock.Unlock();
+    return n;
+}
+
+unsigned int BrickStore::Loads() {
+    lock.Lock();
+    unsigned int n = loads;
+    lock.Unlock();
+    return n;
+}
+
+unsigned int BrickStore::Evictions() {
+    lock.Lock();
+    unsigned int n = evictions;
+    lock.Unlock();
+    return n;
+}
+
+// Loads requested bricks in the order they were asked for, as long as
+// they fit in the budget. The first brick always fits.
+void BrickStore::Run() {
+    for (;;) {
+        lock.Lock();
+        if (!run) {
+            lock.Unlock();
+            return;
+        }
+        int b = -1;
+        if (queued > 0) {
+            unsigned int f = Queued(0);
+            unsigned long need = Footprint(bricks[f].count);
+            if (resident + reserved + need <= budget || resident + reserved == 0) {
+                b = f;
+                queueHead = (queueHead + 1) % queue.size();
+                queued--;
+                reserved += need;
+                __atomic_store_n(&bricks[b].state, (unsigned char)LOADING, __ATOMIC_RELAXED);
+            }
+        }
+        lock.Unlock();
+
+        if (b < 0) {
+            Thread::Sleep(1000);
+            continue;
+        }
+        Publish(b, Read(b));
+    }
+}
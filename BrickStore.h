@@ -0,0 +1,203 @@
+#ifndef _RT_BRICK_STORE_H_
+#define _RT_BRICK_STORE_H_
+
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Math/Vector.h>
+#include <Shapes/Ray.h>
+#include <Shapes/Shape.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "SceneSnapshot.h"
+#include "MaterialTable.h"
+#include "BVH.h"
+
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+
+using namespace std;
+
+/**
+ * Sphere geometry paged in from a brick file, for scenes that do not
+ * fit in memory. The file holds a material table and the spheres cut
+ * into bricks of up to BRICK_SIZE spatially close ones. Only the brick
+ * boxes and a small tree over them stay in memory; a brick's spheres
+ * and its own BVH are loaded by the loader thread when a ray needs
+ * them, and the least recently used bricks are dropped to stay within
+ * budget bytes.
+ *
+ * Traversal never waits for the disk. A ray that reaches a brick that
+ * is not resident requests it and carries on without it, and the
+ * calling thread is marked as having missed (see Missed()): whatever
+ * it traced since ClearMissed() is incomplete and must be traced
+ * again once the loader has caught up.
+ *
+ * Bricks are only dropped in EndPass(), when no thread traverses
+ * them, and by a thread in blocking mode (see SetBlocking()), which
+ * loads what it misses on the spot and must be the only one tracing.
+ *
+ * Brick spheres are identified by ids with the ID bit set, the brick
+ * index and the sphere's index in the brick, so they never collide
+ * with the indices of scene objects.
+ */
+class BrickStore : public Thread {
+public:
+    typedef SceneSnapshot::Object Object;
+
+    static const unsigned int BRICK_BITS = 12;
+    static const unsigned int BRICK_SIZE = 1 << BRICK_BITS;
+    static const unsigned int ID = 0x80000000;
+    static const unsigned int MAX_BRICKS = ID >> BRICK_BITS;
+
+    static bool IsBrick(unsigned int id) {
+        return id & ID;
+    }
+
+    // as stored in the file, host byte order
+    struct Sphere {
+        float center[3];
+        float radius;
+        unsigned int material;
+    };
+
+    // one per brick, at the end of the file
+    struct DirEntry {
+        float bmin[3];
+        float bmax[3];
+        unsigned int count;
+        unsigned int pad;
+        long long offset;
+    };
+
+    /**
+     * Writes a brick file one brick at a time, so it can be made from
+     * more spheres than fit in memory. The spheres given to Add() are
+     * one brick and should be close together.
+     */
+    class Writer {
+        FILE* file;
+        vector<DirEntry> directory;
+    public:
+        Writer();
+        ~Writer();
+        bool Open(string filename, const vector<ShadeMaterial>& materials);
+        bool Add(const vector<Sphere>& spheres);
+        bool Close();
+    };
+
+private:
+    enum State { ABSENT, QUEUED, LOADING, RESIDENT };
+
+    // a loaded brick
+    struct Resident {
+        vector<Object> objects;
+        vector<unsigned int> materials;
+        BVH bvh;
+        unsigned long bytes;
+    };
+
+    struct Brick {
+        Vector<3,float> bmin;
+        Vector<3,float> bmax;
+        long long offset;     // of its spheres in the file
+        unsigned int count;
+        unsigned char state;
+        unsigned int lastUse; // pass it was last traversed in
+        Resident* data;       // when resident
+    };
+
+    FILE* file;
+    string filename;
+    vector<Brick> bricks;
+    BVH top;  // over the brick boxes
+    vector<ShadeMaterial> materials;
+
+    Mutex lock;      // queue, states and byte counts
+    Mutex fileLock;
+
+    // Requested bricks, oldest first. A brick is queued at most once,
+    // so a ring of one entry per brick never fills up and requests
+    // from the tile loop do not allocate.
+    vector<unsigned int> queue;
+    unsigned int queueHead;
+    unsigned int queued;
+    unsigned long resident;  // bytes of resident bricks
+    unsigned long reserved;  // bytes set aside for bricks being loaded
+    unsigned int pass;
+    unsigned int loads;
+    unsigned int passLoads;  // loads at the end of the last pass
+    unsigned int evictions;
+    bool run;
+
+    static unsigned long Footprint(unsigned int count);
+    const Resident* Get(unsigned int b);
+    void Request(unsigned int b);
+    unsigned int Queued(unsigned int i) const;
+    void Unqueue(unsigned int b);
+    Resident* Read(unsigned int b);
+    void Publish(unsigned int b, Resident* data);
+    bool Evict(unsigned long need);
+    void LoadNow(unsigned int b);
+
+    void NearestIn(const Resident& res, unsigned int b, const Ray& r,
+                   const Vector<3,float>& invDir, Hit side,
+                   float& nearestT, unsigned int& nearestId);
+    bool OccludedIn(const Resident& res, const Ray& r,
+                    const Vector<3,float>& invDir, float maxT);
+
+    unsigned long budget;
+
+public:
+    BrickStore();
+    ~BrickStore();
+
+    // reads the directory of a brick file and starts the loader
+    bool Open(string filename);
+    void Close();
+    bool IsOpen() const { return file != NULL; }
+
+    unsigned int Bricks() const { return bricks.size(); }
+    unsigned long ResidentBytes();
+
+    // bytes the resident bricks may take, at least one is always kept
+    void SetBudget(unsigned long bytes);
+
+    // Nearest brick sphere hit on the given side before nearestT,
+    // which updates nearestT and nearestId.
+    void Nearest(const Ray& r, const Vector<3,float>& invDir, Hit side,
+                 float& nearestT, unsigned int& nearestId);
+
+    // any brick sphere hit before maxT
+    bool Occluded(const Ray& r, const Vector<3,float>& invDir, float maxT);
+
+    // of a hit brick sphere
+    Vector<3,float> NormalAt(unsigned int id, Vector<3,float> p);
+    const ShadeMaterial& Material(unsigned int id);
+
+    // whether the calling thread needed a brick that was not resident
+    // since its last ClearMissed()
+    static void ClearMissed();
+    static bool Missed();
+
+    // makes misses of the calling thread load the brick on the spot
+    static void SetBlocking(bool blocking);
+
+    bool Pending();
+
+    // Ends a trace pass: drops the least recently used bricks to make
+    // room for the requested ones and waits until as many of those
+    // are loaded as fit. No thread may traverse bricks meanwhile.
+    // Returns the number of bricks loaded during the pass and the wait.
+    unsigned int EndPass();
+
+    // totals, for the frame log
+    unsigned int Loads();
+    unsigned int Evictions();
+
+    void Run();
+};
+
+#endif
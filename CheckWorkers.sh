@@ -0,0 +1,55 @@
+#!/bin/sh
+# Localhost check of distributed rendering: renders a sequence on three
+# workers, kills one of them in the middle of a frame and expects every
+# frame to be written anyway, with the lost worker's tiles traced by
+# the others. Needs a build with RT_DISTRIBUTED.
+#
+#   ./CheckWorkers.sh build/RayTracer [frames]
+
+RT=${1:-./RayTracer}
+FRAMES=${2:-30}
+RT=$(cd "$(dirname "$RT")" && pwd)/$(basename "$RT")
+DIR=$(mktemp -d)
+SOCK=unix:$DIR/rt.sock
+cd "$DIR" || exit 1
+
+fail() {
+    echo "FAIL: $1 (logs in $DIR)"
+    kill $W1 $W2 $W3 $C 2>/dev/null
+    exit 1
+}
+
+# workers retry until the coordinator listens
+"$RT" --worker $SOCK > worker1.log 2>&1 & W1=$!
+"$RT" --worker $SOCK > worker2.log 2>&1 & W2=$!
+"$RT" --worker $SOCK > worker3.log 2>&1 & W3=$!
+
+"$RT" --listen $SOCK --sequence $FRAMES > coordinator.log 2>&1 & C=$!
+
+# wait for all three, then kill one as its first frame starts
+i=0
+until [ "$(grep -c 'Render worker joined' coordinator.log)" -ge 3 ]; do
+    kill -0 $C 2>/dev/null || fail "sequence ended before the workers joined, use more frames"
+    i=$((i+1))
+    [ $i -lt 300 ] || fail "workers did not join"
+    sleep 0.1
+done
+until grep -q "Cached scene" worker2.log; do
+    kill -0 $C 2>/dev/null || fail "sequence ended before worker 2 traced"
+    sleep 0.05
+done
+kill -9 $W2
+
+wait $C || fail "coordinator exited with $?"
+kill $W1 $W3 2>/dev/null
+
+grep -q "Lost a render worker" coordinator.log || fail "the killed worker was not noticed"
+n=0
+while [ $n -lt $FRAMES ]; do
+    f=$(printf "frame%04u.ppm" $n)
+    [ -s "$f" ] || fail "$f missing"
+    n=$((n+1))
+done
+
+echo "OK: $FRAMES frames with a worker lost"
+rm -rf "$DIR"
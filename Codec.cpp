@@ -0,0 +1,192 @@
+#include "Codec.h"
+
+#include <Scene/SceneNode.h>
+#include <Scene/ShapeNode.h>
+#include <Shapes/Sphere.h>
+#include <Shapes/Plane.h>
+
+#include <cstring>
+
+#include "SceneSnapshot.h"
+
+enum { SHAPE_SPHERE = 1, SHAPE_PLANE = 2 };
+
+static void PutVec3(Message& m, Vector<3,float> v) {
+    for (unsigned int i=0;i<3;i++)
+        m.PutFloat(v[i]);
+}
+
+static void PutVec4(Message& m, Vector<4,float> v) {
+    for (unsigned int i=0;i<4;i++)
+        m.PutFloat(v[i]);
+}
+
+static Vector<3,float> GetVec3(Message& m) {
+    Vector<3,float> v;
+    for (unsigned int i=0;i<3;i++)
+        v[i] = m.GetFloat();
+    return v;
+}
+
+static Vector<4,float> GetVec4(Message& m) {
+    Vector<4,float> v;
+    for (unsigned int i=0;i<4;i++)
+        v[i] = m.GetFloat();
+    return v;
+}
+
+static Shape* MakePlane(Vector<3,float> point, Vector<3,float> normal) {
+    Vector<3,float> a = (fabs(normal[0]) > 0.9f)
+        ? Vector<3,float>(0,1,0)
+        : Vector<3,float>(1,0,0);
+    Vector<3,float> t1 = (normal % a).GetNormalize();
+    Vector<3,float> t2 = normal % t1;
+
+    Shape* plane = new Shapes::Plane(point, point + t1, point + t2);
+    if (plane->NormalAt(point) * normal < 0) {
+        delete plane;
+        plane = new Shapes::Plane(point, point + t2, point + t1);
+    }
+    return plane;
+}
+
+void SceneCodec::Encode(const vector<Shape*>& shapes,
+                        const vector<RayTracer::Light>& lights,
+                        Message& m) {
+    m.PutInt(lights.size());
+    for (unsigned int i=0;i<lights.size();i++) {
+        const RayTracer::Light& l = lights[i];
+        m.PutInt(l.type);
+        PutVec3(m, l.pos);
+        PutVec4(m, l.color);
+        m.PutFloat(l.radius);
+        PutVec3(m, l.edgeU);
+        PutVec3(m, l.edgeV);
+    }
+
+    unsigned int count = 0;
+    unsigned int countPos = m.data.size();
+    m.PutInt(0);
+
+    for (unsigned int i=0;i<shapes.size();i++) {
+        Shape* s = shapes[i];
+        Shapes::Sphere* sphere = dynamic_cast<Shapes::Sphere*>(s);
+        Shapes::Plane* plane = dynamic_cast<Shapes::Plane*>(s);
+
+        if (sphere) {
+            m.PutInt(SHAPE_SPHERE);
+            PutVec3(m, sphere->center);
+            m.PutFloat(sphere->radius);
+        } else if (plane) {
+            Vector<3,float> point, normal;
+            SceneSnapshot::PlaneFrame(plane, point, normal);
+            m.PutInt(SHAPE_PLANE);
+            PutVec3(m, point);
+            PutVec3(m, normal);
+        } else {
+            logger.warning << "Shape " << s << " can not be sent to workers" << logger.end;
+            continue;
+        }
+
+        PutVec4(m, s->mat->diffuse);
+        PutVec4(m, s->mat->specular);
+        m.PutFloat(s->mat->shininess);
+        m.PutFloat(s->reflection);
+        m.PutFloat(s->refraction);
+        m.PutInt(s->transparent ? 1 : 0);
+        count++;
+    }
+
+    Message c;
+    c.PutInt(count);
+    memcpy(&m.data[countPos], &c.data[0], 4);
+}
+
+ISceneNode* SceneCodec::Decode(Message& m, vector<RayTracer::Light>& lights) {
+    lights.clear();
+    unsigned int nLights = m.GetInt();
+    for (unsigned int i=0;i<nLights && !m.bad;i++) {
+        RayTracer::Light l;
+        l.type = RayTracer::Light::Type(m.GetInt());
+        l.pos = GetVec3(m);
+        l.color = GetVec4(m);
+        l.radius = m.GetFloat();
+        l.edgeU = GetVec3(m);
+        l.edgeV = GetVec3(m);
+        lights.push_back(l);
+    }
+
+    SceneNode* root = new SceneNode();
+    unsigned int nShapes = m.GetInt();
+    for (unsigned int i=0;i<nShapes && !m.bad;i++) {
+        Shape* s;
+        unsigned int type = m.GetInt();
+        if (type == SHAPE_SPHERE) {
+            Vector<3,float> center = GetVec3(m);
+            float radius = m.GetFloat();
+            s = new Shapes::Sphere(center, radius);
+        } else if (type == SHAPE_PLANE) {
+            Vector<3,float> point = GetVec3(m);
+            Vector<3,float> normal = GetVec3(m);
+            s = MakePlane(point, normal);
+        } else {
+            m.bad = true;
+            break;
+        }
+
+        s->mat->diffuse = GetVec4(m);
+        s->mat->specular = GetVec4(m);
+        s->mat->shininess = m.GetFloat();
+        s->reflection = m.GetFloat();
+        s->refraction = m.GetFloat();
+        s->transparent = m.GetInt() != 0;
+        root->AddNode(new ShapeNode(s));
+    }
+
+    if (m.bad) {
+        logger.error << "Corrupt scene message" << logger.end;
+        delete root;
+        return NULL;
+    }
+    return root;
+}
+
+uint64_t SceneCodec::Hash(const Message& m) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned int i=0;i<m.data.size();i++) {
+        h ^= m.data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void TileCodec::Encode(const unsigned char* rgb, unsigned int pixels, Message& m) {
+    unsigned int i = 0;
+    while (i < pixels) {
+        const unsigned char* p = rgb + i*3;
+        unsigned int run = 1;
+        while (i + run < pixels && run < 255 &&
+               memcmp(p, rgb + (i+run)*3, 3) == 0)
+            run++;
+        unsigned char r = run;
+        m.PutBytes(&r, 1);
+        m.PutBytes(p, 3);
+        i += run;
+    }
+}
+
+bool TileCodec::Decode(Message& m, unsigned char* rgb, unsigned int pixels) {
+    unsigned int i = 0;
+    while (i < pixels) {
+        unsigned char run;
+        unsigned char p[3];
+        m.GetBytes(&run, 1);
+        m.GetBytes(p, 3);
+        if (m.bad || run == 0 || i + run > pixels)
+            return false;
+        for (unsigned int j=0;j<run;j++,i++)
+            memcpy(rgb + i*3, p, 3);
+    }
+    return true;
+}
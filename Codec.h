@@ -0,0 +1,31 @@
+#ifndef _RT_CODEC_H_
+#define _RT_CODEC_H_
+
+#include "RayTracer.h"
+#include "Socket.h"
+
+/**
+ * Serializes the traceable part of a scene: the shapes with their
+ * materials and the tracer's lights. Only spheres and planes are
+ * supported, other shapes are skipped with a warning.
+ */
+class SceneCodec {
+public:
+    static void Encode(const vector<Shape*>& shapes,
+                       const vector<RayTracer::Light>& lights,
+                       Message& m);
+    static ISceneNode* Decode(Message& m, vector<RayTracer::Light>& lights);
+
+    static uint64_t Hash(const Message& m);
+};
+
+/**
+ * Run length encoding of rgb tile data.
+ */
+class TileCodec {
+public:
+    static void Encode(const unsigned char* rgb, unsigned int pixels, Message& m);
+    static bool Decode(Message& m, unsigned char* rgb, unsigned int pixels);
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "Denoiser.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// B3 spline, separable
+static const float KERNEL[5] = { 1/16.0f, 1/4.0f, 3/8.0f, 1/4.0f, 1/16.0f };
+
+// luminance difference, in standard deviations of the noise around a
+// pixel, at which a tap counts 1/e
+static const float LUMINANCE_SIGMA = 4;
+static const float LUMINANCE_EPSILON = 1e-3;
+// normals are compared by their dot product to the 2^NORMAL_SQUARINGS
+static const unsigned int NORMAL_SQUARINGS = 6;
+// relative depth difference per pixel of distance that counts 1/e
+static const float DEPTH_SIGMA = 0.01;
+static const float ALBEDO_SIGMA = 0.1;
+// albedo channels below this are not divided out
+static const float ALBEDO_MIN = 0.05;
+
+static float Luminance(const Vector<3,float>& c) {
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+Denoiser::Denoiser()
+    : width(0), height(0), result(0),
+      x0(0), y0(0), x1(0), y1(0), step(1) {}
+
+void Denoiser::Resize(unsigned int w, unsigned int h) {
+    if (w == width && h == height)
+        return;
+    width = w;
+    height = h;
+    light[0].resize(w * h);
+    light[1].resize(w * h);
+    normal.resize(w * h);
+    albedo.resize(w * h);
+    depth.assign(w * h, -1);
+    variance[0].resize(w * h);
+    variance[1].resize(w * h);
+}
+
+void Denoiser::Set(unsigned int u, unsigned int v, Vector<4,float> col,
+                   Vector<3,float> n, Vector<4,float> diffuse, float d) {
+    unsigned int i = v*width + u;
+    for (unsigned int c=0;c<3;c++) {
+        float a = diffuse[c];
+        light[0][i][c] = a > ALBEDO_MIN ? col[c] / a : col[c];
+        albedo[i][c] = a;
+    }
+    float len = n.GetLength();
+    normal[i] = len > 0 ? n / len : n;
+    depth[i] = d;
+}
+
+Vector<3,float> Denoiser::Color(unsigned int u, unsigned int v) const {
+    unsigned int i = v*width + u;
+    Vector<3,float> col = light[result][i];
+    for (unsigned int c=0;c<3;c++) {
+        float a = albedo[i][c];
+        if (a > ALBEDO_MIN)
+            col[c] *= a;
+    }
+    return col;
+}
+
+void Denoiser::Filter(unsigned int x0, unsigned int y0,
+                      unsigned int x1, unsigned int y1,
+                      unsigned int iterations, unsigned int threads) {
+    this->x0 = x0;
+    this->y0 = y0;
+    this->x1 = x1;
+    this->y1 = y1;
+    result = 0;
+    step = 1;
+    RunPass(&Denoiser::EstimateRows, threads);
+    for (unsigned int it=0;it<iterations;it++) {
+        step = 1 << it;
+        RunPass(&Denoiser::FilterRows, threads);
+        result = 1 - result;
+    }
+}
+
+// the calling thread takes the first band of rows
+void Denoiser::RunPass(Pass pass, unsigned int threads) {
+    unsigned int rows = y1 - y0;
+    unsigned int n = max(1u, min(threads, rows));
+    vector<Band*> bands;
+    for (unsigned int k=1;k<n;k++) {
+        Band* b = new Band(this, pass, y0 + rows*k/n, y0 + rows*(k+1)/n);
+        b->Start();
+        bands.push_back(b);
+    }
+    (this->*pass)(y0, y0 + rows/n);
+    for (unsigned int k=0;k<bands.size();k++) {
+        bands[k]->Wait();
+        delete bands[k];
+    }
+}
+
+// how much pixel j looks like the same surface as pixel i
+float Denoiser::GuideWeight(unsigned int i, unsigned int j, float depthScale) const {
+    if (depth[j] < 0)
+        return 0;
+    float facing = normal[i] * normal[j];
+    if (facing <= 0)
+        return 0;
+    for (unsigned int k=0;k<NORMAL_SQUARINGS;k++)
+        facing *= facing;
+    Vector<3,float> da = albedo[j] - albedo[i];
+    float e = (da * da) / (ALBEDO_SIGMA * ALBEDO_SIGMA)
+        + fabs(depth[j] - depth[i]) * depthScale;
+    return facing * exp(-e);
+}
+
+// luminance variance over the neighbours on the same surface
+void Denoiser::EstimateRows(unsigned int first, unsigned int last) {
+    const Vector<3,float>* in = &light[0][0];
+    float* var = &variance[0][0];
+
+    for (unsigned int v=first;v<last;v++) {
+        for (unsigned int u=x0;u<x1;u++) {
+            unsigned int i = v*width + u;
+            if (depth[i] < 0)
+                continue;
+            float depthScale = 1 / (DEPTH_SIGMA * depth[i]);
+
+            float sum = 0, sum2 = 0, weights = 0;
+            for (int dy=-2;dy<=2;dy++) {
+                int y = v + dy;
+                if (y < (int)y0 || y >= (int)y1)
+                    continue;
+                for (int dx=-2;dx<=2;dx++) {
+                    int x = u + dx;
+                    if (x < (int)x0 || x >= (int)x1)
+                        continue;
+                    unsigned int j = y*width + x;
+                    float w = KERNEL[dx+2] * KERNEL[dy+2] * GuideWeight(i, j, depthScale);
+                    float l = Luminance(in[j]);
+                    sum += w * l;
+                    sum2 += w * l * l;
+                    weights += w;
+                }
+            }
+            float mean = weights > 0 ? sum / weights : 0;
+            var[i] = weights > 0 ? max(0.0f, sum2 / weights - mean * mean) : 0;
+        }
+    }
+}
+
+void Denoiser::FilterRows(unsigned int first, unsigned int last) {
+    const Vector<3,float>* in = &light[result][0];
+    Vector<3,float>* out = &light[1 - result][0];
+    const float* varIn = &variance[result][0];
+    float* varOut = &variance[1 - result][0];
+
+    for (unsigned int v=first;v<last;v++) {
+        for (unsigned int u=x0;u<x1;u++) {
+            unsigned int i = v*width + u;
+            float d = depth[i];
+            if (d < 0) {
+                out[i] = in[i];
+                continue;
+            }
+            float depthScale = 1 / (DEPTH_SIGMA * d * step);
+            float l = Luminance(in[i]);
+            float lumScale = 1 / (LUMINANCE_SIGMA * sqrt(varIn[i]) + LUMINANCE_EPSILON);
+
+            Vector<3,float> sum(0,0,0);
+            float var = 0, weights = 0;
+            for (int dy=-2;dy<=2;dy++) {
+                int y = v + dy * (int)step;
+                if (y < (int)y0 || y >= (int)y1)
+                    continue;
+                for (int dx=-2;dx<=2;dx++) {
+                    int x = u + dx * (int)step;
+                    if (x < (int)x0 || x >= (int)x1)
+                        continue;
+                    unsigned int j = y*width + x;
+                    float w = GuideWeight(i, j, depthScale);
+                    if (w == 0)
+                        continue;
+                    w *= KERNEL[dx+2] * KERNEL[dy+2] *
+                        exp(-fabs(Luminance(in[j]) - l) * lumScale);
+                    sum += in[j] * w;
+                    var += w * w * varIn[j];
+                    weights += w;
+                }
+            }
+            // a pixel without a normal does not even count itself
+            if (weights > 0) {
+                out[i] = sum / weights;
+                varOut[i] = var / (weights * weights);
+            } else {
+                out[i] = in[i];
+                varOut[i] = varIn[i];
+            }
+        }
+    }
+}
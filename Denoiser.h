@@ -0,0 +1,91 @@
+#ifndef _RT_DENOISER_H_
+#define _RT_DENOISER_H_
+
+#include <Core/Thread.h>
+#include <Math/Vector.h>
+#include <vector>
+
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Math;
+
+using namespace std;
+
+/**
+ * Edge avoiding a-trous filter for frames traced with few shadow
+ * samples. Tracing fills in the colour of each pixel along with the
+ * normal, view depth and diffuse albedo of its first hit. Filter()
+ * then runs a 5x5 B-spline kernel a few times with growing holes
+ * between the taps, 1, 2, 4 .. pixels apart, and weights every tap
+ * down by how much its normal, depth, albedo and brightness differ
+ * from the centre's.
+ *
+ * The colour is divided by the albedo first, so only the lighting is
+ * blurred and textures stay sharp. Brightness differences are judged
+ * against the noise around the pixel: its luminance variance is
+ * estimated over its neighbours before the first pass and filtered
+ * along, so noisy regions are smoothed hard while clean shadow edges
+ * survive.
+ *
+ * Pixels without a hit, or skipped, are neither filtered nor used by
+ * their neighbours. Filter() splits the rows over several threads;
+ * Set() and Skip() may be called from any thread, for different
+ * pixels.
+ */
+class Denoiser {
+    typedef void (Denoiser::*Pass)(unsigned int first, unsigned int last);
+
+    class Band : public Thread {
+        Denoiser* d;
+        Pass pass;
+        unsigned int y0, y1;
+    public:
+        Band(Denoiser* d, Pass pass, unsigned int y0, unsigned int y1)
+            : d(d), pass(pass), y0(y0), y1(y1) {}
+        void Run() { (d->*pass)(y0, y1); }
+    };
+
+    unsigned int width, height;
+    vector<Vector<3,float> > light[2];  // colour over albedo, ping-pong
+    vector<Vector<3,float> > normal;
+    vector<Vector<3,float> > albedo;
+    vector<float> depth;  // < 0 where not filtered
+    vector<float> variance[2];  // of the luminance, along with light
+    unsigned int result;  // buffers holding the output
+
+    // the pass being run
+    unsigned int x0, y0, x1, y1;
+    unsigned int step;
+
+    float GuideWeight(unsigned int i, unsigned int j, float depthScale) const;
+    void RunPass(Pass pass, unsigned int threads);
+    void EstimateRows(unsigned int first, unsigned int last);
+    void FilterRows(unsigned int first, unsigned int last);
+
+public:
+    Denoiser();
+
+    void Resize(unsigned int w, unsigned int h);
+
+    // a traced pixel, depth < 0 and a zero normal on a miss
+    void Set(unsigned int u, unsigned int v, Vector<4,float> col,
+             Vector<3,float> n, Vector<4,float> diffuse, float d);
+
+    // a pixel that keeps its colour, e.g. a reprojected one
+    void Skip(unsigned int u, unsigned int v) {
+        depth[v*width + u] = -1;
+    }
+
+    // filters [x0,x1) x [y0,y1), pixels outside are not looked at
+    void Filter(unsigned int x0, unsigned int y0,
+                unsigned int x1, unsigned int y1,
+                unsigned int iterations, unsigned int threads);
+
+    bool Filtered(unsigned int u, unsigned int v) const {
+        return depth[v*width + u] >= 0;
+    }
+
+    // the filtered colour of a pixel, with its albedo applied again
+    Vector<3,float> Color(unsigned int u, unsigned int v) const;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "FrameHistory.h"
+
+#include <cmath>
+
+FrameHistory::FrameHistory()
+    : width(0), height(0), valid(false) {}
+
+void FrameHistory::Resize(unsigned int w, unsigned int h) {
+    if (w == width && h == height)
+        return;
+    width = w;
+    height = h;
+    pos.resize(w*h);
+    depth.resize(w*h);
+    color.resize(w*h*3);
+    reused.resize(w*h);
+    valid = false;
+}
+
+void FrameHistory::Invalidate() {
+    valid = false;
+}
+
+void FrameHistory::Set(unsigned int u, unsigned int v, float d,
+                       Vector<3,float> p, Vector<4,float> col) {
+    unsigned int i = v*width + u;
+    depth[i] = d;
+    pos[i] = p;
+    color[i*3+0] = col[0]*255;
+    color[i*3+1] = col[1]*255;
+    color[i*3+2] = col[2]*255;
+}
+
+unsigned int FrameHistory::Reproject(const FrameHistory& prev,
+                                     Matrix<4,4,float> view,
+                                     float p00, float p11) {
+    unsigned int n = width*height;
+    for (unsigned int i=0;i<n;i++) {
+        reused[i] = false;
+        depth[i] = -1;
+    }
+
+    if (!prev.valid || prev.width != width || prev.height != height)
+        return 0;
+
+    unsigned int count = 0;
+    for (unsigned int i=0;i<n;i++) {
+        if (prev.depth[i] < 0)
+            continue;
+
+        Vector<3,float> w = prev.pos[i];
+        Vector<4,float> q = view * Vector<4,float>(w[0],w[1],w[2],1);
+
+        // behind the camera
+        if (q[2] >= 0)
+            continue;
+
+        // inverse of the mapping in RayTracer::RayForPoint
+        float d = -q[2];
+        float x = q[0] / d * p00;
+        float y = q[1] / d * p11;
+        float uf = (x + 1) * width / 2;
+        float vf = (y + 1) * height / 2;
+
+        int u = int(floorf(uf + 0.5f));
+        int v = int(floorf(vf + 0.5f));
+        if (u < 0 || v < 0 || u >= int(width) || v >= int(height))
+            continue;
+
+        unsigned int j = v*width + u;
+        if (reused[j] && depth[j] <= d)
+            continue;
+
+        if (!reused[j])
+            count++;
+        reused[j] = true;
+        depth[j] = d;
+        pos[j] = w;
+        color[j*3+0] = prev.color[i*3+0];
+        color[j*3+1] = prev.color[i*3+1];
+        color[j*3+2] = prev.color[i*3+2];
+    }
+    return count;
+}
@@ -0,0 +1,49 @@
+#ifndef _RT_FRAME_HISTORY_H_
+#define _RT_FRAME_HISTORY_H_
+
+#include <Math/Vector.h>
+#include <Math/Matrix.h>
+#include <vector>
+
+using namespace OpenEngine::Math;
+
+using namespace std;
+
+/**
+ * Per pixel record of a traced frame: the world position and view
+ * depth of the first hit and the final colour. A new frame can be
+ * seeded by reprojecting the previous one through the new camera, so
+ * only pixels nobody landed on have to be traced again.
+ */
+class FrameHistory {
+public:
+    unsigned int width, height;
+
+    vector<Vector<3,float> > pos;
+    vector<float> depth;          // view depth of the hit, < 0 on a miss
+    vector<unsigned char> color;  // rgb
+    vector<bool> reused;          // filled in by Reproject
+
+    bool valid;
+
+    FrameHistory();
+
+    void Resize(unsigned int w, unsigned int h);
+    void Invalidate();
+
+    void Set(unsigned int u, unsigned int v, float d,
+             Vector<3,float> p, Vector<4,float> col);
+
+    /**
+     * Splat the hits of prev into this frame. view maps world points
+     * into camera space (the inverse of what RayForPoint uses), and
+     * p00/p11 are the scale entries of the projection matrix.
+     *
+     * @return number of reused pixels
+     */
+    unsigned int Reproject(const FrameHistory& prev,
+                           Matrix<4,4,float> view,
+                           float p00, float p11);
+};
+
+#endif
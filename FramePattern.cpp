@@ -0,0 +1,34 @@
+#include "FramePattern.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+
+bool ValidFramePattern(const string& pattern) {
+    unsigned int conversions = 0;
+    for (string::size_type i=0;i<pattern.size();i++) {
+        if (pattern[i] != '%')
+            continue;
+        if (++i < pattern.size() && pattern[i] == '%')
+            continue;
+        while (i < pattern.size() && strchr("-+ #0", pattern[i]))
+            i++;
+        while (i < pattern.size() && isdigit(pattern[i]))
+            i++;
+        if (i < pattern.size() && pattern[i] == '.') {
+            i++;
+            while (i < pattern.size() && isdigit(pattern[i]))
+                i++;
+        }
+        if (i == pattern.size() || !strchr("diuoxX", pattern[i]))
+            return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+string FrameFileName(const string& pattern, unsigned int frame) {
+    char name[1024];
+    snprintf(name, sizeof(name), pattern.c_str(), frame);
+    return name;
+}
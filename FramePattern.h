@@ -0,0 +1,21 @@
+#ifndef _RT_FRAME_PATTERN_H_
+#define _RT_FRAME_PATTERN_H_
+
+#include <string>
+
+using namespace std;
+
+/**
+ * File name patterns with the frame number in them, like
+ * "frame%04u.ppm". They come from the command line and from scripts
+ * and end up as printf formats, so a pattern must hold exactly one
+ * integer conversion (d, i, u, o, x or X, with flags, width and
+ * precision but no * and no length modifier) and no other directives
+ * than "%%".
+ */
+bool ValidFramePattern(const string& pattern);
+
+// the pattern with frame filled in; the pattern must be valid
+string FrameFileName(const string& pattern, unsigned int frame);
+
+#endif
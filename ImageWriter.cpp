@@ -0,0 +1,79 @@
+#include "ImageWriter.h"
+
+#include <Logging/Logger.h>
+#include <cstdio>
+
+ImageWriter::ImageWriter() : run(true) {}
+
+void ImageWriter::Grab(EmptyTextureResourcePtr tex, Image& img) {
+    img.width = tex->GetWidth();
+    img.height = tex->GetHeight();
+    img.rgb.resize(img.width * img.height * 3);
+
+    // ppm rows go top down, texture rows bottom up
+    unsigned char* p = &img.rgb[0];
+    for (unsigned int v=img.height;v-- > 0;) {
+        for (unsigned int u=0;u<img.width;u++) {
+            *p++ = (*tex)(u,v,0);
+            *p++ = (*tex)(u,v,1);
+            *p++ = (*tex)(u,v,2);
+        }
+    }
+}
+
+void ImageWriter::Write(string file, EmptyTextureResourcePtr tex) {
+    Image img;
+    img.file = file;
+    Grab(tex, img);
+
+    queueLock.Lock();
+    queue.push_back(img);
+    queueLock.Unlock();
+}
+
+bool ImageWriter::Save(string file, EmptyTextureResourcePtr tex) {
+    Image img;
+    img.file = file;
+    Grab(tex, img);
+    return WritePPM(img);
+}
+
+void ImageWriter::Finish() {
+    queueLock.Lock();
+    run = false;
+    queueLock.Unlock();
+    Wait();
+}
+
+bool ImageWriter::WritePPM(const Image& img) {
+    FILE* f = fopen(img.file.c_str(), "wb");
+    if (!f)
+        return false;
+    fprintf(f, "P6\n%u %u\n255\n", img.width, img.height);
+    bool ok = fwrite(&img.rgb[0], 1, img.rgb.size(), f) == img.rgb.size();
+    return fclose(f) == 0 && ok;
+}
+
+void ImageWriter::Run() {
+    for (;;) {
+        queueLock.Lock();
+        if (queue.empty()) {
+            bool done = !run;
+            queueLock.Unlock();
+            if (done)
+                return;
+            Thread::Sleep(1000);
+            continue;
+        }
+        Image img;
+        img.rgb.swap(queue.front().rgb);
+        img.file = queue.front().file;
+        img.width = queue.front().width;
+        img.height = queue.front().height;
+        queue.pop_front();
+        queueLock.Unlock();
+
+        if (!WritePPM(img))
+            logger.error << "Could not write " << img.file << logger.end;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef _RT_IMAGE_WRITER_H_
+#define _RT_IMAGE_WRITER_H_
+
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Resources/EmptyTextureResource.h>
+#include <string>
+#include <vector>
+#include <list>
+
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Resources;
+
+using namespace std;
+
+/**
+ * Writes images to disk as binary PPM files on its own thread. Write()
+ * only copies the pixels, so the tracer can go on with the next frame
+ * while the last one is still being written.
+ */
+class ImageWriter : public Thread {
+    struct Image {
+        string file;
+        unsigned int width, height;
+        vector<unsigned char> rgb;
+    };
+
+    list<Image> queue;
+    Mutex queueLock;
+    bool run;
+
+    static void Grab(EmptyTextureResourcePtr tex, Image& img);
+    static bool WritePPM(const Image& img);
+
+public:
+    ImageWriter();
+
+    void Write(string file, EmptyTextureResourcePtr tex);
+
+    // writes on the calling thread
+    static bool Save(string file, EmptyTextureResourcePtr tex);
+
+    // writes what is queued, then stops the thread
+    void Finish();
+
+    void Run();
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef _RT_INTERSECT_H_
+#define _RT_INTERSECT_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Ray.h>
+#include <Shapes/Shape.h>
+#include <cmath>
+#include <cstring>
+
+#include "SceneSnapshot.h"
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+
+/**
+ * Ray/object intersection on the analytic form kept in the scene
+ * snapshot. Rays have unit directions, and hits are returned as the
+ * distance t along the ray, so finding the nearest hit needs no
+ * hit point and no square root per candidate.
+ *
+ * A hit only counts on the given side. HIT_OUT means the ray enters
+ * the object, or meets a plane from the front; HIT_IN means it leaves
+ * the object, or meets a plane from behind. Other shapes fall back to
+ * Shape::Intersect.
+ *
+ * @return true if the object is hit on that side at 0 < t < tMax
+ */
+inline bool IntersectObject(const SceneSnapshot::Object& o, const Ray& r,
+                            Hit side, float tMax, float& t) {
+    switch (o.kind) {
+    case SceneSnapshot::Object::SPHERE: {
+        Vector<3,float> oc = r.origin - o.point;
+        float b = oc * r.direction;
+        float c = oc * oc - o.radius * o.radius;
+        float disc = b*b - c;
+        if (disc < 0)
+            return false;
+        // a ray starting outside enters at the near root
+        if ((c > 0) != (side == HIT_OUT))
+            return false;
+        float q = sqrtf(disc);
+        t = (c > 0) ? -b - q : -b + q;
+        break;
+    }
+    case SceneSnapshot::Object::PLANE: {
+        float denom = r.direction * o.normal;
+        if (denom == 0 || (denom < 0) != (side == HIT_OUT))
+            return false;
+        t = ((o.point - r.origin) * o.normal) / denom;
+        break;
+    }
+    default: {
+        Vector<3,float> p;
+        if (o.shape->Intersect(r, p) != side)
+            return false;
+        t = (p - r.origin).GetLength();
+    }
+    }
+    return t > 0 && t < tMax;
+}
+
+// the normal flipped to the side dir points into
+inline Vector<3,float> FaceTowards(Vector<3,float> n, Vector<3,float> dir) {
+    return (n * dir < 0) ? -n : n;
+}
+
+/**
+ * Origin for a ray leaving the surface point p to the side n points
+ * into. p is moved a few units in the last place along n, so the
+ * offset grows with the scale of the coordinates and the new ray can
+ * not hit the surface it starts on; near the world origin, where ulps
+ * are tiny, a small fixed offset is used instead.
+ */
+inline Vector<3,float> OffsetRayOrigin(Vector<3,float> p, Vector<3,float> n) {
+    const float ORIGIN = 1.0f / 32;
+    const float FLOAT_SCALE = 1.0f / 65536;
+    const float INT_SCALE = 256;
+
+    Vector<3,float> o;
+    for (unsigned int i=0;i<3;i++) {
+        int off = int(INT_SCALE * n[i]);
+        int bits;
+        memcpy(&bits, &p[i], sizeof(bits));
+        bits += (p[i] < 0) ? -off : off;
+        float moved;
+        memcpy(&moved, &bits, sizeof(moved));
+        o[i] = (fabsf(p[i]) < ORIGIN) ? p[i] + FLOAT_SCALE * n[i] : moved;
+    }
+    return o;
+}
+
+#endif
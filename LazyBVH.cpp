@@ -0,0 +1,113 @@
+#include "LazyBVH.h"
+
+#include <Core/Thread.h>
+
+using namespace OpenEngine::Core;
+
+// levels split by Build() before any ray is traced
+static const unsigned int EAGER_DEPTH = 3;
+
+unsigned int LazyBVH::Expanded() const {
+    return __atomic_load_n(&expanded, __ATOMIC_RELAXED);
+}
+
+void LazyBVH::Build(const vector<Object>& objects) {
+    refs.clear();
+    unbounded.clear();
+    for (unsigned int i=0;i<objects.size();i++) {
+        const Object& o = objects[i];
+        if (!o.bounded) {
+            unbounded.push_back(i);
+            continue;
+        }
+        BVH::Ref r;
+        r.object = i;
+        r.bmin = o.bmin;
+        r.bmax = o.bmax;
+        r.center = (o.bmin + o.bmax) * 0.5;
+        refs.push_back(r);
+    }
+
+    // a binary tree over n leaves has at most 2n-1 nodes
+    unsigned int n = refs.size();
+    nodes.resize(n ? 2*n - 1 : 0);
+    state.resize(nodes.size());
+    depth.resize(nodes.size());
+    prims.resize(n);
+    used = 0;
+    expanded = 0;
+    if (n == 0)
+        return;
+
+    Node& root = nodes[used++];
+    BVH::Bounds(&refs[0], n, root.bmin, root.bmax);
+    root.start = 0;
+    root.count = n;
+    state[0] = PENDING;
+    depth[0] = 0;
+
+    // breadth first, so the top levels are split in index order
+    for (unsigned int i=0;i<used && depth[i]<EAGER_DEPTH;i++)
+        Expand(i);
+}
+
+void LazyBVH::Split(unsigned int n) {
+    unsigned char pending = PENDING;
+    if (!__atomic_compare_exchange_n(&state[n], &pending, (unsigned char)SPLITTING,
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        // someone else is splitting it
+        while (__atomic_load_n(&state[n], __ATOMIC_ACQUIRE) != READY)
+            Thread::Sleep(0);
+        return;
+    }
+
+    Node& node = nodes[n];
+    unsigned int first = node.start;
+    unsigned int count = node.count;
+    unsigned int left = BVH::Split(&refs[first], count, node.bmin, node.bmax, depth[n]);
+    if (left == 0) {
+        for (unsigned int i=0;i<count;i++)
+            prims[first + i] = refs[first + i].object;
+    } else {
+        unsigned int c = __atomic_fetch_add(&used, 2, __ATOMIC_RELAXED);
+        for (unsigned int k=0;k<2;k++) {
+            Node& child = nodes[c + k];
+            child.start = k ? first + left : first;
+            child.count = k ? count - left : left;
+            BVH::Bounds(&refs[child.start], child.count, child.bmin, child.bmax);
+            state[c + k] = PENDING;
+            depth[c + k] = depth[n] + 1;
+        }
+        node.start = c;
+        node.count = 0;
+    }
+    __atomic_fetch_add(&expanded, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&state[n], (unsigned char)READY, __ATOMIC_RELEASE);
+}
+
+void LazyBVH::Refit(const vector<Object>& objects) {
+    for (unsigned int i=0;i<refs.size();i++) {
+        BVH::Ref& r = refs[i];
+        const Object& o = objects[r.object];
+        r.bmin = o.bmin;
+        r.bmax = o.bmax;
+        r.center = (o.bmin + o.bmax) * 0.5;
+    }
+
+    // children always come after their parent
+    for (unsigned int i=used;i-- > 0;) {
+        Node& node = nodes[i];
+        if (node.count)
+            BVH::Bounds(&refs[node.start], node.count, node.bmin, node.bmax);
+        else {
+            const Node& l = nodes[node.start];
+            const Node& r = nodes[node.start + 1];
+            node.bmin = l.bmin;
+            node.bmax = l.bmax;
+            for (unsigned int a=0;a<3;a++) {
+                node.bmin[a] = min(node.bmin[a], r.bmin[a]);
+                node.bmax[a] = max(node.bmax[a], r.bmax[a]);
+            }
+        }
+    }
+}
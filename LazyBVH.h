@@ -0,0 +1,62 @@
+#ifndef _RT_LAZY_BVH_H_
+#define _RT_LAZY_BVH_H_
+
+#include <vector>
+
+#include "BVH.h"
+
+using namespace std;
+
+/**
+ * A BVH that is only built where rays go, for the first frames of a
+ * big scene while the full tree is built in the background. Build()
+ * splits the top few levels; every other node stays pending until a
+ * ray enters it, and Expand() then splits it once. Subtrees nobody
+ * looks at are never built.
+ *
+ * Tracing threads expand nodes concurrently. Nodes are never moved:
+ * storage for the largest possible tree is set aside up front, the
+ * children of a node are claimed with an atomic add and a node is
+ * published by a release store of its state. Ray threads must call
+ * Expand() on a node before looking at anything but its bounds.
+ *
+ * The children of an inner node are start and start+1. Leaves refer
+ * to prims[start .. start+count).
+ */
+class LazyBVH {
+public:
+    typedef SceneSnapshot::Object Object;
+    typedef BVH::Node Node;
+
+    enum State { READY, PENDING, SPLITTING };
+
+    vector<Node> nodes;
+    vector<unsigned int> prims;      // object indices, final under ready leaves
+    vector<unsigned int> unbounded;  // object indices
+
+    // nodes split so far, by Build() and by rays
+    unsigned int Expanded() const;
+
+    void Build(const vector<Object>& objects);
+
+    // Moves the bounds along with the objects. Not thread safe, call
+    // it between frames.
+    void Refit(const vector<Object>& objects);
+
+    // makes sure node n is split or a final leaf
+    void Expand(unsigned int n) {
+        if (__atomic_load_n(&state[n], __ATOMIC_ACQUIRE) != READY)
+            Split(n);
+    }
+
+private:
+    vector<BVH::Ref> refs;
+    vector<unsigned char> state;
+    vector<unsigned char> depth;
+    unsigned int used;
+    unsigned int expanded;
+
+    void Split(unsigned int n);
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _RT_MATERIAL_TABLE_H_
+#define _RT_MATERIAL_TABLE_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Shape.h>
+#include <vector>
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+
+using namespace std;
+
+/**
+ * The shading inputs of one primitive, copied out of the shape and
+ * its material when the scene is visited. kind selects the shading
+ * kernel: a combination of the terms that are actually non-zero.
+ */
+struct ShadeMaterial {
+    enum {
+        DIFFUSE    = 0,
+        SPECULAR   = 1,
+        REFLECT    = 2,
+        REFRACT    = 4,
+        KINDS      = 8
+    };
+
+    Vector<4,float> diffuse;
+    Vector<4,float> specular;
+    float shininess;
+    float reflection;
+    float refraction;
+    unsigned int kind;
+
+    bool operator==(const ShadeMaterial& o) const {
+        return kind == o.kind &&
+            diffuse == o.diffuse &&
+            specular == o.specular &&
+            shininess == o.shininess &&
+            reflection == o.reflection &&
+            refraction == o.refraction;
+    }
+};
+
+/**
+ * Compact table of ShadeMaterials indexed by primitive, in the same
+ * order as the tracer's object list.
+ */
+class MaterialTable {
+    vector<ShadeMaterial> entries;
+public:
+    void Clear() {
+        entries.clear();
+    }
+
+    unsigned int Add(Shape* shape) {
+        ShadeMaterial m;
+        m.diffuse = shape->mat->diffuse;
+        m.specular = shape->mat->specular;
+        m.shininess = shape->mat->shininess;
+        m.reflection = shape->reflection;
+        m.refraction = shape->refraction;
+
+        m.kind = ShadeMaterial::DIFFUSE;
+        if (m.specular[0] > 0 || m.specular[1] > 0 || m.specular[2] > 0)
+            m.kind |= ShadeMaterial::SPECULAR;
+        if (m.reflection > 0.0)
+            m.kind |= ShadeMaterial::REFLECT;
+        if (shape->transparent)
+            m.kind |= ShadeMaterial::REFRACT;
+
+        entries.push_back(m);
+        return entries.size() - 1;
+    }
+
+    const ShadeMaterial& operator[](unsigned int i) const {
+        return entries[i];
+    }
+
+    unsigned int Size() const {
+        return entries.size();
+    }
+
+    bool operator==(const MaterialTable& o) const {
+        if (entries.size() != o.entries.size())
+            return false;
+        for (unsigned int i=0;i<entries.size();i++)
+            if (!(entries[i] == o.entries[i]))
+                return false;
+        return true;
+    }
+};
+
+#endif
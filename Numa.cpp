@@ -0,0 +1,73 @@
+#include "Numa.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <cstdio>
+
+// cpus of a node from its sysfs cpu list, e.g. "0-7,16-23"
+static bool NodeCpus(unsigned int node, cpu_set_t& cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    CPU_ZERO(&cpus);
+    unsigned int a, b;
+    while (fscanf(f, "%u", &a) == 1) {
+        b = a;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &b) != 1)
+                break;
+            c = fgetc(f);
+        }
+        for (unsigned int i=a;i<=b && i<CPU_SETSIZE;i++)
+            CPU_SET(i, &cpus);
+        if (c != ',')
+            break;
+    }
+    fclose(f);
+    return CPU_COUNT(&cpus) > 0;
+}
+
+unsigned int NumaNodes() {
+    static unsigned int nodes = 0;
+    if (nodes == 0) {
+        cpu_set_t cpus;
+        while (NodeCpus(nodes, cpus))
+            nodes++;
+        if (nodes == 0)
+            nodes = 1;
+    }
+    return nodes;
+}
+
+bool PinThread(int node) {
+    cpu_set_t cpus;
+    if (node < 0) {
+        CPU_ZERO(&cpus);
+        for (unsigned int n=0;n<NumaNodes();n++) {
+            cpu_set_t c;
+            if (NodeCpus(n, c))
+                CPU_OR(&cpus, &cpus, &c);
+        }
+        if (CPU_COUNT(&cpus) == 0)
+            return false;
+    } else if (!NodeCpus(node, cpus))
+        return false;
+    // pid 0 is the calling thread
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+#else
+
+unsigned int NumaNodes() {
+    return 1;
+}
+
+bool PinThread(int node) {
+    return false;
+}
+
+#endif
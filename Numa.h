@@ -0,0 +1,17 @@
+#ifndef _RT_NUMA_H_
+#define _RT_NUMA_H_
+
+/**
+ * NUMA topology and thread placement, read from sysfs on Linux. Other
+ * systems look like a single node and pinning does nothing.
+ *
+ * Memory follows the first touch, so data copied by a thread pinned to
+ * a node ends up in that node's memory.
+ */
+unsigned int NumaNodes();
+
+// pins the calling thread to the cpus of a node, or to all cpus when
+// node is negative
+bool PinThread(int node);
+
+#endif
@@ -0,0 +1,132 @@
+#include "Profiler.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+static const char* phaseNames[Profiler::PHASES] = {
+    "intersect", "shadows", "reflect", "refract"
+};
+
+// room for the phases of a frame outside its tiles
+static const unsigned int FRAME_EVENTS = 64;
+
+__thread Profiler::Track* Profiler::current = NULL;
+
+Profiler::Scope::Scope(const char* name, int x, int y) : track(current) {
+    if (!track)
+        return;
+    event.name = name;
+    event.x = x;
+    event.y = y;
+    memcpy(event.sums, track->sums, sizeof(event.sums));
+    event.start = Now();
+}
+
+Profiler::Scope::~Scope() {
+    if (!track)
+        return;
+    event.end = Now();
+    for (unsigned int i=0;i<PHASES;i++)
+        event.sums[i] = track->sums[i] - event.sums[i];
+    if (track->events.size() < track->events.capacity())
+        track->events.push_back(event);
+    else
+        track->dropped++;
+}
+
+Profiler::Sum::Sum(Phase phase) : track(current), phase(phase) {
+    if (track && track->active[phase]++ == 0)
+        track->since[phase] = Now();
+}
+
+Profiler::Sum::~Sum() {
+    if (track && --track->active[phase] == 0)
+        track->sums[phase] += Now() - track->since[phase];
+}
+
+Profiler::Profiler() : frameStart(0) {}
+
+unsigned long long Profiler::Now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void Profiler::BeginFrame(unsigned int threads) {
+    if (tracks.size() < threads)
+        tracks.resize(threads);
+    for (unsigned int i=0;i<tracks.size();i++) {
+        Track& t = tracks[i];
+        t.events.clear();
+        memset(t.sums, 0, sizeof(t.sums));
+        memset(t.active, 0, sizeof(t.active));
+        t.dropped = 0;
+    }
+    // the frame level phases around the tiles
+    Reserve(FRAME_EVENTS);
+    frameStart = Now();
+}
+
+void Profiler::Reserve(unsigned int events) {
+    for (unsigned int i=0;i<tracks.size();i++)
+        tracks[i].events.reserve(events);
+}
+
+unsigned long Profiler::Dropped() const {
+    unsigned long n = 0;
+    for (unsigned int i=0;i<tracks.size();i++)
+        n += tracks[i].dropped;
+    return n;
+}
+
+void Profiler::Bind(unsigned int track) {
+    current = track < tracks.size() ? &tracks[track] : NULL;
+}
+
+void Profiler::Unbind() {
+    current = NULL;
+}
+
+bool Profiler::Write(string file, unsigned int frame) {
+    FILE* f = fopen(file.c_str(), "w");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    for (unsigned int i=0;i<tracks.size();i++) {
+        char name[32];
+        if (i)
+            snprintf(name, sizeof(name), "tile thread %u", i);
+        else
+            snprintf(name, sizeof(name), "tracer");
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", frame, i, name);
+        first = false;
+
+        const vector<Event>& events = tracks[i].events;
+        for (unsigned int j=0;j<events.size();j++) {
+            const Event& e = events[j];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"rt\",\"ph\":\"X\","
+                    "\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                    e.name, frame, i,
+                    (e.start - frameStart) / 1000.0, (e.end - e.start) / 1000.0);
+            const char* sep = "";
+            if (e.x >= 0) {
+                fprintf(f, "\"x\":%d,\"y\":%d", e.x, e.y);
+                sep = ",";
+            }
+            for (unsigned int k=0;k<PHASES;k++) {
+                if (e.sums[k] == 0)
+                    continue;
+                fprintf(f, "%s\"%s us\":%.3f", sep, phaseNames[k], e.sums[k] / 1000.0);
+                sep = ",";
+            }
+            fprintf(f, "}}");
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
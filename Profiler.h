@@ -0,0 +1,84 @@
+#ifndef _RT_PROFILER_H_
+#define _RT_PROFILER_H_
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Named phase markers for the tracer, written out as a Chrome trace
+ * event file (load it in chrome://tracing or Perfetto) to show thread
+ * utilisation, tile imbalance and stalls on a timeline.
+ *
+ * A Scope records one event on the calling thread's track. Per ray
+ * phases are far too many for events, so a Sum only adds its time to
+ * the thread's total for the phase; every event carries the totals
+ * accumulated while it was open. A phase nested in itself, like the
+ * intersection of a reflected ray, is counted once.
+ *
+ * Threads pick their track with Bind(). Markers on threads without one
+ * cost a thread local load and nothing else. Events go into room set
+ * aside by Reserve(), so tracing tiles does not allocate; a track
+ * that runs out drops its further events and counts them.
+ */
+class Profiler {
+public:
+    enum Phase { INTERSECT, SHADOWS, REFLECT, REFRACT, PHASES };
+
+private:
+    struct Event {
+        const char* name;
+        unsigned long long start, end;  // ns
+        unsigned long long sums[PHASES];
+        int x, y;                       // tile corner, -1 if none
+    };
+
+    struct Track {
+        vector<Event> events;
+        unsigned long long sums[PHASES];
+        unsigned long long since[PHASES];
+        unsigned int active[PHASES];
+        unsigned long dropped;
+    };
+
+    vector<Track> tracks;
+    unsigned long long frameStart;
+
+    static __thread Track* current;
+
+public:
+    class Scope {
+        Track* track;
+        Event event;
+    public:
+        Scope(const char* name, int x = -1, int y = -1);
+        ~Scope();
+    };
+
+    class Sum {
+        Track* track;
+        Phase phase;
+    public:
+        Sum(Phase phase);
+        ~Sum();
+    };
+
+    Profiler();
+
+    // monotonic clock in ns
+    static unsigned long long Now();
+
+    // drops the events of the last frame and sets up a track per thread
+    void BeginFrame(unsigned int threads);
+    // room for at least this many events on every track
+    void Reserve(unsigned int events);
+    // events lost to full tracks this frame
+    unsigned long Dropped() const;
+    void Bind(unsigned int track);
+    static void Unbind();
+
+    bool Write(string file, unsigned int frame);
+};
+
+#endif
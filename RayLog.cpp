@@ -0,0 +1,148 @@
+#include "RayLog.h"
+
+#include <Logging/Logger.h>
+#include <cstring>
+
+static const char MAGIC[8] = {'R','T','R','A','Y','S',0,0};
+static const unsigned int VERSION = 1;
+
+RayLog::Buffer::Buffer() : log(NULL), count(0) {}
+
+void RayLog::Buffer::Attach(RayLog* l) {
+    if (log && count)
+        Flush();
+    log = l;
+    count = 0;
+    if (log && chunk.empty())
+        chunk.push_back(vector<Record>(CHUNK_SIZE));
+}
+
+void RayLog::Buffer::Add(const Ray& r, float maxT, unsigned int hit,
+                         unsigned int cost, unsigned int depth, Kind kind) {
+    if (!log)
+        return;
+    if (count == CHUNK_SIZE)
+        Flush();
+    Record& rec = chunk.front()[count++];
+    for (unsigned int i=0;i<3;i++) {
+        rec.origin[i] = r.origin[i];
+        rec.direction[i] = r.direction[i];
+    }
+    rec.maxT = maxT;
+    rec.hit = hit;
+    rec.cost = min(cost, 0xffffu);
+    rec.depth = min(depth, 0xffu);
+    rec.kind = kind;
+}
+
+void RayLog::Buffer::Flush() {
+    if (!log || count == 0)
+        return;
+    log->Submit(chunk, count);
+    count = 0;
+}
+
+RayLog::RayLog() : file(NULL), run(false), records(0) {}
+
+RayLog::~RayLog() {
+    if (file)
+        Close();
+}
+
+bool RayLog::Open(string filename) {
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        logger.error << "Could not open ray log " << filename << logger.end;
+        return false;
+    }
+    unsigned int header[2] = { VERSION, sizeof(Record) };
+    fwrite(MAGIC, 1, sizeof(MAGIC), file);
+    fwrite(header, sizeof(header), 1, file);
+    records = 0;
+    run = true;
+    Start();
+    return true;
+}
+
+void RayLog::Close() {
+    lock.Lock();
+    run = false;
+    lock.Unlock();
+    Wait();
+    if (fclose(file) != 0)
+        logger.error << "Could not write ray log" << logger.end;
+    file = NULL;
+}
+
+unsigned long RayLog::Records() {
+    lock.Lock();
+    unsigned long n = records;
+    lock.Unlock();
+    return n;
+}
+
+// hands the buffer's chunk to the writer and gives it an empty one
+void RayLog::Submit(Chunks& chunk, unsigned int count) {
+    chunk.front().resize(count);
+    lock.Lock();
+    queue.splice(queue.end(), chunk);
+    if (!spare.empty())
+        chunk.splice(chunk.begin(), spare, spare.begin());
+    lock.Unlock();
+    if (chunk.empty())
+        chunk.push_back(vector<Record>(CHUNK_SIZE));
+}
+
+void RayLog::WriteChunk(const vector<Record>& chunk) {
+    if (fwrite(&chunk[0], sizeof(Record), chunk.size(), file) != chunk.size())
+        logger.error << "Could not write ray log" << logger.end;
+}
+
+void RayLog::Run() {
+    for (;;) {
+        lock.Lock();
+        if (queue.empty()) {
+            bool done = !run;
+            lock.Unlock();
+            if (done)
+                return;
+            Thread::Sleep(1000);
+            continue;
+        }
+        Chunks chunk;
+        chunk.splice(chunk.begin(), queue, queue.begin());
+        lock.Unlock();
+
+        WriteChunk(chunk.front());
+
+        lock.Lock();
+        records += chunk.front().size();
+        chunk.front().resize(CHUNK_SIZE);
+        spare.splice(spare.end(), chunk);
+        lock.Unlock();
+    }
+}
+
+bool RayLog::Load(string filename, vector<Record>& records) {
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return false;
+
+    char magic[8];
+    unsigned int header[2];
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1 ||
+        header[0] != VERSION || header[1] != sizeof(Record)) {
+        logger.error << filename << " is not a ray log" << logger.end;
+        fclose(f);
+        return false;
+    }
+
+    records.clear();
+    Record rec;
+    while (fread(&rec, sizeof(Record), 1, f) == 1)
+        records.push_back(rec);
+    fclose(f);
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef _RT_RAY_LOG_H_
+#define _RT_RAY_LOG_H_
+
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Shapes/Ray.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <cstdio>
+
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Shapes;
+
+using namespace std;
+
+/**
+ * Binary log of every ray a frame traces, for analysing ray
+ * distributions offline or replaying them as an intersection-only
+ * benchmark (see RayTracer::ReplayRays).
+ *
+ * The file is a header followed by fixed size records in host byte
+ * order. Each tracing thread fills its own Buffer without locking;
+ * full chunks of records are handed to the log thread, which writes
+ * them out. Chunks are recycled, so a running log does not allocate.
+ */
+class RayLog : public Thread {
+public:
+    // INSIDE rays travel through an object, after a refraction
+    enum Kind { PRIMARY, SECONDARY, INSIDE, SHADOW };
+
+    // hit of a ray that missed everything, and of an occluded shadow ray
+    static const unsigned int MISS = 0xffffffff;
+    static const unsigned int OCCLUDED = 0xfffffffe;
+
+    struct Record {
+        float origin[3];
+        float direction[3];
+        float maxT;             // shadow rays, 0 for the others
+        unsigned int hit;       // object index, MISS or OCCLUDED
+        unsigned short cost;    // boxes and shapes tested
+        unsigned char depth;
+        unsigned char kind;
+    };
+
+    typedef list<vector<Record> > Chunks;
+
+    class Buffer {
+        RayLog* log;
+        Chunks chunk;  // the one being filled
+        unsigned int count;
+    public:
+        Buffer();
+        void Attach(RayLog* log);
+        void Add(const Ray& r, float maxT, unsigned int hit,
+                 unsigned int cost, unsigned int depth, Kind kind);
+        void Flush();
+    };
+
+private:
+    static const unsigned int CHUNK_SIZE = 4096;
+
+    FILE* file;
+    Chunks queue;
+    Chunks spare;
+    Mutex lock;
+    bool run;
+    unsigned long records;
+
+    void Submit(Chunks& chunk, unsigned int count);
+    void WriteChunk(const vector<Record>& chunk);
+
+public:
+    RayLog();
+    ~RayLog();
+
+    bool Open(string filename);
+
+    // writes what is queued and closes the file; buffers must be
+    // flushed first
+    void Close();
+
+    unsigned long Records();
+
+    static bool Load(string filename, vector<Record>& records);
+
+    void Run();
+};
+
+#endif
@@ -5,6 +5,28 @@
 #include <Scene/ISceneNode.h>
 #include <Scene/ShapeNode.h>
 
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "ImageWriter.h"
+#include "AllocationCounter.h"
+#include "RayLog.h"
+#include "Profiler.h"
+#include "FramePattern.h"
+#include "Numa.h"
+#include "Intersect.h"
+#include "LazyBVH.h"
+#include "Upscale.h"
+
+#ifdef RT_DISTRIBUTED
+#include "RenderCoordinator.h"
+#include "Codec.h"
+#endif
+
 using namespace std;
 
 template <unsigned int N, class T>
@@ -16,8 +38,62 @@ Vector<N,T> VecMult(Vector<N,T> a, Vector<N,T> b) {
     return r;
 }
 
+unsigned int HashUInt(unsigned int x) {
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = (x >> 16) ^ x;
+    return x;
+}
+
+// Seed for the light samples of a shading point, so the same point
+// always gets the same (but spatially uncorrelated) sample pattern.
+unsigned int HashPoint(Vector<3,float> p) {
+    unsigned int h = 0;
+    for (unsigned int i=0;i<3;i++) {
+        float f = p[i];
+        unsigned int bits;
+        memcpy(&bits, &f, sizeof(bits));
+        h = HashUInt(h ^ bits);
+    }
+    return h;
+}
+
+// Jittered sample i in a grid x grid stratification of the unit square.
+void StratifiedSample(unsigned int i, unsigned int grid, unsigned int seed,
+                      float& s, float& t) {
+    unsigned int h = HashUInt(seed + i);
+    float js = (h & 0xffff) / 65536.0f;
+    float jt = (h >> 16) / 65536.0f;
+    s = ((i % grid) + js) / grid;
+    t = ((i / grid) + jt) / grid;
+}
+
+float Seconds(Time t) {
+    return t.sec + t.usec * 1e-6f;
+}
+
+unsigned int ProcessorCount() {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return n;
+#endif
+    return 1;
+}
+
+// ray log buffer of the calling tracing thread, NULL when not logging
+static __thread RayLog::Buffer* rayBuffer = NULL;
+
+// copy of the scene the calling thread traverses, NULL for the tracer's
+static __thread const BVH* localBVH = NULL;
+static __thread const SceneSnapshot::Object* localObjects = NULL;
+
+// what NearestShape returns for a brick sphere, which has no shape of
+// its own; normals and materials are looked up by id instead
+static Shapes::Sphere brickShape(Vector<3,float>(0,0,0), 1);
+
 RayTracer::RayTracer(EmptyTextureResourcePtr tex, IViewingVolume* vol, ISceneNode* root)
-    : texture(tex),traceNum(0),root(root),volume(vol),run(true) {
+    : texture(tex),target(tex),traceNum(0),root(root),volume(vol),run(true) {
     for (unsigned int x=0;x<texture->GetWidth();x++)
         for (unsigned int y=0;y<texture->GetHeight();y++) {
             (*texture)(x,y,0) = x;
@@ -35,25 +111,122 @@ RayTracer::RayTracer(EmptyTextureResourcePtr tex, IViewingVolume* vol, ISceneNod
     camPos = Vector<3,float>(0,0,0);
 
     Light l;
+    l.type = Light::SPHERE;
     l.pos = Vector<3,float>(200,100,100);
     l.color = Vector<4,float>(1);
+    l.radius = 20;
     lights.push_back(l);
 
 
-    
+    l.type = Light::RECT;
     l.pos = Vector<3,float>(-200,100,100);
+    l.edgeU = Vector<3,float>(40,0,0);
+    l.edgeV = Vector<3,float>(0,0,40);
     lights.push_back(l);
 
     maxDepth = 5;
 
+    shadowProbeGrid = 2;
+    shadowRefineGrid = 4;
+
+    visibilityCaching = false;
+
+    probeGrid = shadowProbeGrid;
+    refineGrid = shadowRefineGrid;
+    frameCaching = false;
+
+    denoise = false;
+    denoiseIterations = 3;
+    frameDenoise = false;
+    denoiseTime = 0;
+
+    cropped = false;
+    cropRequested = false;
+    cropSamples = 1;
+
+    tileOrder = TILES_ROWS;
+    tileAllocations = 0;
+    allocationFrames = 0;
+    steadyAllocations = 0;
+    tracePass = 0;
+    passThreads = 0;
+    passDone = 0;
+    stopTileThreads = false;
+
+    rayLogRequested = false;
+    rayLog = NULL;
+    tileStreamRequested = false;
+    tileStream = NULL;
+    streamFrame = false;
+    frameMark = false;
+
+    numaAware = true;
+    numaReplicate = true;
+    sceneVersion = 1;
+    frameNodes = 1;
+    frameThreads = 1;
+    tracerPinned = false;
+    if (NumaNodes() > 1)
+        logger.info << "NUMA nodes: " << NumaNodes() << logger.end;
+
+    profiling = false;
+    focusX = texture->GetWidth() / 2;
+    focusY = texture->GetHeight() / 2;
+
+    firstHitsValid = false;
+    firstHitsComplete = false;
+    firstHitCaching = true;
+    secondarySorting = true;
+    geometryChanged = true;
+
+    historyIdx = 0;
+    snapshotIdx = 0;
+    bvhUpdater = &sceneBVHs[0].updater;
+    sceneChanged = true;
+    temporal = false;
+    temporalRefresh = 16;
+
+    reusedPixels = 0;
+    remoteFrame = false;
+    coordinator = NULL;
+    remoteDenoiseWarned = false;
+
+    threads = ProcessorCount();
+    bvhMethod = BVH::SAH;
+    brickBudget = 256;
+    framePasses = 1;
+    paused = false;
+    renderWidth = renderHeight = 0;
+    renderScale = 1.0;
+    cancelFrame = false;
+    canceled = false;
+    saveTickets = 0;
+    savesDone = 0;
+    bvhUpdateTime = 0;
+    memset(&stats, 0, sizeof(stats));
+
     timer.Start();
 
     markX = 200;
     markY = 80;
 
+    SetupKernels();
+
     rnode = new RayTracerRenderNode(this);
 }
 
+RayTracer::~RayTracer() {
+    // tile threads return at the next pass they see
+    stopTileThreads = true;
+    __atomic_fetch_add(&tracePass, 1, __ATOMIC_RELEASE);
+    for (unsigned int i=0;i<tileThreads.size();i++) {
+        tileThreads[i]->Wait();
+        delete tileThreads[i];
+    }
+    for (unsigned int i=0;i<replicas.size();i++)
+        delete replicas[i];
+}
+
 void RayTracer::RayTracerRenderNode::Apply(RenderingEventArg arg, ISceneNodeVisitor& vi) {
     IRenderer& rend = arg.renderer;
 
@@ -72,8 +245,11 @@ void RayTracer::RayTracerRenderNode::Apply(RenderingEventArg arg, ISceneNodeVisi
 
     rt->objectsLock.Lock();
 
-    list<RayHit> rays;
-    rt->TraceRay(r,0,markDebug,HIT_OUT,1.0,&rays);
+    RayList rays((ArenaAllocator<RayHit>(&arena)));
+    if (markDebug)
+        rt->TraceRay<DebugTrace>(r,0,HIT_OUT,1.0,&rays);
+    else
+        rt->TraceRay<CollectTrace>(r,0,HIT_OUT,1.0,&rays);
   
 
     rt->objectsLock.Unlock();
@@ -89,7 +265,7 @@ void RayTracer::RayTracerRenderNode::Apply(RenderingEventArg arg, ISceneNodeVisi
 
     //logger.info << rays.size() << logger.end;
 
-    for(list<RayHit>::iterator itr = rays.begin();
+    for(RayList::iterator itr = rays.begin();
         itr != rays.end();
         itr++) {
         RayHit h = *itr;
@@ -98,14 +274,40 @@ void RayTracer::RayTracerRenderNode::Apply(RenderingEventArg arg, ISceneNodeVisi
                       3);
     }
 
+    rays.clear();
+    arena.Reset();
     markDebug = false;
 }
 
 
-void RayTracer::VisitShapeNode(ShapeNode* node) {
-    Object o;
-    o.shape = node->shape;
-    objects.push_back(o);
+bool RayTracer::Light::operator==(const Light& o) const {
+    return type == o.type &&
+        pos == o.pos &&
+        color == o.color &&
+        radius == o.radius &&
+        edgeU == o.edgeU &&
+        edgeV == o.edgeV;
+}
+
+Vector<3,float> RayTracer::Light::SamplePoint(Vector<3,float> from, float s, float t) const {
+    switch (type) {
+    case SPHERE: {
+        // sample the disc of the sphere facing the shading point
+        Vector<3,float> w = (pos - from).GetNormalize();
+        Vector<3,float> a = (fabs(w[0]) > 0.9f)
+            ? Vector<3,float>(0,1,0)
+            : Vector<3,float>(1,0,0);
+        Vector<3,float> u = (w % a).GetNormalize();
+        Vector<3,float> v = w % u;
+        float r = radius * sqrtf(s);
+        float theta = 2 * PI * t;
+        return pos + u * (r * cosf(theta)) + v * (r * sinf(theta));
+    }
+    case RECT:
+        return pos + edgeU * (s - 0.5f) + edgeV * (t - 0.5f);
+    default:
+        return pos;
+    }
 }
 
 void RayTracer::Handle(Core::ProcessEventArg arg) {
@@ -148,48 +350,117 @@ For each pixel in image {
 
 */
 
-Shape* RayTracer::NearestShape(Ray r, Vector<3,float>& point, bool debug, Hit side) {
-
-    float nearestT = 1.0e100;
-    Shape *nearestObj = 0;
-    Vector<3,float> nearestPoint;
-
-
-    for (vector<Object>::iterator itr = objects.begin();
-         itr != objects.end();
-         itr++) {
-        Shape* s = itr->shape;
-
-        Vector<3,float> interP;
+template <class P>
+void RayTracer::TestShape(unsigned int i, const Ray& r, Hit side,
+                          float& nearestT, unsigned int& nearestId) {
+    float t;
+    if (IntersectObject(LocalObjects()[i], r, side, nearestT, t)) {
+        if (P::VERBOSE)
+            logger.info << " t = " << t << logger.end;
+        nearestT = t;
+        nearestId = i;
+    }
+}
 
-        Hit h = s->Intersect(r,interP);
+// Splits a lazy node a ray has entered if need be, and pushes it on the
+// traversal stack: a leaf as its object range, an inner node as its
+// two children.
+static unsigned int PushLazy(LazyBVH& lazy, unsigned int n,
+                             WideBVH::Entry* stack, unsigned int sp) {
+    lazy.Expand(n);
+    const LazyBVH::Node& node = lazy.nodes[n];
+    WideBVH::Entry e;
+    e.t = 0;
+    if (node.count) {
+        e.index = node.start;
+        e.count = node.count;
+        stack[sp++] = e;
+    } else {
+        e.count = 0;
+        e.index = node.start + 1;
+        stack[sp++] = e;
+        e.index = node.start;
+        stack[sp++] = e;
+    }
+    return sp;
+}
 
-        if (h == side) {
-            float t = (interP - r.origin).GetLength();
-            if (debug)
-                logger.info << " t = " << t << logger.end;
-            if ( t < nearestT && t > 0) {
-                nearestT = t;
-                nearestObj = s;
-                nearestPoint = interP;
+template <class P>
+Shape* RayTracer::NearestShape(Ray r, Vector<3,float>& point, Hit side, unsigned int* id, unsigned int* cost) {
+    PhaseSum<P::STATS> phase(Profiler::INTERSECT);
+
+    float nearestT = 1.0e30f;
+    unsigned int nearestId = objects.size();
+    unsigned int tests = 0;
+
+    const BVH& tree = LocalBVH();
+    LazyBVH* lazy = bvhUpdater->lazy;
+    const vector<unsigned int>& unbounded = lazy ? lazy->unbounded : tree.unbounded;
+    for (unsigned int i=0;i<unbounded.size();i++)
+        TestShape<P>(unbounded[i], r, side, nearestT, nearestId);
+    tests += unbounded.size();
+
+    const WideBVH& wide = tree.wide;
+    Vector<3,float> invDir(1.0f / r.direction[0],
+                           1.0f / r.direction[1],
+                           1.0f / r.direction[2]);
+    if (lazy ? !lazy->nodes.empty() : !wide.nodes.empty()) {
+        // children are pushed far to near, and skipped once a nearer
+        // hit has been found
+        WideBVH::Entry stack[WideBVH::STACK_SIZE];
+        unsigned int sp = 0;
+        stack[sp].index = 0;
+        stack[sp].count = 0;
+        stack[sp++].t = 0;
+        while (sp) {
+            const WideBVH::Entry e = stack[--sp];
+            if (e.t >= nearestT)
+                continue;
+            if (e.count) {
+                const unsigned int* prims = lazy ? &lazy->prims[e.index] : &wide.prims[e.index];
+                for (unsigned int k=0;k<e.count;k++)
+                    TestShape<P>(prims[k], r, side, nearestT, nearestId);
+                tests += e.count;
+                continue;
+            }
+            if (lazy) {
+                const LazyBVH::Node& node = lazy->nodes[e.index];
+                tests++;
+                if (BVH::HitsBox(r, invDir, node.bmin, node.bmax, nearestT))
+                    sp = PushLazy(*lazy, e.index, stack, sp);
+                continue;
             }
+            const WideBVH::Node& node = wide.nodes[e.index];
+            tests++;
+            float t[WideBVH::WIDTH];
+            unsigned int hits = WideBVH::HitChildren(node, r, invDir, nearestT, t);
+            sp = WideBVH::Push(node, hits, t, stack, sp);
         }
     }
 
-    if (nearestObj) {
+    if (bricks.IsOpen())
+        bricks.Nearest(r, invDir, side, nearestT, nearestId);
 
-        if (debug) {
+    if (cost)
+        *cost = tests;
+
+    if (nearestId < objects.size() || BrickStore::IsBrick(nearestId)) {
+        Shape* nearestObj = ShapeOf(nearestId);
+
+        if (P::VERBOSE) {
             logger.info  << " best t = " << nearestT
                          << " => " << nearestObj
                          << logger.end;
         }
 
 
-        point = nearestPoint;
+        point = r.origin + r.direction * nearestT;
+        if (id)
+            *id = nearestId;
         return nearestObj;
     }
 
-    if (debug)
+    if (P::VERBOSE)
         logger.info  <<" best t = 0" << logger.end;
 
 
@@ -197,110 +468,446 @@ Shape* RayTracer::NearestShape(Ray r, Vector<3,float>& point, bool debug, Hit si
 }
 
 
-Vector<4,float> RayTracer::TraceRay(const Ray r, int depth, bool debug, Hit side, float rIndex, list<RayHit>* rayCollection) {
-    if (depth > maxDepth)
-        return Vector<4,float>();    
+template <class P>
+bool RayTracer::Occluded(Vector<3,float> from, Vector<3,float> to, Shape* self) {
+    PhaseSum<P::STATS> phase(Profiler::SHADOWS);
+    bool occluded = OccludedSegment<P>(from, to, self);
+    if (P::STATS && rayBuffer) {
+        Ray r;
+        r.origin = from;
+        r.direction = (to - from).GetNormalize();
+        rayBuffer->Add(r, (to - from).GetLength(),
+                       occluded ? RayLog::OCCLUDED : RayLog::MISS,
+                       0, 0, RayLog::SHADOW);
+    }
+    return occluded;
+}
+
+template <class P>
+bool RayTracer::OccludedSegment(Vector<3,float> from, Vector<3,float> to, Shape* self) {
+    Ray shaddowRay;
+    shaddowRay.origin = from;
+
+    Vector<3,float> lineToLight = (to - from);
+    float distToLight = lineToLight.GetLength();
+
+    shaddowRay.direction = lineToLight / distToLight;
+
+    const BVH& tree = LocalBVH();
+    const WideBVH& wide = tree.wide;
+    LazyBVH* lazy = bvhUpdater->lazy;
+    const vector<unsigned int>& unbounded = lazy ? lazy->unbounded : tree.unbounded;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    unsigned int leaf = 0;
+    unsigned int leafCount = unbounded.size();
+    const unsigned int* leafPrims = leafCount ? &unbounded[0] : NULL;
+    if (lazy ? !lazy->nodes.empty() : !wide.nodes.empty()) {
+        stack[sp].index = 0;
+        stack[sp].count = 0;
+        stack[sp++].t = 0;
+    }
+
+    Vector<3,float> invDir(1.0f / shaddowRay.direction[0],
+                           1.0f / shaddowRay.direction[1],
+                           1.0f / shaddowRay.direction[2]);
+
+    // the unbounded shapes are tested as if they were the first leaf
+    for (;;) {
+        for (;leaf<leafCount;leaf++) {
+            const Object& o = LocalObjects()[leafPrims[leaf]];
+
+            if (o.shape == self)
+                continue;
+
+            float t;
+            if (IntersectObject(o, shaddowRay, HIT_OUT, distToLight, t)) {
+                if (P::VERBOSE)
+                    logger.info << "shadow ray blocked by " << leafPrims[leaf]
+                                << " at t = " << t << logger.end;
+                return true;
+            }
+        }
+
+        if (sp == 0)
+            return bricks.IsOpen() && bricks.Occluded(shaddowRay, invDir, distToLight);
+
+        const WideBVH::Entry e = stack[--sp];
+        if (e.count) {
+            leaf = 0;
+            leafCount = e.count;
+            leafPrims = lazy ? &lazy->prims[e.index] : &wide.prims[e.index];
+            continue;
+        }
+        if (lazy) {
+            const LazyBVH::Node& node = lazy->nodes[e.index];
+            if (BVH::HitsBox(shaddowRay, invDir, node.bmin, node.bmax, distToLight))
+                sp = PushLazy(*lazy, e.index, stack, sp);
+            continue;
+        }
+        float t[WideBVH::WIDTH];
+        unsigned int hits = WideBVH::HitChildren(wide.nodes[e.index], shaddowRay,
+                                                 invDir, distToLight, t);
+        sp = WideBVH::Push(wide.nodes[e.index], hits, t, stack, sp);
+    }
+}
+
+template <class P>
+void RayTracer::OccludePacket(ShadowPacket& packet) {
+    PhaseSum<P::STATS> phase(Profiler::SHADOWS);
+    unsigned int size = packet.Size();
+    unsigned int left = size;
+
+    const BVH& tree = LocalBVH();
+    const WideBVH& wide = tree.wide;
+    LazyBVH* lazy = bvhUpdater->lazy;
+    const vector<unsigned int>& unbounded = lazy ? lazy->unbounded : tree.unbounded;
+    WideBVH::Entry stack[WideBVH::STACK_SIZE];
+    unsigned int sp = 0;
+    unsigned int leaf = 0;
+    unsigned int leafCount = unbounded.size();
+    const unsigned int* leafPrims = leafCount ? &unbounded[0] : NULL;
+    if (lazy ? !lazy->nodes.empty() : !wide.nodes.empty()) {
+        stack[sp].index = 0;
+        stack[sp].count = 0;
+        stack[sp++].t = 0;
+    }
+
+    // the unbounded shapes are tested as if they were the first leaf
+    while (left > 0) {
+        for (;leaf<leafCount && left>0;leaf++) {
+            const Object& o = LocalObjects()[leafPrims[leaf]];
+
+            // one box test rejects the object for the whole packet
+            if (o.bounded && !packet.Overlaps(o.bmin, o.bmax))
+                continue;
+
+            Shape *s2 = o.shape;
+
+            for (unsigned int i=0;i<size;i++) {
+                if (packet.occluded[i] || packet.ignore[i] == s2)
+                    continue;
+
+                float t;
+                if (IntersectObject(o, packet.rays[i], HIT_OUT, packet.maxT[i], t)) {
+                    packet.occluded[i] = true;
+                    left--;
+                }
+            }
+        }
+
+        if (sp == 0)
+            break;
+
+        const WideBVH::Entry e = stack[--sp];
+        if (e.count) {
+            leaf = 0;
+            leafCount = e.count;
+            leafPrims = lazy ? &lazy->prims[e.index] : &wide.prims[e.index];
+            continue;
+        }
+
+        // and whole subtrees the packet box misses
+        if (lazy) {
+            const LazyBVH::Node& node = lazy->nodes[e.index];
+            if (packet.Overlaps(node.bmin, node.bmax))
+                sp = PushLazy(*lazy, e.index, stack, sp);
+            continue;
+        }
+        const WideBVH::Node& node = wide.nodes[e.index];
+        unsigned int hits = 0;
+        float t[WideBVH::WIDTH];
+        for (unsigned int k=0;k<WideBVH::WIDTH;k++) {
+            Vector<3,float> bmin, bmax;
+            WideBVH::ChildBox(node, k, bmin, bmax);
+            t[k] = 0;
+            if (WideBVH::Valid(node, k) && packet.Overlaps(bmin, bmax))
+                hits |= 1 << k;
+        }
+        sp = WideBVH::Push(node, hits, t, stack, sp);
+    }
+
+    // brick spheres ray by ray, for what the scene left unoccluded
+    for (unsigned int i=0;i<size && left>0 && bricks.IsOpen();i++) {
+        if (packet.occluded[i])
+            continue;
+        const Ray& r = packet.rays[i];
+        Vector<3,float> invDir(1.0f / r.direction[0],
+                               1.0f / r.direction[1],
+                               1.0f / r.direction[2]);
+        if (bricks.Occluded(r, invDir, packet.maxT[i])) {
+            packet.occluded[i] = true;
+            left--;
+        }
+    }
+
+    if (P::STATS && rayBuffer) {
+        for (unsigned int i=0;i<size;i++)
+            rayBuffer->Add(packet.rays[i], packet.maxT[i],
+                           packet.occluded[i] ? RayLog::OCCLUDED : RayLog::MISS,
+                           0, 0, RayLog::SHADOW);
+    }
+}
+
+template <class P>
+float RayTracer::SampleLightVisibility(const Light& l, Vector<3,float> p, Vector<3,float> n, Shape* self) {
+    Vector<3,float> from = OffsetRayOrigin(p, FaceTowards(n, l.pos - p));
+    if (l.type == Light::POINT)
+        return Occluded<P>(from, l.pos, self) ? 0.0 : 1.0;
+
+    unsigned int seed = HashPoint(p);
+    unsigned int probes = probeGrid * probeGrid;
+    unsigned int visible = 0;
+    float s,t;
+
+    for (unsigned int i=0;i<probes;i++) {
+        StratifiedSample(i, probeGrid, seed, s, t);
+        if (!Occluded<P>(from, l.SamplePoint(p,s,t), self))
+            visible++;
+    }
+
+    // fully lit or fully in shadow, the probes agree
+    if (visible == 0 || visible == probes)
+        return float(visible) / probes;
+
+    // penumbra
+    unsigned int refine = refineGrid * refineGrid;
+    for (unsigned int i=0;i<refine;i++) {
+        StratifiedSample(i, refineGrid, seed + probes, s, t);
+        if (!Occluded<P>(from, l.SamplePoint(p,s,t), self))
+            visible++;
+    }
+    return float(visible) / (probes + refine);
+}
+
+template <class P>
+float RayTracer::LightVisibility(unsigned int li, Vector<3,float> p, Vector<3,float> n, unsigned int id) {
+    float vis;
+    if (frameCaching && visCache.Lookup(p, li, id, vis))
+        return vis;
+
+    vis = SampleLightVisibility<P>(lights[li], p, n, ShapeOf(id));
+
+    // a ray that missed a brick may have missed its occluder
+    if (frameCaching && !BrickStore::Missed())
+        visCache.Store(p, li, id, vis);
+    return vis;
+}
+
+template <class P>
+void RayTracer::TileLightVisibility(TileContext& ctx, unsigned int li) {
+    const Light& l = lights[li];
+    unsigned int nLights = lights.size();
+    unsigned int probes = (l.type == Light::POINT) ? 1 : probeGrid * probeGrid;
+    unsigned int refine = refineGrid * refineGrid;
+    float s,t;
+
+    // probe rays for every hit in the tile share one packet
+    ctx.probePacket.Clear();
+    for (unsigned int i=0;i<ctx.nHits;i++) {
+        TileHit& h = ctx.hits[i];
+        ctx.cached[i] = false;
+        if (!h.shape)
+            continue;
+        if (frameCaching &&
+            visCache.Lookup(h.p, li, h.id, ctx.vis[i*nLights + li])) {
+            ctx.cached[i] = true;
+            continue;
+        }
+        Vector<3,float> from = OffsetRayOrigin(h.p, FaceTowards(h.n, l.pos - h.p));
+        if (l.type == Light::POINT) {
+            ctx.probePacket.Add(from, l.pos, h.shape);
+            continue;
+        }
+        unsigned int seed = HashPoint(h.p);
+        for (unsigned int j=0;j<probes;j++) {
+            StratifiedSample(j, probeGrid, seed, s, t);
+            ctx.probePacket.Add(from, l.SamplePoint(h.p,s,t), h.shape);
+        }
+    }
+    OccludePacket<P>(ctx.probePacket);
+
+    // hits where the probes disagree are refined in a second packet
+    ctx.refinePacket.Clear();
+    unsigned int k = 0;
+    for (unsigned int i=0;i<ctx.nHits;i++) {
+        TileHit& h = ctx.hits[i];
+        if (!h.shape || ctx.cached[i])
+            continue;
+        unsigned int visible = 0;
+        for (unsigned int j=0;j<probes;j++,k++) {
+            if (!ctx.probePacket.occluded[k])
+                visible++;
+        }
+        ctx.probeHits[i] = visible;
+        ctx.vis[i*nLights + li] = float(visible) / probes;
+
+        if (visible == 0 || visible == probes) {
+            if (frameCaching && !BrickStore::Missed())
+                visCache.Store(h.p, li, h.id, ctx.vis[i*nLights + li]);
+            continue;
+        }
+
+        Vector<3,float> from = OffsetRayOrigin(h.p, FaceTowards(h.n, l.pos - h.p));
+        unsigned int seed = HashPoint(h.p);
+        for (unsigned int j=0;j<refine;j++) {
+            StratifiedSample(j, refineGrid, seed + probes, s, t);
+            ctx.refinePacket.Add(from, l.SamplePoint(h.p,s,t), h.shape);
+        }
+    }
+
+    if (ctx.refinePacket.Size() == 0)
+        return;
+
+
+    OccludePacket<P>(ctx.refinePacket);
+
+    k = 0;
+    for (unsigned int i=0;i<ctx.nHits;i++) {
+        TileHit& h = ctx.hits[i];
+        unsigned int visible = ctx.probeHits[i];
+        if (!h.shape || ctx.cached[i] || visible == 0 || visible == probes)
+            continue;
+        for (unsigned int j=0;j<refine;j++,k++) {
+            if (!ctx.refinePacket.occluded[k])
+                visible++;
+        }
+        ctx.vis[i*nLights + li] = float(visible) / (probes + refine);
+        if (frameCaching && !BrickStore::Missed())
+            visCache.Store(h.p, li, h.id, ctx.vis[i*nLights + li]);
+    }
+}
+
+template <class P>
+Vector<4,float> RayTracer::TraceRay(const Ray r, int depth, Hit side, float rIndex, RayList* rayCollection) {
+    if (depth > maxDepth || depth > P::MAX_DEPTH)
+        return Vector<4,float>();
 
     Shape *nearestObj = 0;
     Vector<3,float> nearestPoint;
+    unsigned int id;
 
 
-    if (debug)
+    if (P::VERBOSE)
         logger.info << "Depth = " << depth << " " << side << logger.end;
 
     // Intersect all objects
 
-    nearestObj = NearestShape(r,nearestPoint,debug,side);
+    unsigned int cost;
+    nearestObj = NearestShape<P>(r,nearestPoint,side,&id,&cost);
+
+    if (P::STATS && rayBuffer) {
+        RayLog::Kind kind = depth == 0 ? RayLog::PRIMARY
+            : side == HIT_IN ? RayLog::INSIDE : RayLog::SECONDARY;
+        rayBuffer->Add(r, 0, nearestObj ? id : RayLog::MISS, cost, depth, kind);
+    }
 
-    if (rayCollection) {
+    if (P::COLLECT && rayCollection) {
         RayHit h;
         h.r = r;
         h.p = (nearestObj)?nearestPoint:(r.origin + r.direction*10);
-        
+
         if (nearestObj)
             rayCollection->push_back(h);
-        if (debug)
+        if (P::VERBOSE)
             logger.info << "added ray " << r << logger.end;
     }
 
 
     if (!nearestObj)
         return Vector<4,float>(0,0,0,1);
-    
 
+    Vector<3,float> norm = NormalAt(nearestObj, id, nearestPoint);
 
-    //logger.info << "distance " << nearestT << logger.end;
-
-    // check if shadow.
-    // Intersect lights
-    Vector<4,float> color = Vector<4,float>(0,0,0,1);
-    for (vector<Light>::iterator itr2 = lights.begin();
-         itr2 != lights.end();
-         itr2++) {
-        Light l = *itr2;
-
-        bool isShaddow = false;
-        Ray shaddowRay;
-        shaddowRay.origin = nearestPoint;
+    return ShadeHit<P>(r, id, nearestPoint, norm, depth, side, rIndex, rayCollection);
+}
 
-        Vector<3,float> lineToLight = (l.pos - nearestPoint);
+template <class P>
+Vector<4,float> RayTracer::ShadeHit(const Ray r, unsigned int id, Vector<3,float> nearestPoint, Vector<3,float> norm, int depth, Hit side, float rIndex, RayList* rayCollection, const float* visibility) {
+    ShadeKernel kernel = kernels[P::INDEX][MaterialOf(id).kind];
+    return (this->*kernel)(r, id, nearestPoint, norm, depth, side, rIndex, rayCollection, visibility);
+}
 
-        shaddowRay.direction = lineToLight.GetNormalize();
+static Ray ReflectionRay(const Ray& r, Vector<3,float> p, Vector<3,float> normal) {
+    Ray reflectionRay;
+    Vector<3,float> d = r.direction;
+    reflectionRay.direction = d - 2 * (normal * d ) * normal;
+    reflectionRay.origin = OffsetRayOrigin(p, FaceTowards(normal, reflectionRay.direction));
+    return reflectionRay;
+}
 
-        for (vector<Object>::iterator itr = objects.begin();
-             itr != objects.end();
-             itr++) {
+// false on total internal reflection
+static bool RefractionRay(const Ray& r, Vector<3,float> p, Vector<3,float> normal,
+                          float rIndex, float rIdx, Ray& refractionRay) {
+    float n = rIndex/rIdx;
+    float cosI = -( normal * r.direction);
+    float cosT2 = 1 - n*n*(1- cosI * cosI);
+    if (cosT2 <= 0)
+        return false;
+    Vector<3,float> T = (n * r.direction) + (n * cosI - sqrtf(cosT2)) * normal;
+    refractionRay.origin = OffsetRayOrigin(p, FaceTowards(normal, T));
+    refractionRay.direction = T;
+    return true;
+}
 
-            Shape *s2 = itr->shape;
+/**
+ * Shading kernel for one material kind and trace policy. The terms a
+ * kind does not have are compiled out, so there is no per hit
+ * branching on the material, and neither on debugging.
+ */
+template <unsigned int KIND, class P>
+Vector<4,float> RayTracer::Shade(const Ray r, unsigned int id, Vector<3,float> nearestPoint, Vector<3,float> norm, int depth, Hit side, float rIndex, RayList* rayCollection, const float* visibility) {
+    const ShadeMaterial& mat = MaterialOf(id);
 
-            if (s2 == nearestObj)
-                continue;
+    //logger.info << "distance " << nearestT << logger.end;
 
+    // check if shadow.
+    // Intersect lights
+    Vector<4,float> color = Vector<4,float>(0,0,0,1);
 
-            Vector<3,float> shaddowInterP;
-            if (s2->Intersect(shaddowRay, shaddowInterP) == HIT_OUT) {
+    for (unsigned int li=0;li<lights.size();li++) {
+        const Light& l = lights[li];
 
-                float dist = (shaddowInterP - shaddowRay.origin).GetLength();
-                float distToLight = (l.pos - shaddowRay.origin).GetLength();
-                if (dist < distToLight)
-                    isShaddow = true;
+        float vis = visibility
+            ? visibility[li]
+            : LightVisibility<P>(li, nearestPoint, norm, id);
 
-            }
-        }
+        if (vis > 0) {
 
-        if (!isShaddow) {
-
-            Vector<3,float> norm = nearestObj->NormalAt(nearestPoint);
-            float diff = (shaddowRay.direction * norm );
+            Vector<3,float> L = (l.pos - nearestPoint).GetNormalize();
+            float diff = (L * norm );
 
 
             if (diff > 0) {
                 // diffuse
-                Vector<4,float> diffuse = diff * VecMult(l.color, nearestObj->mat->diffuse);
-                if (debug) logger.info << "Diffuse: " << diffuse << logger.end;
+                Vector<4,float> diffuse = (vis * diff) * VecMult(l.color, mat.diffuse);
+                if (P::VERBOSE) logger.info << "Diffuse: " << diffuse << logger.end;
                 color += diffuse;
             }
 
-            // specular (phong)
-            Vector<3,float> V = r.direction;
-            Vector<3,float> L = shaddowRay.direction;
+            if (KIND & ShadeMaterial::SPECULAR) {
+                // specular (phong)
+                Vector<3,float> V = r.direction;
+
 
+                Vector<3,float> R = L - 2.0f * ( L * norm ) * norm;
 
-            Vector<3,float> R = L - 2.0f * ( L * norm ) * norm;
+                float dot = V * R;
+                if (dot > 0) {
+                    Vector<4,float> spec = (vis * powf(dot,mat.shininess)) * mat.specular;
+                    Vector<4,float> specular = VecMult(l.color , spec);
 
-            float dot = V * R;
-            if (dot > 0) {
-                Vector<4,float> spec = powf(dot,nearestObj->mat->shininess) * nearestObj->mat->specular;
-                Vector<4,float> specular = VecMult(l.color , spec);
-                
-                if (debug) logger.info << "Specular: " << specular << logger.end;
-                                
-                color += specular;
+                    if (P::VERBOSE) logger.info << "Specular: " << specular << logger.end;
+
+                    color += specular;
+                }
             }
 
+            if (P::VERBOSE && vis < 1)
+                logger.info << "penumbra " << vis << logger.end;
 
         } else {
-            if(debug)
+            if (P::VERBOSE)
                 logger.info << "shaddow!" << logger.end;
 
         }
@@ -310,22 +917,15 @@ Vector<4,float> RayTracer::TraceRay(const Ray r, int depth, bool debug, Hit side
 
     // REFLECTION
 
-    if (nearestObj->reflection > 0.0) {
-        Ray reflectionRay;
-        reflectionRay.origin = nearestPoint;
-        Vector<3,float> normal = nearestObj->NormalAt(nearestPoint);
-        Vector<3,float> d = r.direction;
-
-        reflectionRay.direction = d - 2 * (normal * d ) * normal;
+    if (KIND & ShadeMaterial::REFLECT) {
+        PhaseSum<P::STATS> phase(Profiler::REFLECT);
+        Ray reflectionRay = ReflectionRay(r, nearestPoint, norm);
 
-        reflectionRay.AddEps();
+        Vector<4,float> recurseColor = TraceRay<P>(reflectionRay,depth+1,
+                                                   side,rIndex,rayCollection);
+        float reflection = mat.reflection;
 
-        Vector<4,float> recurseColor = TraceRay(reflectionRay,depth+1,
-                                                debug,side,
-                                                rIndex,rayCollection);
-        float reflection = nearestObj->reflection;
-
-        if (debug)
+        if (P::VERBOSE)
             logger.info << "reflection color = "
                         << recurseColor * reflection
                         << logger.end;
@@ -334,26 +934,17 @@ Vector<4,float> RayTracer::TraceRay(const Ray r, int depth, bool debug, Hit side
     }
 
     // REFRACTION
-    if (nearestObj->transparent) {
-        float rIdx = nearestObj->refraction;
-        float n = rIndex/rIdx;
-        Vector<3,float> normal = nearestObj->NormalAt(nearestPoint);
-        float cosI = -( normal * r.direction);
-        float cosT2 = 1 - n*n*(1- cosI * cosI);
-        if (cosT2 > 0) {
-            Vector<3,float> T = (n * r.direction) + (n * cosI - sqrtf(cosT2)) * normal;
-            
-            Ray refractionRay;
-            refractionRay.origin = nearestPoint;
-            refractionRay.direction = T;
-            refractionRay.AddEps();
-
-            Vector<4,float> refracColor = TraceRay(refractionRay, depth+1, debug, (side==HIT_OUT)?HIT_IN:HIT_OUT, rIdx,rayCollection);
-            
+    if (KIND & ShadeMaterial::REFRACT) {
+        PhaseSum<P::STATS> phase(Profiler::REFRACT);
+        float rIdx = mat.refraction;
+        Ray refractionRay;
+        if (RefractionRay(r, nearestPoint, norm, rIndex, rIdx, refractionRay)) {
+            Vector<4,float> refracColor = TraceRay<P>(refractionRay, depth+1, (side==HIT_OUT)?HIT_IN:HIT_OUT, rIdx,rayCollection);
+
             color += refracColor;
-            if (debug)
+            if (P::VERBOSE)
                 logger.info << "Refraction " << refracColor << logger.end;
-            
+
 
         }
     }
@@ -370,6 +961,144 @@ Vector<4,float> RayTracer::TraceRay(const Ray r, int depth, bool debug, Hit side
     return color;
 }
 
+// Shades all primary hits of a tile that share one material kind.
+// With a secondary queue only the local terms are shaded here, and the
+// reflection and refraction rays wait for TraceSecondary.
+template <unsigned int KIND, class P>
+void RayTracer::ShadeBin(TileContext& ctx, const unsigned int* bin, unsigned int n) {
+    unsigned int nLights = lights.size();
+    for (unsigned int j=0;j<n;j++) {
+        unsigned int i = bin[j];
+        TileHit& h = ctx.hits[i];
+        const float* vis = nLights ? &ctx.vis[i*nLights] : NULL;
+        if (!ctx.secondary) {
+            ctx.colors[i] = Shade<KIND,P>(h.r, h.id, h.p, h.n, 0, HIT_OUT, 1.0, NULL, vis);
+            continue;
+        }
+
+        ctx.colors[i] = Shade<KIND & ShadeMaterial::SPECULAR,P>(h.r, h.id, h.p, h.n, 0,
+                                                                HIT_OUT, 1.0, NULL, vis);
+        const ShadeMaterial& mat = MaterialOf(h.id);
+        if (KIND & ShadeMaterial::REFLECT) {
+            SecondaryRay& s = ctx.secondary[ctx.nSecondary++];
+            s.r = ReflectionRay(h.r, h.p, h.n);
+            s.side = HIT_OUT;
+            s.rIndex = 1.0;
+            s.weight = mat.reflection;
+            s.hit = i;
+        }
+        if (KIND & ShadeMaterial::REFRACT) {
+            SecondaryRay& s = ctx.secondary[ctx.nSecondary];
+            if (RefractionRay(h.r, h.p, h.n, 1.0, mat.refraction, s.r)) {
+                s.side = HIT_IN;
+                s.rIndex = mat.refraction;
+                s.weight = 1.0;
+                s.hit = i;
+                ctx.nSecondary++;
+            }
+        }
+    }
+}
+
+// 9 bits of x spread out to every third bit
+static unsigned int SpreadBits(unsigned int x) {
+    x &= 0x1ff;
+    x = (x | x << 16) & 0x030000ff;
+    x = (x | x << 8) & 0x0300f00f;
+    x = (x | x << 4) & 0x030c30c3;
+    x = (x | x << 2) & 0x09249249;
+    return x;
+}
+
+bool RayTracer::SecondaryBefore(const SecondaryRay& a, const SecondaryRay& b) {
+    return a.key < b.key;
+}
+
+/**
+ * Traces the queued secondary rays of a tile. Rays are sorted by
+ * direction octant and then along a Morton curve through a 512^3 grid
+ * over their origins, so consecutive rays mostly visit the same BVH
+ * nodes and objects while those are still in cache.
+ */
+template <class P>
+void RayTracer::TraceSecondary(TileContext& ctx) {
+    unsigned int n = ctx.nSecondary;
+    if (n == 0)
+        return;
+
+    Vector<3,float> bmin = ctx.secondary[0].r.origin;
+    Vector<3,float> bmax = bmin;
+    for (unsigned int i=1;i<n;i++) {
+        const Vector<3,float>& o = ctx.secondary[i].r.origin;
+        for (unsigned int a=0;a<3;a++) {
+            bmin[a] = min(bmin[a], o[a]);
+            bmax[a] = max(bmax[a], o[a]);
+        }
+    }
+    for (unsigned int i=0;i<n;i++) {
+        SecondaryRay& s = ctx.secondary[i];
+        unsigned int key = 0;
+        for (unsigned int a=0;a<3;a++) {
+            float extent = bmax[a] - bmin[a];
+            unsigned int cell = extent > 0
+                ? (unsigned int)((s.r.origin[a] - bmin[a]) / extent * 511.0f) : 0;
+            key |= SpreadBits(cell) << a;
+            if (s.r.direction[a] < 0)
+                key |= 1 << (27 + a);
+        }
+        s.key = key;
+    }
+    sort(ctx.secondary, ctx.secondary + n, SecondaryBefore);
+
+    for (unsigned int i=0;i<n;i++) {
+        const SecondaryRay& s = ctx.secondary[i];
+        ctx.colors[s.hit] += TraceRay<P>(s.r, 1, s.side, s.rIndex) * s.weight;
+    }
+    for (unsigned int i=0;i<n;i++) {
+        Vector<4,float>& c = ctx.colors[ctx.secondary[i].hit];
+        for (unsigned int k=0;k<4;k++)
+            c[k] = min(c[k], 1.0f);
+    }
+}
+
+template <class P>
+void RayTracer::SetupPolicyKernels() {
+    ShadeKernel* k = kernels[P::INDEX];
+    k[0] = &RayTracer::Shade<0,P>;
+    k[1] = &RayTracer::Shade<1,P>;
+    k[2] = &RayTracer::Shade<2,P>;
+    k[3] = &RayTracer::Shade<3,P>;
+    k[4] = &RayTracer::Shade<4,P>;
+    k[5] = &RayTracer::Shade<5,P>;
+    k[6] = &RayTracer::Shade<6,P>;
+    k[7] = &RayTracer::Shade<7,P>;
+
+    BinShader* b = binShaders[P::INDEX];
+    b[0] = &RayTracer::ShadeBin<0,P>;
+    b[1] = &RayTracer::ShadeBin<1,P>;
+    b[2] = &RayTracer::ShadeBin<2,P>;
+    b[3] = &RayTracer::ShadeBin<3,P>;
+    b[4] = &RayTracer::ShadeBin<4,P>;
+    b[5] = &RayTracer::ShadeBin<5,P>;
+    b[6] = &RayTracer::ShadeBin<6,P>;
+    b[7] = &RayTracer::ShadeBin<7,P>;
+}
+
+void RayTracer::SetupKernels() {
+    SetupPolicyKernels<FastTrace>();
+    SetupPolicyKernels<StatsTrace>();
+    SetupPolicyKernels<CollectTrace>();
+    SetupPolicyKernels<DebugTrace>();
+}
+
+bool SameMatrix(const Matrix<4,4,float>& a, const Matrix<4,4,float>& b) {
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            if (a(i,j) != b(i,j))
+                return false;
+    return true;
+}
+
 Vector<3,float> TransformPoint(Vector<3,float> p, Matrix<4,4,float> m) {
     Vector<3,float> r;
 
@@ -431,28 +1160,354 @@ Ray RayTracer::RayForPoint(unsigned int u, unsigned int v) {
 
 }
 
-void RayTracer::Trace() {
-    if (!run)
-        return;
-    
+// Whether b holds other objects than a, or the same ones elsewhere.
+// Unbounded shapes are only compared by identity of their scene graph
+// shape.
+void RayTracer::CompareObjects(const vector<Object>& a, const vector<Object>& b,
+                               bool& added, bool& moved) {
+    added = a.size() != b.size();
+    moved = added;
+    for (unsigned int i=0;!added && i<a.size();i++) {
+        added = a[i].source != b[i].source;
+        moved = moved || added ||
+            a[i].bmin != b[i].bmin ||
+            a[i].bmax != b[i].bmax;
+    }
+}
+
+// Drops cached shadow results and the frame history when geometry
+// or lights have moved since the last frame.
+void RayTracer::UpdateSceneState(const SceneBVH& scene) {
+    visCache.ResetStats();
+
+    bvhUpdateTime = scene.updateTime;
+    if (scene.moved)
+        visCache.InvalidateAll();
+    geometryChanged = scene.moved;
+    sceneChanged = scene.moved || scene.shading;
+
+    for (unsigned int li=0;li<lights.size();li++) {
+        if (li >= lastLights.size() || !(lights[li] == lastLights[li])) {
+            visCache.InvalidateLight(li);
+            sceneChanged = true;
+        }
+    }
+    lastLights = lights;
+}
+
+bool RayTracer::Reusable(unsigned int u, unsigned int v) {
+    FrameHistory& cur = history[historyIdx];
+    unsigned int i = v*cur.width + u;
+    if (!cur.reused[i] || (markX == u && markY == v))
+        return false;
+    // a rotating subset is traced anyway to refresh view dependent
+    // shading and hide reprojection errors
+    return HashUInt(i) % temporalRefresh != traceNum % temporalRefresh;
+}
+
+void RayTracer::WritePixel(unsigned int u, unsigned int v,
+                           unsigned char r, unsigned char g, unsigned char b) {
+    (*target)(u,v,0) = r;
+    (*target)(u,v,1) = g;
+    (*target)(u,v,2) = b;
+
+    if (frameMark && (markX == u || markY == v)) {
+        (*target)(u,v,0) = -1;
+        (*target)(u,v,1) = 0;
+        (*target)(u,v,2) = 0;
+    }
+}
+
+template <class P>
+bool RayTracer::TraceTile(TileContext& ctx,
+                          unsigned int x0, unsigned int y0,
+                          unsigned int x1, unsigned int y1) {
+    Profiler::Scope tile("tile", x0, y0);
+
+    FrameHistory& cur = history[historyIdx];
+    BrickStore::ClearMissed();
+
+    // Primary hits for the whole tile first, so the shadow rays of
+    // neighbouring pixels can be traced together as packets.
+    Arena::Mark mark = ctx.arena.GetMark();
+    ctx.hits = ctx.arena.Allocate<TileHit>((x1-x0) * (y1-y0));
+    ctx.nHits = 0;
+    {
+        Profiler::Scope phase("primary");
+        for (unsigned int v=y0;v<y1;v++) {
+            for (unsigned int u=x0;u<x1;u++) {
+                if (temporal && Reusable(u,v)) {
+                    unsigned int i = (v*cur.width + u)*3;
+                    WritePixel(u, v, cur.color[i], cur.color[i+1], cur.color[i+2]);
+                    if (frameDenoise)
+                        denoiser.Skip(u, v);
+                    continue;
+                }
+
+                unsigned int idx = v*cur.width + u;
+                if (firstHitsValid) {
+                    // the hit is the same, but it points into the last
+                    // frame's snapshot
+                    TileHit h = firstHits[idx];
+                    if (h.shape)
+                        h.shape = ShapeOf(h.id);
+                    ctx.hits[ctx.nHits++] = h;
+                    continue;
+                }
+
+                TileHit h;
+                h.u = u;
+                h.v = v;
+
+                // Create ray from eyepoint passing throuth this pixel
+                h.r = RayForPoint(u,v);
+                unsigned int cost;
+                h.shape = NearestShape<P>(h.r, h.p, HIT_OUT, &h.id, &cost);
+                if (P::STATS && rayBuffer)
+                    rayBuffer->Add(h.r, 0, h.shape ? h.id : RayLog::MISS,
+                                   cost, 0, RayLog::PRIMARY);
+                // a miss has no geometry for the history or the
+                // denoiser to look at
+                if (h.shape)
+                    h.n = NormalAt(h.shape, h.id, h.p);
+                else
+                    h.p = h.n = Vector<3,float>(0);
+                firstHits[idx] = h;
+                ctx.hits[ctx.nHits++] = h;
+            }
+        }
+    }
+
+    ctx.vis = ctx.arena.Allocate<float>(ctx.nHits * lights.size());
+    ctx.probeHits = ctx.arena.Allocate<unsigned int>(ctx.nHits);
+    ctx.cached = ctx.arena.Allocate<bool>(ctx.nHits);
+    {
+        Profiler::Scope phase("shadows");
+        for (unsigned int li=0;li<lights.size();li++)
+            TileLightVisibility<P>(ctx, li);
+    }
+
+    // bin the hits by material kind and shade each bin with its kernel
+    for (unsigned int k=0;k<ShadeMaterial::KINDS;k++) {
+        ctx.bins[k] = ctx.arena.Allocate<unsigned int>(ctx.nHits);
+        ctx.binSize[k] = 0;
+    }
+    ctx.colors = ctx.arena.Allocate<Vector<4,float> >(ctx.nHits);
+    // at most a reflection and a refraction ray per hit
+    ctx.secondary = secondarySorting
+        ? ctx.arena.Allocate<SecondaryRay>(2 * ctx.nHits) : NULL;
+    ctx.nSecondary = 0;
+    for (unsigned int i=0;i<ctx.nHits;i++) {
+        TileHit& h = ctx.hits[i];
+        if (markDebug && markX == h.u && markY == h.v)
+            ctx.colors[i] = TraceRay<DebugTrace>(h.r,0);
+        else if (!h.shape)
+            ctx.colors[i] = Vector<4,float>(0,0,0,1);
+        else {
+            unsigned int k = MaterialOf(h.id).kind;
+            ctx.bins[k][ctx.binSize[k]++] = i;
+        }
+    }
+    {
+        Profiler::Scope phase("shade");
+        for (unsigned int k=0;k<ShadeMaterial::KINDS;k++) {
+            if (ctx.binSize[k])
+                (this->*binShaders[P::INDEX][k])(ctx, ctx.bins[k], ctx.binSize[k]);
+        }
+    }
+    {
+        Profiler::Scope phase("secondary");
+        TraceSecondary<P>(ctx);
+    }
+
+    // the whole tile is traced again in the next pass
+    if (BrickStore::Missed()) {
+        ctx.arena.Rewind(mark);
+        return false;
+    }
+
+    {
+        Profiler::Scope phase("write");
+        for (unsigned int i=0;i<ctx.nHits;i++) {
+            TileHit& h = ctx.hits[i];
+            unsigned int u = h.u;
+            unsigned int v = h.v;
+            Vector<4,float> col = ctx.colors[i];
+
+            float depth = -1;
+            if (h.shape) {
+                Vector<4,float> q = _tmpView * Vector<4,float>(h.p[0],h.p[1],h.p[2],1);
+                depth = -q[2];
+            }
+            cur.Set(u, v, depth, h.p, col);
+            if (frameDenoise)
+                denoiser.Set(u, v, col, h.n,
+                             h.shape ? MaterialOf(h.id).diffuse : Vector<4,float>(0),
+                             depth);
+
+            WritePixel(u, v, col[0]*255, col[1]*255, col[2]*255);
+            //(*texture)(u,v,3) = col[3]*255;
+        }
+    }
+    ctx.arena.Rewind(mark);
+    return true;
+}
+
+void RayTracer::CaptureScene() {
+    snapshots[1-snapshotIdx].Capture(root);
+    sceneBVHs[1-snapshotIdx].prepared = false;
+
+    if (volume) {
+        _nextIV = volume->GetViewMatrix().GetInverse();
+        _nextProj = volume->GetProjectionMatrix();
+    }
+}
+
+// Only touches the back snapshot and its tree, and reads the front
+// ones, which do not change while a frame is traced.
+void RayTracer::PrepareScene() {
+    unsigned int back = 1 - snapshotIdx;
+    const SceneSnapshot& snap = snapshots[back];
+    SceneBVH& scene = sceneBVHs[back];
+    const SceneBVH& front = sceneBVHs[snapshotIdx];
+    BVHUpdater& updater = scene.updater;
+
     Timer t;
     t.Reset();
     t.Start();
 
-    // lock
+    // only the tree depends on the object order, moving objects
+    // around just refits it; a new build method rebuilds it as well
+    bool added, moved;
+    CompareObjects(scene.fitted, snap.objects, added, moved);
+    bool rebuild = added || bvhMethod != updater.method;
+    updater.method = bvhMethod;
+    updater.threads = max(1u, threads);
+
+    bool frontAdded, frontMoved;
+    CompareObjects(front.fitted, snap.objects, frontAdded, frontMoved);
+    if (rebuild && !frontAdded && !front.updater.lazy &&
+        front.updater.method == bvhMethod) {
+        // the tree being traced holds the same objects, a copy of it
+        // is refitted instead of building the same tree again
+        updater.Adopt(front.updater);
+        updater.Update(snap.objects, false);
+    } else if (rebuild || moved) {
+        updater.Update(snap.objects, rebuild);
+        const BVH& tree = updater.bvh;
+        if (rebuild && !updater.lazy)
+            logger.info << "BVH: " << (tree.method == BVH::LBVH ? "LBVH" : "SAH")
+                        << " build of " << snap.objects.size() << " objects on "
+                        << tree.buildThreads << " threads took "
+                        << tree.buildTime * 1000 << " ms, SAH cost "
+                        << tree.buildCost << logger.end;
+    } else
+        updater.Poll(snap.objects);
+    scene.fitted = snap.objects;
+    t.Stop();
+    scene.updateTime = Seconds(t.GetElapsedTime());
+
+    // against the snapshot being traced
+    CompareObjects(objects, snap.objects, added, scene.moved);
+    scene.shading = !(snap.materials == materials);
+    scene.prepared = true;
+}
+
+void RayTracer::ApplyScene() {
+    if (!sceneBVHs[1-snapshotIdx].prepared)
+        PrepareScene();
+    snapshotIdx = 1 - snapshotIdx;
+    SceneSnapshot& snap = snapshots[snapshotIdx];
+    SceneBVH& scene = sceneBVHs[snapshotIdx];
+    scene.prepared = false;
+
+    if (volume) {
+        _tmpIV = _nextIV;
+        _tmpProj = _nextProj;
+    }
 
+    // the debug node traces from the render thread
     objectsLock.Lock();
-    objects.clear();
-    root->Accept(*this);
+    objects = snap.objects;
+    materials = snap.materials;
+    bvhUpdater = &scene.updater;
+    UpdateSceneState(scene);
+    sceneVersion++;
     objectsLock.Unlock();
+}
+
+void RayTracer::UpdateTarget() {
+    unsigned int w = renderWidth, h = renderHeight;
+    if (w == 0 || h == 0) {
+        w = max(1u, (unsigned int)(texture->GetWidth() * renderScale + 0.5f));
+        h = max(1u, (unsigned int)(texture->GetHeight() * renderScale + 0.5f));
+    }
+    if (w == target->GetWidth() && h == target->GetHeight())
+        return;
+
+    if (w == texture->GetWidth() && h == texture->GetHeight())
+        target = texture;
+    else {
+        target = EmptyTextureResource::Create(w, h, 24);
+        target->Load();
+    }
+    width = w;
+    height = h;
+    fovY = height/width * fovX;
 
+    // the history is resized along, the first hits are not
+    firstHitsComplete = false;
+
+    logger.info << "Render resolution " << w << "x" << h << logger.end;
+}
+
+void RayTracer::BeginFrame() {
+    Profiler::Scope phase("begin frame");
+    UpdateTarget();
+    UpdateRayLog();
+    UpdateTileStream();
+
+    tileLock.Lock();
+    cropped = cropRequested;
+    frameCrop = crop;
+    tileLock.Unlock();
+    if (cropped) {
+        frameCrop.x1 = min(frameCrop.x1, target->GetWidth());
+        frameCrop.y1 = min(frameCrop.y1, target->GetHeight());
+        cropped = frameCrop.x0 < frameCrop.x1 && frameCrop.y0 < frameCrop.y1;
+    }
+
+    // a crop window may be traced with more shadow samples, whose
+    // results must not end up in the cache
+    unsigned int scale = cropped ? max(1u, cropSamples) : 1;
+    probeGrid = shadowProbeGrid * scale;
+    refineGrid = shadowRefineGrid * scale;
+    frameCaching = visibilityCaching && scale == 1;
+    frameDenoise = denoise && denoiseIterations > 0;
+    frameMark = false;
+    if (frameDenoise)
+        denoiser.Resize(target->GetWidth(), target->GetHeight());
+    denoiseTime = 0;
+    bricks.SetBudget((unsigned long)max(1u, brickBudget) << 20);
+    framePasses = 0;
 
-    _tmpIV = volume->GetViewMatrix().GetInverse();
-    _tmpProj = volume->GetProjectionMatrix();
     _tmpOrigo = Vector<3,float>(_tmpIV(3,0), // iv is not transposed!
                                 _tmpIV(3,1),
                                 _tmpIV(3,2));
 
+    // Primary visibility only depends on the camera and the geometry,
+    // so material and light edits can reuse last frame's first hits.
+    bool sameView = SameMatrix(_tmpIV, _lastIV) && SameMatrix(_tmpProj, _lastProj);
+    _lastIV = _tmpIV;
+    _lastProj = _tmpProj;
+    firstHits.resize(target->GetWidth() * target->GetHeight());
+    firstHitsValid = firstHitCaching && firstHitsComplete &&
+        sameView && !geometryChanged;
+
+    Matrix<4,4,float> ivT = _tmpIV;
+    ivT.Transpose();
+    _tmpView = ivT.GetInverse();
+
     logger.info << _tmpProj << logger.end;
 
     if (markDebug) {
@@ -481,66 +1536,870 @@ void RayTracer::Trace() {
     // }
 
     traceNum++;
-    for (unsigned int v=0;v<texture->GetHeight();v++) {
-        for (unsigned int u=0;u<texture->GetWidth();u++) {
 
-            (*texture)(u,v,0) = -1;
-            (*texture)(u,v,1) = 0;
-            (*texture)(u,v,2) = 0;
-            (*texture)(u,v,3) = -1;
+    // seed this frame with the last one seen through the new camera
+    FrameHistory& prev = history[1-historyIdx];
+    FrameHistory& cur = history[historyIdx];
+    prev.Resize(target->GetWidth(), target->GetHeight());
+    cur.Resize(target->GetWidth(), target->GetHeight());
+    if (!temporal || sceneChanged || cropped)
+        prev.Invalidate();
+    reusedPixels = cur.Reproject(prev, _tmpView, _tmpProj(0,0), _tmpProj(1,1));
+    remoteFrame = false;
+}
 
+void RayTracer::RenderRegion(unsigned int x0, unsigned int y0,
+                             unsigned int x1, unsigned int y1) {
+    Profiler::Scope phase("trace tiles");
+
+    unsigned int rows = (y1 - y0 + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int cols = (x1 - x0 + TILE_SIZE - 1) / TILE_SIZE;
+    unsigned int n = max(1u, min(threads, rows * cols));
+    frameThreads = n;
+    frameNodes = numaAware ? max(1u, min(NumaNodes(), min(n, rows))) : 1;
+    while (replicas.size() < frameNodes) {
+        replicas.push_back(new SceneReplica());
+        replicas.back()->version = 0;
+    }
 
-            // Create ray from eyepoint passing throuth this pixel
+    // each node gets a band of rows, so it keeps writing the same part
+    // of the frame
+    tiles.clear();
+    for (unsigned int y=y0;y<y1;y+=TILE_SIZE) {
+        for (unsigned int x=x0;x<x1;x+=TILE_SIZE) {
+            Tile t;
+            t.x0 = x;
+            t.y0 = y;
+            t.x1 = min(x+TILE_SIZE, x1);
+            t.y1 = min(y+TILE_SIZE, y1);
+            t.priority = 0;
+            t.node = (y - y0) / TILE_SIZE * frameNodes / rows;
+            tiles.push_back(t);
+        }
+    }
+    PrioritizeTiles();
+    nextTile.assign(frameNodes, 0);
 
+    if (tileContexts.size() < n)
+        tileContexts.resize(n);
 
-            Ray r = RayForPoint(u,v);
+    // the tile loop must not allocate, see AllocationCounter.h
+    unsigned int pixels = TILE_SIZE * TILE_SIZE;
+    for (unsigned int i=0;i<n;i++) {
+        tileContexts[i].probePacket.Reserve(pixels * max(1u, probeGrid * probeGrid));
+        tileContexts[i].refinePacket.Reserve(pixels * refineGrid * refineGrid);
+    }
+    // a tile and its five phases; twice the fair share of a thread
+    if (profiling)
+        profiler.Reserve(2 * tiles.size() * 6 / n + 64);
+
+    // the tracer thread traces track 0, on the first node
+    if (frameNodes > 1 || tracerPinned) {
+        tracerPinned = frameNodes > 1;
+        PinThread(tracerPinned ? 0 : -1);
+    }
 
+    // Tiles that needed bricks which were not resident are traced
+    // again once the loader has brought those in. If no tile gets
+    // through, the bricks a tile needs do not fit the budget at once,
+    // and the rest is traced on this thread, loading as it goes.
+    deferredTiles.clear();
+    deferredTiles.reserve(tiles.size());
+    unsigned int stalls = 0;
+    for (framePasses=1;;framePasses++) {
+        TracePass(n);
+        tileLock.Lock();
+        bool canceling = cancelFrame;
+        tileLock.Unlock();
+        if (deferredTiles.empty() || canceling)
+            break;
+
+        unsigned int done = tiles.size() - deferredTiles.size();
+        objectsLock.Lock();
+        unsigned int loaded = bricks.EndPass();
+        objectsLock.Unlock();
+        tiles.swap(deferredTiles);
+        deferredTiles.clear();
+        nextTile.assign(frameNodes, 0);
+
+        if (done == 0 && (loaded == 0 || stalls++)) {
+            framePasses++;
+            // bricks loaded on the spot are allocated by this pass,
+            // they are not counted against the tile loop
+            unsigned long counted = tileContexts[0].allocations;
+            objectsLock.Lock();
+            BrickStore::SetBlocking(true);
+            TracePass(1);
+            BrickStore::SetBlocking(false);
+            objectsLock.Unlock();
+            tileContexts[0].allocations = counted;
+            break;
+        }
+    }
+}
 
+void RayTracer::TracePass(unsigned int n) {
+    // the calling thread traces tiles too
+    if (n == 1) {
+        TraceTiles(tileContexts[0]);
+        return;
+    }
 
-            //logger.info << "Ray: " << r << logger.end;
+    // the pool grows to the most tracks a pass has had
+    while (tileThreads.size() + 1 < n) {
+        TileThread* t = new TileThread(this, tileThreads.size() + 1);
+        t->Start();
+        tileThreads.push_back(t);
+    }
+    passThreads = n;
+    __atomic_store_n(&passDone, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tracePass, 1, __ATOMIC_RELEASE);
 
-            Vector<4,float> col;
-            if (markX == u && markY == v)
-                col = TraceRay(r,0,markDebug);
-            else
-                col = TraceRay(r,0);
+    TraceTiles(tileContexts[0]);
 
+    // they share the tiles, so the others finish about now too
+    while (__atomic_load_n(&passDone, __ATOMIC_ACQUIRE) < n - 1)
+        Thread::Sleep(0);
+}
 
-            (*texture)(u,v,0) = col[0]*255;
-            (*texture)(u,v,1) = col[1]*255;
-            (*texture)(u,v,2) = col[2]*255;
-            //(*texture)(u,v,3) = col[3]*255;
+RayTracer::TileThread::TileThread(RayTracer* rt, unsigned int track)
+    : rt(rt), track(track), pass(rt->tracePass) {}
+
+void RayTracer::TileThread::Run() {
+    unsigned int idle = 0;
+    for (;;) {
+        unsigned int p = __atomic_load_n(&rt->tracePass, __ATOMIC_ACQUIRE);
+        if (p == pass) {
+            Thread::Sleep(++idle < TILE_THREAD_SPINS ? 0 : 1000);
+            continue;
+        }
+        pass = p;
+        idle = 0;
+        if (rt->stopTileThreads)
+            return;
+        if (track < rt->passThreads) {
+            rt->TraceTiles(rt->tileContexts[track]);
+            __atomic_fetch_add(&rt->passDone, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
 
-            //logger.info << "color " << col << logger.end;
-            //Thread::Sleep(50000);
+bool RayTracer::TracedBefore(const Tile& a, const Tile& b) {
+    return a.priority > b.priority;
+}
+
+// Sorts the tiles of a region so the part of the image that matters
+// most converges first.
+void RayTracer::PrioritizeTiles() {
+    if (tileOrder == TILES_ROWS)
+        return;
+
+    float cx = width / 2, cy = height / 2;
+    if (tileOrder == TILES_FOCUS) {
+        cx = focusX * width / texture->GetWidth();
+        cy = focusY * height / texture->GetHeight();
+    } else if (tileOrder == TILES_MARK) {
+        cx = markX;
+        cy = markY;
+    }
+
+    FrameHistory& cur = history[historyIdx];
+    for (unsigned int i=0;i<tiles.size();i++) {
+        Tile& t = tiles[i];
+        if (tileOrder != TILES_ERROR) {
+            float dx = (t.x0 + t.x1) * 0.5f - cx;
+            float dy = (t.y0 + t.y1) * 0.5f - cy;
+            t.priority = -(dx*dx + dy*dy);
+            continue;
+        }
 
-            if (markX == u || markY == v) {
-                (*texture)(u,v,0) = -1;
-                (*texture)(u,v,1) = 0;
-                (*texture)(u,v,2) = 0;
+        // the target still holds the last frame: tiles with edges or
+        // penumbrae in it, and those reprojection left holes in, first
+        float lo = 255, hi = 0;
+        unsigned int holes = 0, n = 0;
+        for (unsigned int v=t.y0;v<t.y1;v++) {
+            for (unsigned int u=t.x0;u<t.x1;u++) {
+                float l = 0.299f * (*target)(u,v,0)
+                    + 0.587f * (*target)(u,v,1)
+                    + 0.114f * (*target)(u,v,2);
+                lo = min(lo, l);
+                hi = max(hi, l);
+                if (temporal && !cur.reused[v*cur.width + u])
+                    holes++;
+                n++;
             }
+        }
+        t.priority = (hi - lo) + 255.0f * holes / n;
+    }
+    stable_sort(tiles.begin(), tiles.end(), TracedBefore);
+}
+
+bool RayTracer::ProfileFrames(string pattern) {
+    if (!pattern.empty() && !ValidFramePattern(pattern)) {
+        logger.error << "Profile file " << pattern
+                     << " needs one frame number like %04u" << logger.end;
+        return false;
+    }
+    tileLock.Lock();
+    profilePattern = pattern;
+    tileLock.Unlock();
+    return true;
+}
 
-            dirty = true;
+void RayTracer::RecordRays(string file) {
+    tileLock.Lock();
+    rayLogRequest = file;
+    rayLogRequested = true;
+    tileLock.Unlock();
+}
+
+// Switches logs between frames, when the buffers of the tracing
+// threads have been flushed.
+void RayTracer::UpdateRayLog() {
+    tileLock.Lock();
+    bool requested = rayLogRequested;
+    string file = rayLogRequest;
+    rayLogRequested = false;
+    tileLock.Unlock();
+    if (!requested)
+        return;
+
+    if (rayLog) {
+        rayLog->Close();
+        logger.info << "Logged " << rayLog->Records() << " rays" << logger.end;
+        delete rayLog;
+        rayLog = NULL;
+    }
+    if (file.empty())
+        return;
+    rayLog = new RayLog();
+    if (rayLog->Open(file))
+        logger.info << "Logging rays to " << file << logger.end;
+    else {
+        delete rayLog;
+        rayLog = NULL;
+    }
+}
+
+void RayTracer::StreamTiles(string target) {
+    tileLock.Lock();
+    tileStreamRequest = target;
+    tileStreamRequested = true;
+    tileLock.Unlock();
+}
+
+void RayTracer::UpdateTileStream() {
+    tileLock.Lock();
+    bool requested = tileStreamRequested;
+    string target = tileStreamRequest;
+    tileStreamRequested = false;
+    tileLock.Unlock();
+    if (!requested)
+        return;
+
+    if (tileStream) {
+        tileStream->Close();
+        logger.info << "Streamed " << tileStream->Tiles() << " tiles" << logger.end;
+        delete tileStream;
+        tileStream = NULL;
+    }
+    if (target.empty())
+        return;
+    tileStream = new TileStream();
+    if (tileStream->Open(target))
+        logger.info << "Streaming tiles to " << target << logger.end;
+    else {
+        delete tileStream;
+        tileStream = NULL;
+    }
+}
+
+void RayTracer::CloseOutputs() {
+    RecordRays("");
+    UpdateRayLog();
+    StreamTiles("");
+    UpdateTileStream();
+}
+
+bool RayTracer::ReplayRays(string file) {
+    vector<RayLog::Record> records;
+    if (!RayLog::Load(file, records)) {
+        logger.error << "Could not read ray log " << file << logger.end;
+        return false;
+    }
+
+    CaptureScene();
+    ApplyScene();
+
+    unsigned long kinds[RayLog::SHADOW + 1] = {0, 0, 0, 0};
+    unsigned long mismatches = 0;
+    unsigned long long cost = 0;
+
+    Timer t;
+    t.Reset();
+    t.Start();
+    objectsLock.Lock();
+    for (unsigned int i=0;i<records.size();i++) {
+        const RayLog::Record& rec = records[i];
+        if (rec.kind > RayLog::SHADOW)
+            continue;
+        Ray r;
+        r.origin = Vector<3,float>(rec.origin[0], rec.origin[1], rec.origin[2]);
+        r.direction = Vector<3,float>(rec.direction[0], rec.direction[1], rec.direction[2]);
+        kinds[rec.kind]++;
+
+        // the shape a shadow ray leaves is not logged, so it may find
+        // itself where the frame did not
+        if (rec.kind == RayLog::SHADOW) {
+            OccludedSegment<FastTrace>(r.origin, r.origin + r.direction * rec.maxT, NULL);
+            continue;
         }
+
+        Vector<3,float> p;
+        unsigned int id, tests;
+        Hit side = rec.kind == RayLog::INSIDE ? HIT_IN : HIT_OUT;
+        Shape* s = NearestShape<FastTrace>(r, p, side, &id, &tests);
+        if ((s ? id : RayLog::MISS) != rec.hit)
+            mismatches++;
+        cost += tests;
+    }
+    objectsLock.Unlock();
+    t.Stop();
+
+    float secs = Seconds(t.GetElapsedTime());
+    unsigned long traced = records.size() - kinds[RayLog::SHADOW];
+    logger.info << "Replayed " << records.size() << " rays from " << file
+                << " (" << kinds[RayLog::PRIMARY] << " primary, "
+                << kinds[RayLog::SECONDARY] + kinds[RayLog::INSIDE] << " secondary, "
+                << kinds[RayLog::SHADOW] << " shadow) in " << secs << " s, "
+                << (secs > 0 ? records.size() / secs / 1.0e6 : 0) << " Mrays/s"
+                << logger.end;
+    logger.info << "Mean cost " << (traced ? float(cost) / traced : 0)
+                << " tests per ray, " << mismatches << " hits differ from the log"
+                << logger.end;
+    return true;
+}
+
+void RayTracer::SetFocus(unsigned int x, unsigned int y) {
+    focusX = x;
+    focusY = y;
+}
+
+// Tiles of the thread's own node first, in priority order, then those
+// of the other nodes once it runs out.
+bool RayTracer::NextTile(Tile& tile, unsigned int node) {
+    tileLock.Lock();
+    bool more = false;
+    for (unsigned int i=0;i<frameNodes && !cancelFrame && !more;i++) {
+        unsigned int k = (node + i) % frameNodes;
+        unsigned int& next = nextTile[k];
+        while (next < tiles.size() && tiles[next].node != k)
+            next++;
+        if (next < tiles.size()) {
+            tile = tiles[next++];
+            more = true;
+        }
+    }
+    tileLock.Unlock();
+    return more;
+}
+
+void RayTracer::DeferTile(const Tile& tile) {
+    tileLock.Lock();
+    deferredTiles.push_back(tile);
+    tileLock.Unlock();
+}
+
+// Pins a tile thread to its node and points it at the node's copy of
+// the scene, making the copy first if the scene changed. The copy is
+// made by a thread of the node, so its pages end up in local memory.
+void RayTracer::PlaceThread(unsigned int track) {
+    // tile threads stay where they are while the placement holds
+    unsigned int node = track * frameNodes / frameThreads;
+    int pin = frameNodes > 1 ? int(node) : -1;
+    TileContext& ctx = tileContexts[track];
+    if (track && ctx.pinned != pin) {
+        PinThread(pin);
+        ctx.pinned = pin;
+    }
+    if (frameNodes == 1)
+        return;
+    // a lazy tree is split in place, so every node shares it
+    if (node == 0 || !numaReplicate || bvhUpdater->lazy)
+        return;
+
+    SceneReplica& r = *replicas[node];
+    r.lock.Lock();
+    if (r.version != sceneVersion) {
+        r.bvh = bvhUpdater->bvh;
+        r.objects = objects;
+        r.version = sceneVersion;
+    }
+    r.lock.Unlock();
+    localBVH = &r.bvh;
+    localObjects = r.objects.empty() ? NULL : &r.objects[0];
+}
+
+const BVH& RayTracer::LocalBVH() const {
+    return localBVH ? *localBVH : bvhUpdater->bvh;
+}
+
+const RayTracer::Object* RayTracer::LocalObjects() const {
+    if (localObjects)
+        return localObjects;
+    return objects.empty() ? NULL : &objects[0];
+}
+
+const ShadeMaterial& RayTracer::MaterialOf(unsigned int id) {
+    return BrickStore::IsBrick(id) ? bricks.Material(id) : materials[id];
+}
+
+Shape* RayTracer::ShapeOf(unsigned int id) {
+    return BrickStore::IsBrick(id) ? &brickShape : objects[id].shape;
+}
+
+Vector<3,float> RayTracer::NormalAt(Shape* shape, unsigned int id, Vector<3,float> p) {
+    return BrickStore::IsBrick(id) ? bricks.NormalAt(id, p) : shape->NormalAt(p);
+}
+
+bool RayTracer::OpenBricks(string file) {
+    objectsLock.Lock();
+    bool ok = bricks.Open(file);
+    firstHitsComplete = false;
+    visCache.InvalidateAll();
+    objectsLock.Unlock();
+    return ok;
+}
+
+void RayTracer::TraceTiles(TileContext& ctx) {
+    unsigned long allocations = ThreadAllocations();
+    ctx.rays.Attach(rayLog);
+    rayBuffer = rayLog ? &ctx.rays : NULL;
+
+    // the tracer thread keeps its track for the rest of the frame
+    unsigned int track = &ctx - &tileContexts[0];
+    if (profiling && track)
+        profiler.Bind(track);
+
+    PlaceThread(track);
+    unsigned int node = track * frameNodes / frameThreads;
+
+    // statistics cost a branch per ray, so take them along only when
+    // someone is looking
+    bool stats = rayLog || profiling;
+    Tile t;
+    while (NextTile(t, node)) {
+        bool done = stats
+            ? TraceTile<StatsTrace>(ctx, t.x0, t.y0, t.x1, t.y1)
+            : TraceTile<FastTrace>(ctx, t.x0, t.y0, t.x1, t.y1);
+        if (!done)
+            DeferTile(t);
+        else if (streamFrame)
+            tileStream->Add(target, t.x0, t.y0, t.x1, t.y1);
         dirty = true;
-        //Thread::Sleep(100000);
     }
+    rayBuffer = NULL;
+    localBVH = NULL;
+    localObjects = NULL;
+    if (track)
+        Profiler::Unbind();
+    ctx.allocations += ThreadAllocations() - allocations;
+}
+
+void RayTracer::CancelFrame() {
+    tileLock.Lock();
+    cancelFrame = true;
+    tileLock.Unlock();
+}
+
+void RayTracer::SetCrop(unsigned int x0, unsigned int y0,
+                        unsigned int x1, unsigned int y1) {
+    tileLock.Lock();
+    crop.x0 = x0;
+    crop.y0 = y0;
+    crop.x1 = x1;
+    crop.y1 = y1;
+    cropRequested = true;
+    tileLock.Unlock();
+}
+
+void RayTracer::ClearCrop() {
+    tileLock.Lock();
+    cropRequested = false;
+    tileLock.Unlock();
+}
+
+void RayTracer::EndFrame() {
+    Profiler::Scope phase("end frame");
+    FrameHistory& cur = history[historyIdx];
+
+    tileLock.Lock();
+    canceled = cancelFrame;
+    cancelFrame = false;
+    tileLock.Unlock();
+
+    // a remote or canceled frame leaves neither history nor first
+    // hits behind
+    bool complete = !remoteFrame && !canceled;
+
+    // outside the crop window cur still holds an older frame
+    cur.valid = complete && !cropped;
+
+    // remote frames leave no depth to guide the filter
+    if (target != texture)
+        Upscale(target, remoteFrame ? NULL : &cur.depth[0], texture);
+
+    historyIdx = 1 - historyIdx;
+
+    // tile scratch lives for one frame
+    tileAllocations = 0;
+    for (unsigned int i=0;i<tileContexts.size();i++) {
+        tileAllocations += tileContexts[i].allocations;
+        tileContexts[i].allocations = 0;
+        tileContexts[i].arena.Reset();
+        tileContexts[i].rays.Flush();
+    }
+
+    // In the counting build, once the first frames have sized the
+    // pools, tracing tiles must not allocate at all; AllocationTest
+    // fails on steadyAllocations. Recorded rays are exempt, their log
+    // grows with every frame.
+    if (CountingAllocations()) {
+        bool warm = ++allocationFrames > ALLOCATION_WARMUP;
+        if (tileAllocations && warm && !rayLog) {
+            steadyAllocations += tileAllocations;
+            logger.error << "Heap allocations while tracing tiles after "
+                         << ALLOCATION_WARMUP << " frames: "
+                         << tileAllocations << logger.end;
+        } else if (tileAllocations)
+            logger.warning << "Heap allocations while tracing tiles: "
+                           << tileAllocations << logger.end;
+    }
+
+    // reprojected pixels did not refresh their first hit, and a crop
+    // window only refreshes its own
+    firstHitsComplete = complete &&
+        (firstHitsValid || (reusedPixels == 0 && !cropped));
+}
+
+void RayTracer::RenderFrame(bool display) {
+    BeginFrame();
+
+    // render workers trace regions without a frame of their own, so
+    // only tiles of frames rendered here are streamed, and those of a
+    // denoised frame only once it is filtered
+    bool streaming = tileStream != NULL;
+    streamFrame = streaming && !frameDenoise;
+    frameMark = display && !streaming;
+    unsigned int w = target->GetWidth(), h = target->GetHeight();
+    if (streaming)
+        tileStream->BeginFrame(traceNum, w, h);
+    // a frame of tiles, so tracing only waits on a writer a frame behind
+    if (streamFrame)
+        tileStream->Reserve(((w + TILE_SIZE - 1) / TILE_SIZE) * ((h + TILE_SIZE - 1) / TILE_SIZE),
+                            TILE_SIZE * TILE_SIZE * 3);
+
+    // crop windows are small, they are always traced here
+    Tile r = { 0, 0, w, h, 0, 0 };
+    if (cropped)
+        r = frameCrop;
+    bool local = cropped || !TraceRemote();
+    if (local) {
+        RenderRegion(r.x0, r.y0, r.x1, r.y1);
+        if (frameDenoise)
+            DenoiseRegion(r.x0, r.y0, r.x1, r.y1);
+    }
+    if (streaming && !(local && streamFrame)) {
+        // the frame is done as a whole, it is streamed in row bands
+        for (unsigned int y=r.y0;y<r.y1;y+=TILE_SIZE)
+            tileStream->Add(target, r.x0, y, r.x1, min(y+TILE_SIZE, r.y1));
+    }
+
+    EndFrame();
+    if (streaming)
+        tileStream->EndFrame(traceNum, canceled);
+    streamFrame = false;
+}
+
+// Filters the traced region and writes it back to the target and to
+// the history, so reprojected pixels are denoised too.
+void RayTracer::DenoiseRegion(unsigned int x0, unsigned int y0,
+                              unsigned int x1, unsigned int y1) {
+    Profiler::Scope phase("denoise");
+
+    // a canceled frame is left as it was traced
+    tileLock.Lock();
+    bool canceling = cancelFrame;
+    tileLock.Unlock();
+    if (canceling)
+        return;
+
+    Timer t;
+    t.Reset();
+    t.Start();
+    denoiser.Filter(x0, y0, x1, y1, denoiseIterations, max(1u, threads));
+
+    FrameHistory& cur = history[historyIdx];
+    for (unsigned int v=y0;v<y1;v++) {
+        for (unsigned int u=x0;u<x1;u++) {
+            if (!denoiser.Filtered(u,v))
+                continue;
+            Vector<3,float> col = denoiser.Color(u,v);
+            unsigned char* rgb = &cur.color[(v*cur.width + u)*3];
+            for (unsigned int c=0;c<3;c++)
+                rgb[c] = min(1.0f, max(0.0f, col[c])) * 255;
+            WritePixel(u, v, rgb[0], rgb[1], rgb[2]);
+        }
+    }
+    t.Stop();
+    denoiseTime = Seconds(t.GetElapsedTime());
+}
+
+bool RayTracer::TraceRemote() {
+#ifdef RT_DISTRIBUTED
+    // workers do not have the bricks
+    if (!coordinator || bricks.IsOpen())
+        return false;
+
+    // nor the guide buffers of the denoiser
+    if (frameDenoise) {
+        if (!remoteDenoiseWarned && coordinator->GetWorkerCount() > 0) {
+            logger.warning << "Denoised frames are traced locally, "
+                           << "not on the render workers" << logger.end;
+            remoteDenoiseWarned = true;
+        }
+        return false;
+    }
+
+    FrameJob job;
+    vector<Shape*> shapes;
+    for (unsigned int i=0;i<objects.size();i++)
+        shapes.push_back(objects[i].source);
+    SceneCodec::Encode(shapes, lights, job.scene);
+    job.sceneHash = SceneCodec::Hash(job.scene);
+
+    job.width = target->GetWidth();
+    job.height = target->GetHeight();
+    job.iv = _tmpIV;
+    job.proj = _tmpProj;
+    job.maxDepth = maxDepth;
+    job.shadowProbeGrid = shadowProbeGrid;
+    job.shadowRefineGrid = shadowRefineGrid;
+
+    remoteFrame = coordinator->RenderFrame(job, target);
+    return remoteFrame;
+#else
+    return false;
+#endif
+}
+
+void RayTracer::Trace() {
+    if (!run)
+        return;
+    
+    Timer t;
+    t.Reset();
+    t.Start();
+
+    // saves requested from now on go to the next frame
+    saveLock.Lock();
+    list<string> saves;
+    saves.swap(saveRequests);
+    saveLock.Unlock();
+
+    tileLock.Lock();
+    string profile = profilePattern;
+    tileLock.Unlock();
+    profiling = !profile.empty();
+    if (profiling) {
+        profiler.BeginFrame(max(1u, threads));
+        profiler.Bind(0);
+    }
+
+    {
+        Profiler::Scope phase("capture scene");
+        CaptureScene();
+    }
+    {
+        Profiler::Scope phase("apply scene");
+        ApplyScene();
+    }
+    // frames that are saved are written without the mark
+    RenderFrame(saves.empty());
 
     dirty = true;
     t.Stop();
 
+    // before the saves are reported, so a script waiting for one
+    // reads the counters of its frame
+    statsLock.Lock();
+    stats.frame = traceNum;
+    stats.traceTime = Seconds(t.GetElapsedTime());
+    stats.bvhUpdateTime = bvhUpdateTime;
+    stats.bvhBuildTime = bvhUpdater->bvh.buildTime;
+    stats.bvhCost = bvhUpdater->bvh.cost;
+    stats.reusedPixels = temporal ? reusedPixels : 0;
+    stats.cacheHits = visCache.Hits();
+    stats.cacheMisses = visCache.Misses();
+    stats.remote = remoteFrame;
+    stats.reusedFirstHits = firstHitsValid;
+    stats.canceled = canceled;
+    stats.allocations = tileAllocations;
+    stats.steadyAllocations = steadyAllocations;
+    stats.passes = framePasses;
+    stats.brickLoads = bricks.IsOpen() ? bricks.Loads() : 0;
+    stats.brickBytes = bricks.IsOpen() ? bricks.ResidentBytes() : 0;
+    stats.denoiseTime = denoiseTime;
+    statsLock.Unlock();
+
+    if (canceled) {
+        // a partial frame is not worth saving, try again next frame
+        saveLock.Lock();
+        saveRequests.splice(saveRequests.begin(), saves);
+        saveLock.Unlock();
+    }
+    for (list<string>::iterator itr = saves.begin();
+         itr != saves.end();
+         itr++) {
+        Profiler::Scope phase("save");
+        if (ImageWriter::Save(*itr, texture))
+            logger.info << "Saved " << *itr << logger.end;
+        else
+            logger.error << "Could not write " << *itr << logger.end;
+    }
+    saveLock.Lock();
+    savesDone += saves.size();
+    saveLock.Unlock();
+
+    if (profiling) {
+        Profiler::Unbind();
+        string file = FrameFileName(profile, traceNum);
+        if (!profiler.Write(file, traceNum))
+            logger.error << "Could not write " << file << logger.end;
+        if (profiler.Dropped())
+            logger.warning << "Profile events dropped: " << profiler.Dropped() << logger.end;
+    }
+
+
     logger.info << "Trace time: " << t.GetElapsedTime() << logger.end;
 
+    if (canceled)
+        logger.info << "Frame canceled" << logger.end;
+
+    if (remoteFrame)
+        logger.info << "Traced on render workers" << logger.end;
+
+    if (firstHitsValid)
+        logger.info << "Reused first hits" << logger.end;
+
+    if (temporal)
+        logger.info << "Reprojected " << reusedPixels << " pixels" << logger.end;
+
+    // totals over the trees of both snapshots
+    const BVHUpdater& a = sceneBVHs[0].updater;
+    const BVHUpdater& b = sceneBVHs[1].updater;
+    if (geometryChanged)
+        logger.info << "BVH update: " << bvhUpdateTime * 1000 << " ms"
+                    << " (" << a.refits + b.refits << " refits, "
+                    << a.rebuilds + b.rebuilds << " rebuilds, "
+                    << a.backgroundRebuilds + b.backgroundRebuilds << " background rebuilds, "
+                    << a.lazyBuilds + b.lazyBuilds << " lazy builds, "
+                    << a.adoptions + b.adoptions << " copies)"
+                    << logger.end;
+    if (bvhUpdater->lazy)
+        logger.info << "Lazy BVH: " << bvhUpdater->lazy->Expanded()
+                    << " nodes split" << logger.end;
+
+    if (bricks.IsOpen())
+        logger.info << "Bricks: " << framePasses << " passes, "
+                    << bricks.Loads() << " loads, " << bricks.Evictions()
+                    << " evictions, " << (bricks.ResidentBytes() >> 20)
+                    << " of " << brickBudget << " MB resident" << logger.end;
+
+    if (denoiseTime > 0)
+        logger.info << "Denoise: " << denoiseTime * 1000 << " ms" << logger.end;
+
+
+    if (visibilityCaching)
+        logger.info << "Visibility cache: " << visCache.Hits() << " hits, "
+                    << visCache.Misses() << " misses" << logger.end;
+
     markDebug = false;
 }
 
+unsigned int RayTracer::SaveNextFrame(string file) {
+    saveLock.Lock();
+    saveRequests.push_back(file);
+    unsigned int ticket = ++saveTickets;
+    saveLock.Unlock();
+    return ticket;
+}
+
+bool RayTracer::FrameSaved(unsigned int ticket) {
+    saveLock.Lock();
+    bool saved = savesDone >= ticket;
+    saveLock.Unlock();
+    return saved;
+}
+
+bool RayTracer::SavePending() {
+    saveLock.Lock();
+    bool pending = !saveRequests.empty();
+    saveLock.Unlock();
+    return pending;
+}
+
+RayTracer::FrameStats RayTracer::GetFrameStats() {
+    statsLock.Lock();
+    FrameStats s = stats;
+    statsLock.Unlock();
+    return s;
+}
+
+void RayTracer::SetView(Matrix<4,4,float> iv, Matrix<4,4,float> proj) {
+    _tmpIV = iv;
+    _tmpProj = proj;
+}
+
+void RayTracer::SetRoot(ISceneNode* root) {
+    objectsLock.Lock();
+    this->root = root;
+    objectsLock.Unlock();
+}
+
+ISceneNode* RayTracer::GetRoot() {
+    return root;
+}
+
+void RayTracer::SetLights(vector<Light> lights) {
+    this->lights = lights;
+}
+
+vector<RayTracer::Light> RayTracer::GetLights() {
+    return lights;
+}
+
+EmptyTextureResourcePtr RayTracer::GetTexture() {
+    return texture;
+}
+
+void RayTracer::SetCoordinator(RenderCoordinator* coordinator) {
+    this->coordinator = coordinator;
+}
+
 void RayTracer::Run() {
 
     while (run) {
+        // a paused tracer still renders frames someone wants saved
+        if (paused && !SavePending()) {
+            Thread::Sleep(10000);
+            continue;
+        }
         Trace();
         //Thread::Sleep(1000000);
     }
 
+    CloseOutputs();
 }
 
 RayTracer::RayTracerRenderNode* RayTracer::GetRayTracerDebugNode() {
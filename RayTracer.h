@@ -8,6 +8,8 @@
 
 #include <Math/Vector.h>
 #include <vector>
+#include <list>
+#include <string>
 #include <Shapes/Shape.h>
 #include <Scene/ISceneNodeVisitor.h>
 #include <Scene/RenderNode.h>
@@ -17,6 +19,22 @@
 
 #include <Resources/EmptyTextureResource.h>
 
+#include "ShadowPacket.h"
+#include "VisibilityCache.h"
+#include "FrameHistory.h"
+#include "Denoiser.h"
+#include "MaterialTable.h"
+#include "SceneSnapshot.h"
+#include "BVH.h"
+#include "BrickStore.h"
+#include "Arena.h"
+#include "RayLog.h"
+#include "TileStream.h"
+#include "Profiler.h"
+#include "TracePolicy.h"
+
+class RenderCoordinator;
+
 using namespace OpenEngine;
 using namespace OpenEngine::Resources;
 using namespace OpenEngine::Renderers;
@@ -32,8 +50,7 @@ using namespace std;
 
 
 class RayTracer : public Thread 
-                , public IListener<Core::ProcessEventArg>
-                , public ISceneNodeVisitor {
+                , public IListener<Core::ProcessEventArg> {
 
     struct RayHit {
         Ray r;
@@ -41,8 +58,11 @@ class RayTracer : public Thread
         //float t;
     };
 
+    typedef list<RayHit, ArenaAllocator<RayHit> > RayList;
+
     class RayTracerRenderNode : public RenderNode {
         RayTracer* rt;
+        Arena arena;  // the debug ray path, reset every Apply
     public:
         bool markDebug;
 
@@ -53,73 +73,555 @@ class RayTracer : public Thread
 
     RayTracerRenderNode *rnode;
 
+public:
     struct Light {
+        enum Type { POINT, SPHERE, RECT };
+
+        Type type;
         Vector<3,float> pos;
         Vector<4,float> color;
+
+        float radius;          // SPHERE
+        Vector<3,float> edgeU; // RECT, full edge vectors centered at pos
+        Vector<3,float> edgeV;
+
+        Light() : type(POINT), radius(0) {}
+
+        bool operator==(const Light& o) const;
+        Vector<3,float> SamplePoint(Vector<3,float> from, float s, float t) const;
     };
 
-    struct Object {
-        Shape *shape;
+private:
+
+    typedef SceneSnapshot::Object Object;
+
+    struct TileHit {
+        unsigned int u,v;
+        Ray r;
+        Shape* shape;
+        unsigned int id;
+        Vector<3,float> p;
+        Vector<3,float> n;
     };
 
+    // A reflection or refraction ray of a primary hit. They are traced
+    // after all of a tile's primaries, sorted so that neighbouring
+    // rays start close together and point the same way.
+    struct SecondaryRay {
+        Ray r;
+        Hit side;
+        float rIndex;
+        float weight;
+        unsigned int hit;  // into the tile's hits
+        unsigned int key;  // direction octant, then Morton code of the origin
+    };
+    static bool SecondaryBefore(const SecondaryRay& a, const SecondaryRay& b);
+
+    static const unsigned int TILE_SIZE = 8;
+
 
     vector<Light> lights;
     vector<Object> objects;
+    MaterialTable materials;
 
     Vector<3,float> camPos;
     float fovX;
     float fovY;
 
     float height,width;
-    int maxDepth;
 
-    EmptyTextureResourcePtr texture;
+    EmptyTextureResourcePtr texture;  // what is displayed
+    EmptyTextureResourcePtr target;   // what is traced, texture at scale 1
+
+    void UpdateTarget();
     
     int traceNum;
     bool dirty;
 
+    // scratch space for tracing a tile, one per tracing thread. The
+    // arrays are carved from the arena for each tile and rewound after
+    // it; the arena itself is reset at the end of the frame.
+    struct TileContext {
+        Arena arena;
+        TileHit* hits;
+        unsigned int nHits;
+        float* vis;
+        unsigned int* probeHits;
+        bool* cached;
+        unsigned int* bins[ShadeMaterial::KINDS];
+        unsigned int binSize[ShadeMaterial::KINDS];
+        Vector<4,float>* colors;
+        SecondaryRay* secondary;  // NULL to trace them recursively
+        unsigned int nSecondary;
+        ShadowPacket probePacket;
+        ShadowPacket refinePacket;
+        unsigned long allocations;  // heap allocations while tracing tiles
+        RayLog::Buffer rays;
+        int pinned;  // NUMA node of its tile thread, -1 for any, -2 not placed yet
+
+        TileContext() : nHits(0), secondary(NULL), nSecondary(0), allocations(0), pinned(-2) {}
+    };
+
+    struct Tile {
+        unsigned int x0, y0, x1, y1;
+        float priority;  // higher is traced first
+        unsigned int node;  // NUMA node whose threads take it first
+    };
+
+    // Traces the tiles of one track in every pass that has it, for
+    // the tracer's lifetime, so passes do not start and join threads.
+    // It polls tracePass for the next pass.
+    class TileThread : public Thread {
+        RayTracer* rt;
+        unsigned int track;
+        unsigned int pass;  // the last one seen
+    public:
+        TileThread(RayTracer* rt, unsigned int track);
+        void Run();
+    };
+    // polls without sleeping this long after a pass, the next pass of
+    // a frame is never far behind
+    static const unsigned int TILE_THREAD_SPINS = 1000;
+
+    vector<TileThread*> tileThreads;  // tracks 1 and up
+    unsigned int tracePass;    // bumped to start a pass
+    unsigned int passThreads;  // tracks taking part in it
+    unsigned int passDone;     // tile threads done with it
+    bool stopTileThreads;
+
+    vector<TileContext> tileContexts;
+    unsigned long tileAllocations;
+    unsigned int allocationFrames;  // traced with allocations counted
+    unsigned long steadyAllocations;  // after the warmup, see EndFrame
+    vector<Tile> tiles;
+    vector<unsigned int> nextTile;  // per NUMA node
+
+    // tiles that needed bricks which were not resident, traced again
+    // in the next pass of the frame
+    vector<Tile> deferredTiles;
+    unsigned int framePasses;
+    void TracePass(unsigned int n);
+
+    // NUMA placement of the current frame: threads and row bands of
+    // tiles are split evenly over the nodes, and every node but the
+    // first traverses its own copy of the scene
+    struct SceneReplica {
+        BVH bvh;
+        vector<Object> objects;
+        unsigned int version;
+        Mutex lock;
+    };
+    vector<SceneReplica*> replicas;
+    unsigned int sceneVersion;
+    unsigned int frameNodes;
+    unsigned int frameThreads;
+    bool tracerPinned;
+    void PlaceThread(unsigned int track);
+    const BVH& LocalBVH() const;
+    const Object* LocalObjects() const;
+    Mutex tileLock;
+    bool cancelFrame;
+    bool canceled;
+
+    // crop window as requested and as used by the current frame
+    Tile crop;
+    bool cropRequested;
+    Tile frameCrop;
+    bool cropped;
+
+    unsigned int focusX, focusY;
+
+    // ray log as requested and as written by the current frame
+    string rayLogRequest;
+    bool rayLogRequested;
+    RayLog* rayLog;
+    void UpdateRayLog();
+
+    // tile stream as requested and as written to by the current frame
+    string tileStreamRequest;
+    bool tileStreamRequested;
+    TileStream* tileStream;
+    bool streamFrame;
+    void UpdateTileStream();
+
+    // the mark is drawn only into frames that are just shown
+    bool frameMark;
+
+    string profilePattern;
+    bool profiling;  // the current frame
+    Profiler profiler;
+
+    // sampling of the current frame
+    unsigned int probeGrid;
+    unsigned int refineGrid;
+    bool frameCaching;
+
+    // guide buffers and filter of the current frame, see denoise
+    Denoiser denoiser;
+    bool frameDenoise;
+    float denoiseTime;  // seconds
+    void DenoiseRegion(unsigned int x0, unsigned int y0,
+                       unsigned int x1, unsigned int y1);
+
+    bool NextTile(Tile& tile, unsigned int node);
+    void DeferTile(const Tile& tile);
+    void PrioritizeTiles();
+    static bool TracedBefore(const Tile& a, const Tile& b);
+    void TraceTiles(TileContext& ctx);
+
+    template <class P>
+    void TestShape(unsigned int i, const Ray& r, Hit side,
+                   float& nearestT, unsigned int& nearestId);
+    template <class P>
     Shape* NearestShape(Ray r, 
                         Vector<3,float>& p, 
-                        bool debug= false,
-                        Hit side=HIT_OUT
+                        Hit side=HIT_OUT,
+                        unsigned int* id=NULL,
+                        unsigned int* cost=NULL
                         );
 
     Ray RayForPoint(unsigned int u, unsigned int v);
 
+    template <class P>
     Vector<4,float> TraceRay(const Ray r, 
                              int depth, 
-                             bool debug=false, 
                              Hit side = HIT_OUT,
                              float rIndex=1.0, 
-                             list<RayHit>* rayCollection=NULL);
+                             RayList* rayCollection=NULL);
+    template <class P>
+    Vector<4,float> ShadeHit(const Ray r,
+                             unsigned int id,
+                             Vector<3,float> nearestPoint,
+                             Vector<3,float> norm,
+                             int depth,
+                             Hit side,
+                             float rIndex,
+                             RayList* rayCollection,
+                             const float* visibility=NULL);
+
+    typedef Vector<4,float> (RayTracer::*ShadeKernel)(const Ray r,
+                                                       unsigned int id,
+                                                       Vector<3,float> nearestPoint,
+                                                       Vector<3,float> norm,
+                                                       int depth,
+                                                       Hit side,
+                                                       float rIndex,
+                                                       RayList* rayCollection,
+                                                       const float* visibility);
+    typedef void (RayTracer::*BinShader)(TileContext& ctx, const unsigned int* bin, unsigned int n);
+
+    // one row per trace policy, see TracePolicy.h
+    ShadeKernel kernels[TRACE_POLICIES][ShadeMaterial::KINDS];
+    BinShader binShaders[TRACE_POLICIES][ShadeMaterial::KINDS];
+
+    template <unsigned int KIND, class P>
+    Vector<4,float> Shade(const Ray r,
+                          unsigned int id,
+                          Vector<3,float> nearestPoint,
+                          Vector<3,float> norm,
+                          int depth,
+                          Hit side,
+                          float rIndex,
+                          RayList* rayCollection,
+                          const float* visibility);
+    template <unsigned int KIND, class P>
+    void ShadeBin(TileContext& ctx, const unsigned int* bin, unsigned int n);
+    template <class P>
+    void TraceSecondary(TileContext& ctx);
+    template <class P>
+    void SetupPolicyKernels();
+    void SetupKernels();
+
+    template <class P>
+    bool Occluded(Vector<3,float> from, Vector<3,float> to, Shape* self);
+    template <class P>
+    bool OccludedSegment(Vector<3,float> from, Vector<3,float> to, Shape* self);
+    template <class P>
+    void OccludePacket(ShadowPacket& packet);
+    template <class P>
+    float SampleLightVisibility(const Light& l, Vector<3,float> p, Vector<3,float> n, Shape* self);
+    template <class P>
+    float LightVisibility(unsigned int li, Vector<3,float> p, Vector<3,float> n, unsigned int id);
+    template <class P>
+    void TileLightVisibility(TileContext& ctx, unsigned int li);
+
+    // paged sphere geometry traced along with the scene, see OpenBricks
+    BrickStore bricks;
+    const ShadeMaterial& MaterialOf(unsigned int id);
+    Shape* ShapeOf(unsigned int id);
+    Vector<3,float> NormalAt(Shape* shape, unsigned int id, Vector<3,float> p);
+
+    // false if it needed bricks that were not resident, and then it
+    // wrote nothing
+    template <class P>
+    bool TraceTile(TileContext& ctx,
+                   unsigned int x0, unsigned int y0,
+                   unsigned int x1, unsigned int y1);
+    bool TraceRemote();
     void Trace();
     Timer timer;
     ISceneNode* root;
 
     Mutex objectsLock;
 
+    // the scene is captured into the back snapshot while the front
+    // one may still be traced
+    SceneSnapshot snapshots[2];
+    unsigned int snapshotIdx;
+
+    // The BVH of each snapshot. The back one is fitted to its snapshot
+    // by PrepareScene() while the front one is traced, and how the
+    // back snapshot differs from the front one is found out along.
+    struct SceneBVH {
+        BVHUpdater updater;
+        vector<Object> fitted;  // the objects the tree was last fitted to
+        float updateTime;       // seconds
+        bool prepared;          // for the snapshot as captured
+        bool moved;             // geometry differs from the front snapshot
+        bool shading;           // materials differ from the front snapshot
+        SceneBVH() : updateTime(0), prepared(false), moved(true), shading(true) {}
+    };
+    SceneBVH sceneBVHs[2];
+    static void CompareObjects(const vector<Object>& a, const vector<Object>& b,
+                               bool& added, bool& moved);
+    Matrix<4,4,float> _nextIV;
+    Matrix<4,4,float> _nextProj;
+
     IViewingVolume* volume;
 
     Matrix<4,4,float> _tmpIV;
     Matrix<4,4,float> _tmpProj;
 
     Vector<3,float> _tmpOrigo;
+
+    VisibilityCache visCache;
+    vector<Light> lastLights;
+
+    bool sceneChanged;
+    bool geometryChanged;
+
+    BVHUpdater* bvhUpdater;  // of the front snapshot
+    float bvhUpdateTime;  // seconds
+
+    void UpdateSceneState(const SceneBVH& scene);
+
+    FrameHistory history[2];
+    unsigned int historyIdx;
+    Matrix<4,4,float> _tmpView;
+    unsigned int reusedPixels;
+    bool remoteFrame;
+
+    RenderCoordinator* coordinator;
+    bool remoteDenoiseWarned;
+
+    // first hit g-buffer, reused while camera and geometry are static
+    vector<TileHit> firstHits;
+    bool firstHitsValid;
+    bool firstHitsComplete;
+    Matrix<4,4,float> _lastIV;
+    Matrix<4,4,float> _lastProj;
+
+    Mutex saveLock;
+    list<string> saveRequests;  // taken by the next frame
+    unsigned int saveTickets;
+    unsigned int savesDone;
+    bool SavePending();
+
+    Mutex statsLock;
+
+public:
+    // frames that may allocate while tracing tiles, see AllocationCounter.h
+    static const unsigned int ALLOCATION_WARMUP = 3;
+
+    struct FrameStats {
+        unsigned int frame;
+        float traceTime;      // seconds
+        float bvhUpdateTime;  // seconds
+        float bvhBuildTime;   // seconds, of the tree in use
+        float bvhCost;        // its SAH cost
+        unsigned int reusedPixels;
+        unsigned int cacheHits;
+        unsigned int cacheMisses;
+        bool remote;
+        bool reusedFirstHits;
+        bool canceled;
+        unsigned long allocations;  // heap allocations of the tile loop
+        unsigned long steadyAllocations; // of all frames after the warmup
+        unsigned int passes;        // more than one when tiles waited for bricks
+        unsigned int brickLoads;    // since OpenBricks
+        unsigned long brickBytes;   // resident at the end of the frame
+        float denoiseTime;          // seconds
+    };
+
+private:
+    FrameStats stats;
+
+    bool Reusable(unsigned int u, unsigned int v);
+    void WritePixel(unsigned int u, unsigned int v,
+                    unsigned char r, unsigned char g, unsigned char b);
     
 
 public:
     bool run;
 
+    int maxDepth;
+
     unsigned int markX;
     unsigned int markY;
     bool markDebug;
 
+    // adaptive shadow sampling for area lights: probeGrid^2 probe
+    // rays per light, plus refineGrid^2 more only where they disagree
+    unsigned int shadowProbeGrid;
+    unsigned int shadowRefineGrid;
+
+    // reuse shadow results across frames while the scene is static
+    bool visibilityCaching;
+
+    // reproject the previous frame and only trace the pixels it does
+    // not cover, plus every temporalRefresh'th pixel in rotation
+    bool temporal;
+    unsigned int temporalRefresh;
+
+    // only re-shade when just materials or lights changed
+    bool firstHitCaching;
+
+    // trace the reflection and refraction rays of a tile's primary
+    // hits together, sorted by direction and origin
+    bool secondarySorting;
+
+    // tiles are traced by this many threads, one per core by default
+    unsigned int threads;
+
+    // how the BVH is rebuilt when objects are added or removed, on
+    // as many threads as tiles are traced with
+    BVH::Method bvhMethod;
+
+    // on multi socket machines, pin tile threads to NUMA nodes and
+    // give each node its own copy of the BVH and object list
+    bool numaAware;
+    bool numaReplicate;
+
+    // memory the bricks of OpenBricks may take, in megabytes
+    unsigned int brickBudget;
+
+    // Filter the lighting of each traced frame guided by its normals,
+    // depths and albedos, so fewer shadow samples look smooth. Tiles
+    // of a denoised frame are only streamed once it is filtered.
+    bool denoise;
+    unsigned int denoiseIterations;
+
+    // a paused tracer only renders frames asked for by SaveNextFrame
+    bool paused;
+
+    // Trace resolution, upscaled edge aware into the texture. Without
+    // an explicit renderWidth and renderHeight it is renderScale times
+    // the texture size. Takes effect from the next frame.
+    unsigned int renderWidth;
+    unsigned int renderHeight;
+    float renderScale;
+
+    // shadow grids are scaled by this inside a crop window
+    unsigned int cropSamples;
+
+    // Order tiles are traced in: row by row, from the center out,
+    // from the focus point (see SetFocus) or the mark out, or where
+    // the last frame had the most contrast or could not be reprojected
+    enum TileOrder {
+        TILES_ROWS,
+        TILES_CENTER,
+        TILES_FOCUS,
+        TILES_MARK,
+        TILES_ERROR
+    };
+    TileOrder tileOrder;
+
     
     RayTracer(EmptyTextureResourcePtr tex, IViewingVolume* vol, ISceneNode* root);
+    ~RayTracer();
     void Run();
 
     void Handle(Core::ProcessEventArg arg);
 
-    void VisitShapeNode(ShapeNode* node);
+    // Scene phases. CaptureScene() copies the scene graph and the
+    // camera into the back snapshot and PrepareScene() refits or
+    // rebuilds the snapshot's own BVH; both may run while a frame is
+    // traced. ApplyScene() makes the back snapshot the scene of the next
+    // frame, between frames, and prepares it first if that was not done.
+    void CaptureScene();
+    void PrepareScene();
+    void ApplyScene();
+
+    // Frame phases, used by Trace() and by render workers that only
+    // trace some regions of a frame. Without a viewing volume the
+    // camera comes from SetView.
+    void BeginFrame();
+    void RenderRegion(unsigned int x0, unsigned int y0,
+                      unsigned int x1, unsigned int y1);
+    void EndFrame();
+
+    // traces the applied scene, on render workers if any are connected;
+    // the mark is drawn when the frame is only displayed
+    void RenderFrame(bool display = false);
+
+    // stops handing out the tiles of the frame being traced
+    void CancelFrame();
+
+    // Only trace [x0,x1) x [y0,y1) of the render target and keep the
+    // rest of the last frame, until ClearCrop().
+    void SetCrop(unsigned int x0, unsigned int y0,
+                 unsigned int x1, unsigned int y1);
+    void ClearCrop();
+
+    // focus point for TILES_FOCUS, in texture coordinates
+    void SetFocus(unsigned int x, unsigned int y);
+
+    // Writes a Chrome trace event file of the tracer phases for every
+    // frame from the next one on, named by a printf pattern of the
+    // frame number, e.g. "profile%04u.json". Empty stops; a pattern
+    // that is not one is refused, see FramePattern.h.
+    bool ProfileFrames(string pattern);
+
+    // Logs every ray from the next frame on to file, see RayLog. An
+    // empty name stops logging.
+    void RecordRays(string file);
+
+    // Traces the rays of a log against the current scene without
+    // shading them and logs the timing. Shadow rays are replayed for
+    // their cost; the others are checked against the logged hits.
+    bool ReplayRays(string file);
+
+    // Writes the tiles of every frame from the next one on as they
+    // are finished, see TileStream for the targets. Empty stops.
+    void StreamTiles(string target);
+
+    // closes the ray log and the tile stream, after the last frame
+    void CloseOutputs();
+
+    // Writes the next frame that starts tracing to file. The returned
+    // ticket is passed to FrameSaved() to learn when it was written.
+    unsigned int SaveNextFrame(string file);
+    bool FrameSaved(unsigned int ticket);
+
+    // counters of the last frame traced by Run()
+    FrameStats GetFrameStats();
+
+    void SetView(Matrix<4,4,float> iv, Matrix<4,4,float> proj);
+    void SetRoot(ISceneNode* root);
+    ISceneNode* GetRoot();
+    void SetLights(vector<Light> lights);
+    vector<Light> GetLights();
+    EmptyTextureResourcePtr GetTexture();
+
+    // Traces the spheres of a brick file (see BrickStore) along with
+    // the scene graph, paging them in within brickBudget. Frames with
+    // bricks are always traced locally.
+    bool OpenBricks(string file);
+
+    // hand whole frames to remote workers when any are connected;
+    // denoised frames are traced here, workers do not send the depth
+    // and normals that guide the filter
+    void SetCoordinator(RenderCoordinator* coordinator);
 
     RayTracerRenderNode* GetRayTracerDebugNode();
 };
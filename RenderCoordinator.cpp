@@ -0,0 +1,306 @@
+#include "RenderCoordinator.h"
+#include "Codec.h"
+
+#include <Logging/Logger.h>
+
+#include <poll.h>
+#include <algorithm>
+
+RenderCoordinator::RenderCoordinator(string address)
+    : frameId(0)
+    , tileSize(64)
+    , tilesInFlight(2)
+    , tileTimeout(30) {
+    listener = Socket::Listen(address);
+    if (listener)
+        logger.info << "Waiting for render workers on " << address << logger.end;
+}
+
+RenderCoordinator::~RenderCoordinator() {
+    for (list<Worker*>::iterator itr = workers.begin();
+         itr != workers.end();
+         itr++) {
+        delete (*itr)->socket;
+        delete *itr;
+    }
+    for (list<Worker*>::iterator itr = joining.begin();
+         itr != joining.end();
+         itr++) {
+        delete (*itr)->socket;
+        delete *itr;
+    }
+    delete listener;
+}
+
+void RenderCoordinator::AcceptWorker() {
+    Socket* s = listener->Accept();
+    if (!s)
+        return;
+
+    // a worker gets tileTimeout for its hello, like for a tile
+    s->SetTimeout(tileTimeout);
+    s->SetMessageLimit(max(MAX_HELLO_MESSAGE, MAX_RESULT_MESSAGE));
+    Worker* w = new Worker();
+    w->socket = s;
+    w->busy.Reset();
+    w->busy.Start();
+    joining.push_back(w);
+}
+
+// Moves workers whose MSG_HELLO has arrived over to workers, and
+// gives up on those that took too long.
+void RenderCoordinator::Handshake(list<Worker*>& joined) {
+    list<Worker*> all = joining;
+    for (list<Worker*>::iterator itr = all.begin(); itr != all.end(); itr++) {
+        Worker* w = *itr;
+        Message hello;
+        int r = w->socket->ReceiveReady(hello);
+        if (r == 0 && w->busy.GetElapsedIntervals(1000000) < tileTimeout)
+            continue;
+
+        joining.remove(w);
+        if (r <= 0 || hello.type != MSG_HELLO) {
+            logger.warning << "Dropped a connection that did not say hello"
+                           << logger.end;
+            delete w->socket;
+            delete w;
+            continue;
+        }
+
+        unsigned int n = hello.GetInt();
+        for (unsigned int i=0;i<n && !hello.bad;i++)
+            UseScene(w, hello.GetLong());
+        workers.push_back(w);
+        joined.push_back(w);
+
+        logger.info << "Render worker joined (" << workers.size()
+                    << " connected)" << logger.end;
+    }
+}
+
+unsigned int RenderCoordinator::GetWorkerCount() {
+    if (!listener)
+        return 0;
+
+    // pick up workers that connected since the last frame
+    struct pollfd p;
+    p.fd = listener->GetDescriptor();
+    p.events = POLLIN;
+    while (poll(&p, 1, 0) > 0 && (p.revents & POLLIN))
+        AcceptWorker();
+
+    list<Worker*> joined;
+    Handshake(joined);
+    return workers.size();
+}
+
+// mirrors what the worker does with its cache
+void RenderCoordinator::UseScene(Worker* w, uint64_t hash) {
+    w->scenes.remove(hash);
+    w->scenes.push_back(hash);
+    while (w->scenes.size() > MAX_CACHED_SCENES)
+        w->scenes.pop_front();
+}
+
+bool RenderCoordinator::StartFrame(Worker* w, const FrameJob& job) {
+    // scenes are shipped once per worker and cached there by hash
+    if (find(w->scenes.begin(), w->scenes.end(), job.sceneHash) == w->scenes.end()) {
+        Message m(MSG_SCENE);
+        m.PutLong(job.sceneHash);
+        m.PutBytes(job.scene.data.empty() ? NULL : &job.scene.data[0],
+                   job.scene.data.size());
+        if (!w->socket->Send(m))
+            return false;
+    }
+    UseScene(w, job.sceneHash);
+
+    Message m(MSG_FRAME);
+    m.PutInt(frameId);
+    m.PutLong(job.sceneHash);
+    m.PutInt(job.width);
+    m.PutInt(job.height);
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            m.PutFloat(job.iv(i,j));
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            m.PutFloat(job.proj(i,j));
+    m.PutInt(job.maxDepth);
+    m.PutInt(job.shadowProbeGrid);
+    m.PutInt(job.shadowRefineGrid);
+    return w->socket->Send(m);
+}
+
+void RenderCoordinator::DropWorker(Worker* w, list<Tile>& pending) {
+    // hand its tiles to the others first
+    pending.splice(pending.begin(), w->inFlight);
+    workers.remove(w);
+    delete w->socket;
+    delete w;
+
+    logger.warning << "Lost a render worker (" << workers.size()
+                   << " left)" << logger.end;
+}
+
+bool RenderCoordinator::HandleResult(Worker* w, Message& m, EmptyTextureResourcePtr out) {
+    if (m.type != MSG_RESULT)
+        return false;
+
+    unsigned int id = m.GetInt();
+    Tile t;
+    t.x0 = m.GetInt();
+    t.y0 = m.GetInt();
+    t.x1 = m.GetInt();
+    t.y1 = m.GetInt();
+    if (m.bad || id != frameId)
+        return false;
+
+    list<Tile>::iterator itr = w->inFlight.begin();
+    for (; itr != w->inFlight.end(); itr++) {
+        if (itr->x0 == t.x0 && itr->y0 == t.y0 &&
+            itr->x1 == t.x1 && itr->y1 == t.y1)
+            break;
+    }
+    if (itr == w->inFlight.end())
+        return false;
+
+    unsigned int pixels = (t.x1 - t.x0) * (t.y1 - t.y0);
+    vector<unsigned char> rgb(pixels * 3);
+    if (!TileCodec::Decode(m, &rgb[0], pixels))
+        return false;
+
+    unsigned int i = 0;
+    for (unsigned int v=t.y0;v<t.y1;v++) {
+        for (unsigned int u=t.x0;u<t.x1;u++,i++) {
+            (*out)(u,v,0) = rgb[i*3+0];
+            (*out)(u,v,1) = rgb[i*3+1];
+            (*out)(u,v,2) = rgb[i*3+2];
+        }
+    }
+
+    w->inFlight.erase(itr);
+    w->busy.Reset();
+    return true;
+}
+
+bool RenderCoordinator::RenderFrame(const FrameJob& job, EmptyTextureResourcePtr out) {
+    if (GetWorkerCount() == 0)
+        return false;
+    if (job.scene.data.size() > MAX_SCENE_SIZE) {
+        logger.warning << "Scene too large for the render workers, "
+                       << "tracing locally" << logger.end;
+        return false;
+    }
+    tileSize = min(tileSize, MAX_TILE_SIZE);
+
+    frameId++;
+
+    list<Tile> pending;
+    for (unsigned int y=0;y<job.height;y+=tileSize) {
+        for (unsigned int x=0;x<job.width;x+=tileSize) {
+            Tile t;
+            t.x0 = x;
+            t.y0 = y;
+            t.x1 = min(x + tileSize, job.width);
+            t.y1 = min(y + tileSize, job.height);
+            pending.push_back(t);
+        }
+    }
+    unsigned int left = pending.size();
+
+    list<Worker*> all = workers;
+    for (list<Worker*>::iterator itr = all.begin(); itr != all.end(); itr++) {
+        (*itr)->inFlight.clear();
+        if (!StartFrame(*itr, job))
+            DropWorker(*itr, pending);
+    }
+
+    vector<struct pollfd> fds;
+    vector<Worker*> polled;
+
+    while (left > 0) {
+        if (workers.empty())
+            return false;
+
+        // keep every worker busy with a few tiles
+        all = workers;
+        for (list<Worker*>::iterator itr = all.begin(); itr != all.end(); itr++) {
+            Worker* w = *itr;
+            while (w->inFlight.size() < tilesInFlight && !pending.empty()) {
+                Tile t = pending.front();
+                Message m(MSG_TILE);
+                m.PutInt(frameId);
+                m.PutInt(t.x0);
+                m.PutInt(t.y0);
+                m.PutInt(t.x1);
+                m.PutInt(t.y1);
+                if (w->inFlight.empty())
+                    w->busy.Reset();
+                w->busy.Start();
+                w->inFlight.push_back(t);
+                pending.pop_front();
+                if (!w->socket->Send(m)) {
+                    DropWorker(w, pending);
+                    break;
+                }
+            }
+        }
+
+        fds.clear();
+        polled.clear();
+        struct pollfd p;
+        p.fd = listener->GetDescriptor();
+        p.events = POLLIN;
+        fds.push_back(p);
+        polled.push_back(NULL);
+        for (list<Worker*>::iterator itr = workers.begin(); itr != workers.end(); itr++) {
+            p.fd = (*itr)->socket->GetDescriptor();
+            fds.push_back(p);
+            polled.push_back(*itr);
+        }
+        for (list<Worker*>::iterator itr = joining.begin(); itr != joining.end(); itr++) {
+            p.fd = (*itr)->socket->GetDescriptor();
+            fds.push_back(p);
+            polled.push_back(NULL);
+        }
+
+        if (poll(&fds[0], fds.size(), 100) < 0)
+            continue;
+
+        if (fds[0].revents & POLLIN)
+            AcceptWorker();
+
+        for (unsigned int i=1;i<fds.size();i++) {
+            Worker* w = polled[i];
+            if (!w || !(fds[i].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)))
+                continue;
+
+            // everything that has arrived, a result may still be partial
+            Message m;
+            int r;
+            while ((r = w->socket->ReceiveReady(m)) > 0) {
+                if (HandleResult(w, m, out))
+                    left--;
+            }
+            if (r < 0)
+                DropWorker(w, pending);
+        }
+
+        list<Worker*> joined;
+        Handshake(joined);
+        for (list<Worker*>::iterator itr = joined.begin(); itr != joined.end(); itr++) {
+            if (!StartFrame(*itr, job))
+                DropWorker(*itr, pending);
+        }
+
+        // a worker that sits on its tiles for too long is as good as lost
+        all = workers;
+        for (list<Worker*>::iterator itr = all.begin(); itr != all.end(); itr++) {
+            Worker* w = *itr;
+            if (!w->inFlight.empty() &&
+                w->busy.GetElapsedIntervals(1000000) >= tileTimeout)
+                DropWorker(w, pending);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,117 @@
+#ifndef _RT_RENDER_COORDINATOR_H_
+#define _RT_RENDER_COORDINATOR_H_
+
+#include "Socket.h"
+
+#include <Math/Matrix.h>
+#include <Utils/Timer.h>
+#include <Resources/EmptyTextureResource.h>
+
+#include <list>
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Utils;
+using namespace OpenEngine::Resources;
+
+/**
+ * Message types spoken between coordinator and workers.
+ */
+enum {
+    MSG_HELLO  = 1, // worker: cached scene hashes
+    MSG_SCENE  = 2, // coordinator: hash, encoded scene
+    MSG_FRAME  = 3, // coordinator: frame id, scene hash, size, camera, settings
+    MSG_TILE   = 4, // coordinator: frame id, tile rectangle
+    MSG_RESULT = 5  // worker: frame id, tile rectangle, rle rgb
+};
+
+/**
+ * Scenes a worker keeps. Both ends drop the least recently used one
+ * beyond this, so the coordinator knows what a worker has without
+ * being told; MSG_HELLO lists them least recently used first.
+ */
+static const unsigned int MAX_CACHED_SCENES = 2;
+
+/**
+ * Largest messages of the protocol; each end refuses anything bigger
+ * from the other. Results are at most 4 bytes of run length encoding
+ * per pixel, scenes 76 bytes per shape. Larger scenes are traced
+ * locally and tileSize is clamped to MAX_TILE_SIZE.
+ */
+static const unsigned int MAX_TILE_SIZE = 256;
+static const unsigned int MAX_SCENE_SIZE = 64 << 20;
+static const unsigned int MAX_HELLO_MESSAGE = 4 + 8 * MAX_CACHED_SCENES;
+static const unsigned int MAX_RESULT_MESSAGE = 20 + 4 * MAX_TILE_SIZE * MAX_TILE_SIZE;
+static const unsigned int MAX_SCENE_MESSAGE = 8 + MAX_SCENE_SIZE;
+
+/**
+ * Everything a worker needs to trace tiles of one frame.
+ */
+struct FrameJob {
+    Message scene;
+    uint64_t sceneHash;
+
+    unsigned int width, height;
+    Matrix<4,4,float> iv;
+    Matrix<4,4,float> proj;
+
+    unsigned int maxDepth;
+    unsigned int shadowProbeGrid;
+    unsigned int shadowRefineGrid;
+};
+
+/**
+ * Splits frames into tiles and farms them out to RenderWorker
+ * processes connected over tcp or unix sockets. Workers may come and
+ * go at any time; the tiles of a lost or stalled worker are handed to
+ * the others. Tile results only depend on the job, so the image is
+ * the same no matter which worker traced what.
+ *
+ * Worker sockets are only read when data has arrived and never block
+ * on a partial message, so a client that connects and says nothing,
+ * or a worker that stops halfway through a result, is dropped after
+ * tileTimeout like any other stalled worker.
+ */
+class RenderCoordinator {
+    struct Tile {
+        unsigned int x0, y0, x1, y1;
+    };
+
+    struct Worker {
+        Socket* socket;
+        list<uint64_t> scenes;  // least recently used first
+        list<Tile> inFlight;
+        Timer busy;             // since the last result, or connecting
+    };
+
+    Socket* listener;
+    list<Worker*> workers;
+    list<Worker*> joining;      // connected, MSG_HELLO not complete yet
+    unsigned int frameId;
+
+    void AcceptWorker();
+    void Handshake(list<Worker*>& joined);
+    bool StartFrame(Worker* w, const FrameJob& job);
+    void UseScene(Worker* w, uint64_t hash);
+    void DropWorker(Worker* w, list<Tile>& pending);
+    bool HandleResult(Worker* w, Message& m, EmptyTextureResourcePtr out);
+
+public:
+    unsigned int tileSize;
+    unsigned int tilesInFlight;
+    unsigned int tileTimeout; // seconds
+
+    RenderCoordinator(string address);
+    ~RenderCoordinator();
+
+    unsigned int GetWorkerCount();
+
+    /**
+     * Render a whole frame on the workers into out.
+     *
+     * @return false if there were no workers, or all of them were
+     * lost before the frame was done
+     */
+    bool RenderFrame(const FrameJob& job, EmptyTextureResourcePtr out);
+};
+
+#endif
@@ -0,0 +1,405 @@
+#include "RenderScript.h"
+
+#include <Logging/Logger.h>
+#include <Scene/ShapeNode.h>
+#include <Shapes/Sphere.h>
+#include <cstdio>
+#include <cstdlib>
+
+// Render settings reachable with rt-set and rt-get. Each name maps to
+// exactly one of the fields.
+static int* IntSetting(RayTracer* rt, const string& name) {
+    if (name == "max-depth") return &rt->maxDepth;
+    return NULL;
+}
+
+static unsigned int* UIntSetting(RayTracer* rt, const string& name, bool& positive) {
+    positive = true;
+    if (name == "threads")            return &rt->threads;
+    if (name == "shadow-probe-grid")  return &rt->shadowProbeGrid;
+    if (name == "shadow-refine-grid") return &rt->shadowRefineGrid;
+    if (name == "temporal-refresh")   return &rt->temporalRefresh;
+    if (name == "crop-samples")       return &rt->cropSamples;
+    if (name == "brick-budget")       return &rt->brickBudget;
+    positive = false;
+    if (name == "denoise-iterations") return &rt->denoiseIterations;
+    if (name == "render-width")       return &rt->renderWidth;
+    if (name == "render-height")      return &rt->renderHeight;
+    return NULL;
+}
+
+static float* FloatSetting(RayTracer* rt, const string& name) {
+    if (name == "render-scale") return &rt->renderScale;
+    return NULL;
+}
+
+static bool* BoolSetting(RayTracer* rt, const string& name) {
+    if (name == "visibility-caching") return &rt->visibilityCaching;
+    if (name == "temporal")           return &rt->temporal;
+    if (name == "first-hit-caching")  return &rt->firstHitCaching;
+    if (name == "secondary-sorting")  return &rt->secondarySorting;
+    if (name == "numa")               return &rt->numaAware;
+    if (name == "numa-replicate")     return &rt->numaReplicate;
+    if (name == "denoise")            return &rt->denoise;
+    return NULL;
+}
+
+// tile-order takes a symbol, indexed by RayTracer::TileOrder
+static const char* tileOrders[] = {"rows", "center", "focus", "mark", "error"};
+static const unsigned int TILE_ORDERS = 5;
+
+// bvh-builder too, indexed by BVH::Method
+static const char* bvhMethods[] = {"sah", "lbvh"};
+static const unsigned int BVH_METHODS = 2;
+
+RenderScript::RenderScript(RayTracer* rt, string dataDir)
+    : sc(scheme_init_new()), rt(rt) {
+    scheme_set_output_port_file(sc, stdout);
+    scheme_set_external_data(sc, this);
+
+    Load(dataDir + "init.scm");
+    Load(dataDir + "oe-init.scm");
+
+    Bind("rt-start", &RenderScript::Resume);
+    Bind("rt-stop", &RenderScript::Pause);
+    Bind("rt-cancel", &RenderScript::Cancel);
+    Bind("rt-set", &RenderScript::SetSetting);
+    Bind("rt-get", &RenderScript::GetSetting);
+    Bind("rt-crop", &RenderScript::Crop);
+    Bind("rt-render-to-file", &RenderScript::RenderToFile);
+    Bind("rt-record-rays", &RenderScript::RecordRays);
+    Bind("rt-profile", &RenderScript::Profile);
+    Bind("rt-stream-tiles", &RenderScript::StreamTiles);
+    Bind("rt-stats", &RenderScript::Stats);
+    Bind("rt-sphere-center", &RenderScript::SphereCenter);
+    Bind("rt-move-sphere", &RenderScript::MoveSphere);
+
+    Load(dataDir + "render.scm");
+}
+
+RenderScript::~RenderScript() {
+    scheme_deinit(sc);
+    free(sc);
+}
+
+void RenderScript::Bind(string name, foreign_func fn) {
+    sc->vptr->scheme_define(sc, sc->global_env,
+                            sc->vptr->mk_symbol(sc, name.c_str()),
+                            sc->vptr->mk_foreign_func(sc, fn));
+}
+
+bool RenderScript::Load(string file) {
+    FILE* f = fopen(file.c_str(), "r");
+    if (!f) {
+        logger.warning << "Could not open script " << file << logger.end;
+        return false;
+    }
+    scheme_load_named_file(sc, f, file.c_str());
+    fclose(f);
+    return true;
+}
+
+void RenderScript::Eval(string code) {
+    scheme_load_string(sc, code.c_str());
+}
+
+void RenderScript::Process(unsigned int usec) {
+    char code[64];
+    snprintf(code, sizeof(code), "(process %u)", usec);
+    Eval(code);
+}
+
+void RenderScript::RunFile(string file) {
+    script = file;
+    Start();
+}
+
+void RenderScript::Run() {
+    Load(script);
+}
+
+RenderScript* RenderScript::Self(scheme* sc) {
+    return static_cast<RenderScript*>(sc->ext_data);
+}
+
+pointer RenderScript::Resume(scheme* sc, pointer args) {
+    Self(sc)->rt->paused = false;
+    return sc->T;
+}
+
+pointer RenderScript::Pause(scheme* sc, pointer args) {
+    Self(sc)->rt->paused = true;
+    return sc->T;
+}
+
+pointer RenderScript::Cancel(scheme* sc, pointer args) {
+    Self(sc)->rt->CancelFrame();
+    return sc->T;
+}
+
+pointer RenderScript::SetSetting(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (!s->is_pair(args) || !s->is_symbol(s->pair_car(args)) ||
+        !s->is_pair(s->pair_cdr(args))) {
+        logger.warning << "rt-set: expected a setting and a value" << logger.end;
+        return sc->F;
+    }
+    string name = s->symname(s->pair_car(args));
+    pointer value = s->pair_car(s->pair_cdr(args));
+
+    if (bool* b = BoolSetting(rt, name)) {
+        *b = value != sc->F;
+        return sc->T;
+    }
+    if (name == "tile-order") {
+        for (unsigned int i=0; s->is_symbol(value) && i<TILE_ORDERS; i++) {
+            if (string(s->symname(value)) == tileOrders[i]) {
+                rt->tileOrder = RayTracer::TileOrder(i);
+                return sc->T;
+            }
+        }
+        logger.warning << "rt-set: tile-order must be one of 'rows 'center "
+                       << "'focus 'mark 'error" << logger.end;
+        return sc->F;
+    }
+    if (name == "bvh-builder") {
+        for (unsigned int i=0; s->is_symbol(value) && i<BVH_METHODS; i++) {
+            if (string(s->symname(value)) == bvhMethods[i]) {
+                rt->bvhMethod = BVH::Method(i);
+                return sc->T;
+            }
+        }
+        logger.warning << "rt-set: bvh-builder must be 'sah or 'lbvh" << logger.end;
+        return sc->F;
+    }
+    if (!s->is_number(value)) {
+        logger.warning << "rt-set: " << name << " needs a number" << logger.end;
+        return sc->F;
+    }
+    if (float* f = FloatSetting(rt, name)) {
+        if (s->rvalue(value) <= 0) {
+            logger.warning << "rt-set: " << name << " must be positive" << logger.end;
+            return sc->F;
+        }
+        *f = s->rvalue(value);
+        return sc->T;
+    }
+    long n = s->ivalue(value);
+    if (int* i = IntSetting(rt, name)) {
+        *i = n;
+        return sc->T;
+    }
+    bool positive;
+    if (unsigned int* u = UIntSetting(rt, name, positive)) {
+        if (n < (positive ? 1 : 0)) {
+            logger.warning << "rt-set: " << name << " must be "
+                           << (positive ? "positive" : "non-negative") << logger.end;
+            return sc->F;
+        }
+        *u = n;
+        return sc->T;
+    }
+    logger.warning << "rt-set: unknown setting " << name << logger.end;
+    return sc->F;
+}
+
+pointer RenderScript::GetSetting(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (!s->is_pair(args) || !s->is_symbol(s->pair_car(args))) {
+        logger.warning << "rt-get: expected a setting" << logger.end;
+        return sc->F;
+    }
+    string name = s->symname(s->pair_car(args));
+
+    if (bool* b = BoolSetting(rt, name))
+        return *b ? sc->T : sc->F;
+    if (int* i = IntSetting(rt, name))
+        return s->mk_integer(sc, *i);
+    bool positive;
+    if (unsigned int* u = UIntSetting(rt, name, positive))
+        return s->mk_integer(sc, *u);
+    if (float* f = FloatSetting(rt, name))
+        return s->mk_real(sc, *f);
+    if (name == "tile-order")
+        return s->mk_symbol(sc, tileOrders[rt->tileOrder]);
+    if (name == "bvh-builder")
+        return s->mk_symbol(sc, bvhMethods[rt->bvhMethod]);
+
+    logger.warning << "rt-get: unknown setting " << name << logger.end;
+    return sc->F;
+}
+
+pointer RenderScript::Crop(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (args == sc->NIL) {
+        rt->ClearCrop();
+        return sc->T;
+    }
+    long c[4];
+    for (unsigned int i=0;i<4;i++) {
+        if (!s->is_pair(args) || !s->is_number(s->pair_car(args)) ||
+            s->ivalue(s->pair_car(args)) < 0) {
+            logger.warning << "rt-crop: expected x0 y0 x1 y1" << logger.end;
+            return sc->F;
+        }
+        c[i] = s->ivalue(s->pair_car(args));
+        args = s->pair_cdr(args);
+    }
+    rt->SetCrop(c[0], c[1], c[2], c[3]);
+    return sc->T;
+}
+
+pointer RenderScript::RenderToFile(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (!s->is_pair(args) || !s->is_string(s->pair_car(args))) {
+        logger.warning << "rt-render-to-file: expected a file name" << logger.end;
+        return sc->F;
+    }
+    unsigned int ticket = rt->SaveNextFrame(s->string_value(s->pair_car(args)));
+    while (!rt->FrameSaved(ticket)) {
+        if (!rt->run)
+            return sc->F;
+        Thread::Sleep(10000);
+    }
+    return sc->T;
+}
+
+pointer RenderScript::RecordRays(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (args == sc->NIL) {
+        rt->RecordRays("");
+        return sc->T;
+    }
+    if (!s->is_pair(args) || !s->is_string(s->pair_car(args))) {
+        logger.warning << "rt-record-rays: expected a file name" << logger.end;
+        return sc->F;
+    }
+    rt->RecordRays(s->string_value(s->pair_car(args)));
+    return sc->T;
+}
+
+pointer RenderScript::Profile(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (args == sc->NIL) {
+        rt->ProfileFrames("");
+        return sc->T;
+    }
+    if (!s->is_pair(args) || !s->is_string(s->pair_car(args))) {
+        logger.warning << "rt-profile: expected a file name pattern" << logger.end;
+        return sc->F;
+    }
+    return rt->ProfileFrames(s->string_value(s->pair_car(args))) ? sc->T : sc->F;
+}
+
+pointer RenderScript::StreamTiles(scheme* sc, pointer args) {
+    RayTracer* rt = Self(sc)->rt;
+    scheme_interface* s = sc->vptr;
+
+    if (args == sc->NIL) {
+        rt->StreamTiles("");
+        return sc->T;
+    }
+    if (!s->is_pair(args) || !s->is_string(s->pair_car(args))) {
+        logger.warning << "rt-stream-tiles: expected a target" << logger.end;
+        return sc->F;
+    }
+    rt->StreamTiles(s->string_value(s->pair_car(args)));
+    return sc->T;
+}
+
+pointer RenderScript::Stats(scheme* sc, pointer args) {
+    RayTracer::FrameStats st = Self(sc)->rt->GetFrameStats();
+    scheme_interface* s = sc->vptr;
+
+    pointer l = sc->NIL;
+#define RT_STAT(name, value) \
+    l = s->cons(sc, s->cons(sc, s->mk_symbol(sc, name), value), l)
+    RT_STAT("allocations",       s->mk_integer(sc, st.allocations));
+    RT_STAT("steady-allocations", s->mk_integer(sc, st.steadyAllocations));
+    RT_STAT("brick-bytes",       s->mk_integer(sc, st.brickBytes));
+    RT_STAT("brick-loads",       s->mk_integer(sc, st.brickLoads));
+    RT_STAT("trace-passes",      s->mk_integer(sc, st.passes));
+    RT_STAT("denoise-time",      s->mk_real(sc, st.denoiseTime));
+    RT_STAT("canceled",          st.canceled ? sc->T : sc->F);
+    RT_STAT("reused-first-hits", st.reusedFirstHits ? sc->T : sc->F);
+    RT_STAT("remote",            st.remote ? sc->T : sc->F);
+    RT_STAT("cache-misses",      s->mk_integer(sc, st.cacheMisses));
+    RT_STAT("cache-hits",        s->mk_integer(sc, st.cacheHits));
+    RT_STAT("reused-pixels",     s->mk_integer(sc, st.reusedPixels));
+    RT_STAT("bvh-sah-cost",      s->mk_real(sc, st.bvhCost));
+    RT_STAT("bvh-build-time",    s->mk_real(sc, st.bvhBuildTime));
+    RT_STAT("bvh-update-time",   s->mk_real(sc, st.bvhUpdateTime));
+    RT_STAT("trace-time",        s->mk_real(sc, st.traceTime));
+    RT_STAT("frame",             s->mk_integer(sc, st.frame));
+#undef RT_STAT
+    return l;
+}
+
+// the spheres of the scene graph, in the order it is visited
+class SphereFinder : public ISceneNodeVisitor {
+public:
+    vector<Shapes::Sphere*> spheres;
+    void VisitShapeNode(ShapeNode* node) {
+        if (Shapes::Sphere* s = dynamic_cast<Shapes::Sphere*>(node->shape))
+            spheres.push_back(s);
+    }
+};
+
+static Shapes::Sphere* SphereArg(scheme* sc, pointer& args, RayTracer* rt) {
+    scheme_interface* s = sc->vptr;
+    if (!s->is_pair(args) || !s->is_number(s->pair_car(args)))
+        return NULL;
+    long i = s->ivalue(s->pair_car(args));
+    args = s->pair_cdr(args);
+    SphereFinder finder;
+    if (rt->GetRoot())
+        rt->GetRoot()->Accept(finder);
+    if (i < 0 || (unsigned long)i >= finder.spheres.size())
+        return NULL;
+    return finder.spheres[i];
+}
+
+pointer RenderScript::SphereCenter(scheme* sc, pointer args) {
+    scheme_interface* s = sc->vptr;
+    Shapes::Sphere* sphere = SphereArg(sc, args, Self(sc)->rt);
+    if (!sphere) {
+        logger.warning << "rt-sphere-center: expected a sphere index" << logger.end;
+        return sc->F;
+    }
+    pointer l = sc->NIL;
+    for (unsigned int i=3;i-- > 0;)
+        l = s->cons(sc, s->mk_real(sc, sphere->center[i]), l);
+    return l;
+}
+
+pointer RenderScript::MoveSphere(scheme* sc, pointer args) {
+    scheme_interface* s = sc->vptr;
+    Shapes::Sphere* sphere = SphereArg(sc, args, Self(sc)->rt);
+    Vector<3,float> c;
+    for (unsigned int i=0;sphere && i<3;i++) {
+        if (!s->is_pair(args) || !s->is_number(s->pair_car(args))) {
+            sphere = NULL;
+            break;
+        }
+        c[i] = s->rvalue(s->pair_car(args));
+        args = s->pair_cdr(args);
+    }
+    if (!sphere) {
+        logger.warning << "rt-move-sphere: expected a sphere index and x y z" << logger.end;
+        return sc->F;
+    }
+    sphere->center = c;
+    return sc->T;
+}
@@ -0,0 +1,83 @@
+#ifndef _RT_RENDER_SCRIPT_H_
+#define _RT_RENDER_SCRIPT_H_
+
+#include <Core/Thread.h>
+#include <string>
+
+extern "C" {
+#include <scheme-private.h>
+}
+
+#include "RayTracer.h"
+
+using namespace OpenEngine::Core;
+
+using namespace std;
+
+/**
+ * TinyScheme interpreter with bindings for controlling a RayTracer:
+ *
+ *   (rt-start) (rt-stop)          resume or pause tracing frames
+ *   (rt-cancel)                   abandon the frame being traced
+ *   (rt-set 'max-depth 3)         set a render setting
+ *   (rt-set 'render-scale 0.5)    trace at half resolution
+ *   (rt-set 'tile-order 'center)  trace tiles from the center out
+ *   (rt-set 'bvh-builder 'lbvh)   faster BVH builds, slower tracing
+ *   (rt-set 'brick-budget 512)    megabytes of paged geometry in memory
+ *   (rt-set 'denoise #t)          filter noisy soft shadows after tracing
+ *   (rt-get 'threads)             read one
+ *   (rt-crop 100 100 164 164)     only trace this window, (rt-crop) clears
+ *   (rt-render-to-file "a.ppm")   trace a frame and wait until written
+ *   (rt-record-rays "a.rays")     log every ray, (rt-record-rays) stops
+ *   (rt-profile "p%04u.json")     phase timeline per frame, (rt-profile) stops
+ *   (rt-stream-tiles "|cmd")      write tiles as they finish, (rt-stream-tiles) stops
+ *   (rt-stats)                    counters of the last frame, an alist
+ *   (rt-sphere-center 0)          center of the first sphere of the scene
+ *   (rt-move-sphere 0 x y z)      move it, only from process hooks
+ *
+ * data/oe-init.scm is loaded as well, so scripts can register process
+ * hooks with add-to-process. Process() runs them, e.g. once per frame
+ * of a sequence, before the scene is captured.
+ *
+ * Quality presets and sweeps are plain Scheme on top of these, see
+ * data/render.scm. Scripts run on their own thread, since rendering to
+ * a file waits for the tracer.
+ */
+class RenderScript : public Thread {
+    scheme* sc;
+    RayTracer* rt;
+    string script;
+
+    void Bind(string name, foreign_func fn);
+
+    static RenderScript* Self(scheme* sc);
+    static pointer Resume(scheme* sc, pointer args);
+    static pointer Pause(scheme* sc, pointer args);
+    static pointer Cancel(scheme* sc, pointer args);
+    static pointer SetSetting(scheme* sc, pointer args);
+    static pointer GetSetting(scheme* sc, pointer args);
+    static pointer Crop(scheme* sc, pointer args);
+    static pointer RenderToFile(scheme* sc, pointer args);
+    static pointer RecordRays(scheme* sc, pointer args);
+    static pointer Profile(scheme* sc, pointer args);
+    static pointer StreamTiles(scheme* sc, pointer args);
+    static pointer Stats(scheme* sc, pointer args);
+    static pointer SphereCenter(scheme* sc, pointer args);
+    static pointer MoveSphere(scheme* sc, pointer args);
+
+public:
+    RenderScript(RayTracer* rt, string dataDir = "data/");
+    ~RenderScript();
+
+    bool Load(string file);
+    void Eval(string code);
+
+    // runs the process hooks, given the time step in microseconds
+    void Process(unsigned int usec);
+
+    // runs the script file on the script thread
+    void RunFile(string file);
+    void Run();
+};
+
+#endif
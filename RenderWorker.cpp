@@ -0,0 +1,157 @@
+#include "RenderWorker.h"
+#include "RenderCoordinator.h"
+#include "Codec.h"
+
+RenderWorker::RenderWorker(string address)
+    : address(address), rt(NULL), frameId(0), run(true) {}
+
+// The coordinator evicts the same scenes. A new scene is always sent
+// right before its frame, so the one the tracer holds is never dropped.
+void RenderWorker::UseScene(uint64_t hash) {
+    recent.remove(hash);
+    recent.push_back(hash);
+    while (recent.size() > MAX_CACHED_SCENES) {
+        logger.info << "Dropped scene " << recent.front() << logger.end;
+        map<uint64_t, CachedScene>::iterator old = scenes.find(recent.front());
+        delete old->second.root;
+        scenes.erase(old);
+        recent.pop_front();
+    }
+}
+
+bool RenderWorker::HandleScene(Message& m) {
+    uint64_t hash = m.GetLong();
+
+    // the rest of the message is the encoded scene
+    Message scene;
+    scene.data.assign(m.data.begin() + m.pos, m.data.end());
+    if (m.bad || SceneCodec::Hash(scene) != hash)
+        return false;
+
+    CachedScene c;
+    c.root = SceneCodec::Decode(scene, c.lights);
+    if (!c.root)
+        return false;
+    map<uint64_t, CachedScene>::iterator old = scenes.find(hash);
+    if (old != scenes.end())
+        delete old->second.root;
+    scenes[hash] = c;
+    UseScene(hash);
+
+    logger.info << "Cached scene " << hash << logger.end;
+    return true;
+}
+
+bool RenderWorker::HandleFrame(Message& m) {
+    frameId = m.GetInt();
+    uint64_t hash = m.GetLong();
+    unsigned int width = m.GetInt();
+    unsigned int height = m.GetInt();
+    Matrix<4,4,float> iv, proj;
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            iv(i,j) = m.GetFloat();
+    for (unsigned int i=0;i<4;i++)
+        for (unsigned int j=0;j<4;j++)
+            proj(i,j) = m.GetFloat();
+    unsigned int maxDepth = m.GetInt();
+    unsigned int probeGrid = m.GetInt();
+    unsigned int refineGrid = m.GetInt();
+
+    map<uint64_t, CachedScene>::iterator scene = scenes.find(hash);
+    if (m.bad || scene == scenes.end())
+        return false;
+    UseScene(hash);
+
+    if (!rt ||
+        rt->GetTexture()->GetWidth() != width ||
+        rt->GetTexture()->GetHeight() != height) {
+        delete rt;
+        EmptyTextureResourcePtr tex = EmptyTextureResource::Create(width, height, 24);
+        tex->Load();
+        rt = new RayTracer(tex, NULL, scene->second.root);
+
+        // anything that depends on earlier frames or on the order
+        // tiles are traced in would make the result depend on which
+        // worker got which tile
+        rt->visibilityCaching = false;
+        rt->temporal = false;
+        rt->firstHitCaching = false;
+    }
+
+    rt->SetRoot(scene->second.root);
+    rt->SetLights(scene->second.lights);
+    rt->SetView(iv, proj);
+    rt->maxDepth = maxDepth;
+    rt->shadowProbeGrid = probeGrid;
+    rt->shadowRefineGrid = refineGrid;
+
+    rt->CaptureScene();
+    rt->ApplyScene();
+    rt->BeginFrame();
+    return true;
+}
+
+bool RenderWorker::HandleTile(Message& m, Socket* s) {
+    unsigned int id = m.GetInt();
+    unsigned int x0 = m.GetInt();
+    unsigned int y0 = m.GetInt();
+    unsigned int x1 = m.GetInt();
+    unsigned int y1 = m.GetInt();
+    if (m.bad || !rt || id != frameId)
+        return false;
+
+    rt->RenderRegion(x0, y0, x1, y1);
+
+    EmptyTextureResourcePtr tex = rt->GetTexture();
+    vector<unsigned char> rgb;
+    rgb.reserve((x1-x0) * (y1-y0) * 3);
+    for (unsigned int v=y0;v<y1;v++) {
+        for (unsigned int u=x0;u<x1;u++) {
+            rgb.push_back((*tex)(u,v,0));
+            rgb.push_back((*tex)(u,v,1));
+            rgb.push_back((*tex)(u,v,2));
+        }
+    }
+
+    Message r(MSG_RESULT);
+    r.PutInt(id);
+    r.PutInt(x0);
+    r.PutInt(y0);
+    r.PutInt(x1);
+    r.PutInt(y1);
+    TileCodec::Encode(&rgb[0], rgb.size() / 3, r);
+    return s->Send(r);
+}
+
+void RenderWorker::Run() {
+    while (run) {
+        Socket* s = Socket::Connect(address);
+        if (!s) {
+            Thread::Sleep(1000000);
+            continue;
+        }
+        logger.info << "Connected to coordinator " << address << logger.end;
+        s->SetMessageLimit(MAX_SCENE_MESSAGE);
+
+        Message hello(MSG_HELLO);
+        hello.PutInt(recent.size());
+        for (list<uint64_t>::iterator itr = recent.begin();
+             itr != recent.end();
+             itr++)
+            hello.PutLong(*itr);
+
+        bool ok = s->Send(hello);
+        Message m;
+        while (ok && run && s->Receive(m)) {
+            switch (m.type) {
+            case MSG_SCENE: ok = HandleScene(m); break;
+            case MSG_FRAME: ok = HandleFrame(m); break;
+            case MSG_TILE:  ok = HandleTile(m, s); break;
+            default:        ok = false;
+            }
+        }
+        delete s;
+        logger.warning << "Lost coordinator " << address << logger.end;
+    }
+}
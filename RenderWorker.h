@@ -0,0 +1,44 @@
+#ifndef _RT_RENDER_WORKER_H_
+#define _RT_RENDER_WORKER_H_
+
+#include "RayTracer.h"
+#include "Socket.h"
+
+#include <map>
+#include <list>
+
+/**
+ * Headless tracer process for distributed rendering. It connects to a
+ * RenderCoordinator, keeps the last few scenes it has been sent (by
+ * hash, see MAX_CACHED_SCENES) and traces the tiles it is handed.
+ */
+class RenderWorker {
+    struct CachedScene {
+        ISceneNode* root;
+        vector<RayTracer::Light> lights;
+    };
+
+    string address;
+    map<uint64_t, CachedScene> scenes;
+    list<uint64_t> recent;  // least recently used first
+    RayTracer* rt;
+    unsigned int frameId;
+
+    void UseScene(uint64_t hash);
+    bool HandleScene(Message& m);
+    bool HandleFrame(Message& m);
+    bool HandleTile(Message& m, Socket* s);
+
+public:
+    bool run;
+
+    RenderWorker(string address);
+
+    /**
+     * Serve the coordinator, reconnecting whenever the connection is
+     * lost, until run is cleared.
+     */
+    void Run();
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "SceneSnapshot.h"
+
+#include <Shapes/Sphere.h>
+#include <Shapes/Plane.h>
+
+SceneSnapshot::SceneSnapshot() : captures(0) {}
+
+SceneSnapshot::~SceneSnapshot() {
+    for (map<Shape*, Clone>::iterator itr = clones.begin();
+         itr != clones.end();
+         itr++)
+        delete itr->second.shape;
+}
+
+void SceneSnapshot::Capture(ISceneNode* root) {
+    objects.clear();
+    materials.Clear();
+    captures++;
+    root->Accept(*this);
+
+    // spheres removed from the scene
+    map<Shape*, Clone>::iterator itr = clones.begin();
+    while (itr != clones.end()) {
+        if (itr->second.capture == captures) {
+            itr++;
+            continue;
+        }
+        delete itr->second.shape;
+        clones.erase(itr++);
+    }
+}
+
+void SceneSnapshot::VisitShapeNode(ShapeNode* node) {
+    Object o;
+    o.source = node->shape;
+    o.shape = node->shape;
+    o.bounded = false;
+    o.kind = Object::OTHER;
+    o.radius = 0;
+
+    Sphere* sphere = dynamic_cast<Sphere*>(o.source);
+    if (sphere) {
+        Clone& c = clones[o.source];
+        if (!c.shape)
+            c.shape = new Sphere(sphere->center, sphere->radius);
+        c.capture = captures;
+        Sphere* clone = static_cast<Sphere*>(c.shape);
+        clone->center = sphere->center;
+        clone->radius = sphere->radius;
+        o.shape = clone;
+
+        o.bounded = true;
+        o.bmin = sphere->center - Vector<3,float>(sphere->radius);
+        o.bmax = sphere->center + Vector<3,float>(sphere->radius);
+
+        o.kind = Object::SPHERE;
+        o.point = sphere->center;
+        o.radius = sphere->radius;
+    } else if (dynamic_cast<Plane*>(o.source)) {
+        o.kind = Object::PLANE;
+        PlaneFrame(o.shape, o.point, o.normal);
+    }
+    objects.push_back(o);
+    materials.Add(o.source);
+}
+
+void SceneSnapshot::PlaneFrame(Shape* plane, Vector<3,float>& point, Vector<3,float>& normal) {
+    normal = plane->NormalAt(Vector<3,float>(0,0,0));
+    point = Vector<3,float>(0,0,0);
+
+    Ray r;
+    r.origin = Vector<3,float>(0,0,0);
+    for (int s=-1;s<=1;s+=2) {
+        r.direction = normal * float(s);
+        Vector<3,float> p;
+        Hit h = plane->Intersect(r, p);
+        if (h == HIT_OUT || h == HIT_IN) {
+            point = p;
+            return;
+        }
+    }
+}
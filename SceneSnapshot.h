@@ -0,0 +1,70 @@
+#ifndef _RT_SCENE_SNAPSHOT_H_
+#define _RT_SCENE_SNAPSHOT_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Shape.h>
+#include <Scene/ISceneNodeVisitor.h>
+#include <Scene/ShapeNode.h>
+#include <vector>
+#include <map>
+
+#include "MaterialTable.h"
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+using namespace OpenEngine::Scene;
+
+using namespace std;
+
+/**
+ * The traceable state of the scene graph at one point in time.
+ *
+ * Spheres are copied into private shapes that are reused (and updated
+ * in place) from capture to capture, so the scene graph may be
+ * animated while a frame traces a snapshot. The copies of spheres
+ * that are gone from the graph are deleted by the next capture. Other
+ * shapes are shared with the scene graph and must not change during a
+ * frame.
+ */
+class SceneSnapshot : public ISceneNodeVisitor {
+public:
+    struct Object {
+        Shape* source;  // the shape in the scene graph
+        Shape* shape;   // what the tracer intersects
+        bool bounded;
+        Vector<3,float> bmin;
+        Vector<3,float> bmax;
+
+        // analytic form for the intersection routines, see Intersect.h
+        enum Kind { SPHERE, PLANE, OTHER };
+        Kind kind;
+        Vector<3,float> point;   // sphere center, a point on the plane
+        Vector<3,float> normal;  // plane
+        float radius;            // sphere
+    };
+
+    vector<Object> objects;
+    MaterialTable materials;
+
+private:
+    struct Clone {
+        Shape* shape;
+        unsigned int capture;  // the last one that saw its source
+    };
+    map<Shape*, Clone> clones;
+    unsigned int captures;
+
+public:
+    SceneSnapshot();
+    ~SceneSnapshot();
+
+    void Capture(ISceneNode* root);
+
+    void VisitShapeNode(ShapeNode* node);
+
+    // Planes do not expose their definition, so recover a point on the
+    // plane and its normal through the Shape interface.
+    static void PlaneFrame(Shape* plane, Vector<3,float>& point, Vector<3,float>& normal);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "SequenceRenderer.h"
+#include "FramePattern.h"
+
+#include <Logging/Logger.h>
+#include <Utils/Timer.h>
+
+SequenceRenderer::SequenceRenderer(RayTracer* rt, string filePattern, float fps)
+    : rt(rt), filePattern(filePattern), fps(fps) {}
+
+IEvent<SequenceFrameArg>& SequenceRenderer::AnimateEvent() {
+    return animateEvent;
+}
+
+void SequenceRenderer::FrameTracer::Trace() {
+    lock.Lock();
+    pending = true;
+    lock.Unlock();
+}
+
+void SequenceRenderer::FrameTracer::WaitFrame() {
+    lock.Lock();
+    while (pending) {
+        lock.Unlock();
+        Thread::Sleep(1000);
+        lock.Lock();
+    }
+    lock.Unlock();
+}
+
+void SequenceRenderer::FrameTracer::Finish() {
+    lock.Lock();
+    run = false;
+    lock.Unlock();
+    Wait();
+}
+
+void SequenceRenderer::FrameTracer::Run() {
+    for (;;) {
+        lock.Lock();
+        bool trace = pending;
+        bool done = !run && !pending;
+        lock.Unlock();
+        if (done)
+            return;
+        if (!trace) {
+            Thread::Sleep(1000);
+            continue;
+        }
+        rt->RenderFrame();
+        lock.Lock();
+        pending = false;
+        lock.Unlock();
+    }
+}
+
+string SequenceRenderer::FileName(unsigned int frame) {
+    return FrameFileName(filePattern, frame);
+}
+
+// FNV-1a of the pixels
+unsigned int SequenceRenderer::Fingerprint(EmptyTextureResourcePtr tex) {
+    unsigned int h = 2166136261u;
+    for (unsigned int v=0;v<tex->GetHeight();v++)
+        for (unsigned int u=0;u<tex->GetWidth();u++)
+            for (unsigned int c=0;c<3;c++)
+                h = (h ^ (*tex)(u,v,c)) * 16777619u;
+    return h;
+}
+
+unsigned int SequenceRenderer::Render(unsigned int first, unsigned int last) {
+    if (!ValidFramePattern(filePattern)) {
+        logger.error << "Sequence file " << filePattern
+                     << " needs one frame number like %04u" << logger.end;
+        return 0;
+    }
+    if (first > last)
+        return 0;
+
+    Timer t;
+    t.Reset();
+    t.Start();
+
+    ImageWriter writer;
+    writer.Start();
+
+    FrameTracer tracer(rt);
+    tracer.Start();
+    unsigned int still = 0;
+    unsigned int previous = 0;
+    for (unsigned int f=first;f<=last;f++) {
+        // animate, capture and fit the BVH of frame f while frame f-1
+        // is traced
+        SequenceFrameArg arg;
+        arg.frame = f;
+        arg.time = (f - first) / fps;
+        arg.dt = f == first ? 0 : 1.0 / fps;
+        animateEvent.Notify(arg);
+        rt->CaptureScene();
+        rt->PrepareScene();
+
+        if (f > first) {
+            tracer.WaitFrame();
+            unsigned int print = Fingerprint(rt->GetTexture());
+            if (f-1 > first && print == previous)
+                still++;
+            previous = print;
+            writer.Write(FileName(f-1), rt->GetTexture());
+        }
+
+        rt->ApplyScene();
+        tracer.Trace();
+    }
+
+    tracer.WaitFrame();
+    if (last > first && Fingerprint(rt->GetTexture()) == previous)
+        still++;
+    writer.Write(FileName(last), rt->GetTexture());
+    tracer.Finish();
+    writer.Finish();
+
+    t.Stop();
+    logger.info << "Rendered frames " << first << " to " << last
+                << " in " << t.GetElapsedTime() << logger.end;
+    if (still)
+        logger.warning << still << " frames were the same as the one before"
+                       << ", is anything animated?" << logger.end;
+    return still;
+}
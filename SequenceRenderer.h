@@ -0,0 +1,73 @@
+#ifndef _RT_SEQUENCE_RENDERER_H_
+#define _RT_SEQUENCE_RENDERER_H_
+
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Core/Event.h>
+#include <string>
+
+#include "RayTracer.h"
+#include "ImageWriter.h"
+
+using namespace OpenEngine::Core;
+
+using namespace std;
+
+struct SequenceFrameArg {
+    unsigned int frame;
+    float time;  // seconds since the first frame
+    float dt;    // since the frame before, 0 for the first
+};
+
+/**
+ * Renders an animation offline. The stages of a frame overlap: while
+ * frame N is traced, the scene is animated to frame N+1, captured into
+ * the tracer's back snapshot and the snapshot's own BVH is refitted or
+ * rebuilt, and frame N-1 is written to disk by an ImageWriter. Between
+ * frames only the snapshots are swapped.
+ *
+ * Frames are traced by one FrameTracer thread for the whole sequence.
+ *
+ * Listeners of AnimateEvent() move the scene to the given frame. The
+ * scene graph must only be changed from there.
+ */
+class SequenceRenderer {
+    class FrameTracer : public Thread {
+        RayTracer* rt;
+        Mutex lock;
+        bool pending;  // a frame to trace or being traced
+        bool run;
+    public:
+        FrameTracer(RayTracer* rt) : rt(rt), pending(false), run(true) {}
+        // traces the applied scene
+        void Trace();
+        void WaitFrame();
+        // stops the thread once the last frame is done
+        void Finish();
+        void Run();
+    };
+
+    RayTracer* rt;
+    Event<SequenceFrameArg> animateEvent;
+
+    string FileName(unsigned int frame);
+    static unsigned int Fingerprint(EmptyTextureResourcePtr tex);
+
+public:
+    // printf style pattern of the output files, given the frame number;
+    // Render() refuses one that is not a frame pattern, see FramePattern.h
+    string filePattern;
+    float fps;
+
+    SequenceRenderer(RayTracer* rt,
+                     string filePattern = "frame%04u.ppm",
+                     float fps = 25);
+
+    IEvent<SequenceFrameArg>& AnimateEvent();
+
+    // Returns the number of frames that came out the same as the one
+    // before, which in an animation means nothing moved.
+    unsigned int Render(unsigned int first, unsigned int last);
+};
+
+#endif
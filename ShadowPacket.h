@@ -0,0 +1,80 @@
+#ifndef _RT_SHADOW_PACKET_H_
+#define _RT_SHADOW_PACKET_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Shape.h>
+#include <Shapes/Ray.h>
+#include <vector>
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+
+using namespace std;
+
+/**
+ * A bundle of shadow rays towards the same light, typically from all
+ * the pixels of a tile. The packet keeps the bounding box of all its
+ * ray segments so an occluder can be rejected once for the whole
+ * packet instead of once per ray.
+ */
+class ShadowPacket {
+public:
+    vector<Ray> rays;
+    vector<float> maxT;
+    vector<Shape*> ignore;
+    vector<bool> occluded;
+
+    Vector<3,float> bmin;
+    Vector<3,float> bmax;
+
+    // room for n rays, so adding them does not allocate
+    void Reserve(unsigned int n) {
+        rays.reserve(n);
+        maxT.reserve(n);
+        ignore.reserve(n);
+        occluded.reserve(n);
+    }
+
+    void Clear() {
+        rays.clear();
+        maxT.clear();
+        ignore.clear();
+        occluded.clear();
+    }
+
+    void Add(Vector<3,float> from, Vector<3,float> to, Shape* self) {
+        Vector<3,float> d = to - from;
+        float dist = d.GetLength();
+
+        Ray r;
+        r.origin = from;
+        r.direction = d / dist;
+
+        if (rays.empty()) {
+            bmin = bmax = from;
+        }
+        for (unsigned int i=0;i<3;i++) {
+            bmin[i] = min(bmin[i], min(from[i], to[i]));
+            bmax[i] = max(bmax[i], max(from[i], to[i]));
+        }
+
+        rays.push_back(r);
+        maxT.push_back(dist);
+        ignore.push_back(self);
+        occluded.push_back(false);
+    }
+
+    unsigned int Size() const {
+        return rays.size();
+    }
+
+    bool Overlaps(const Vector<3,float>& min, const Vector<3,float>& max) const {
+        for (unsigned int i=0;i<3;i++) {
+            if (max[i] < bmin[i] || min[i] > bmax[i])
+                return false;
+        }
+        return true;
+    }
+};
+
+#endif
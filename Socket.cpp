@@ -0,0 +1,316 @@
+#include "Socket.h"
+
+#include <Logging/Logger.h>
+
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const unsigned int HEADER_SIZE = 8;
+
+#ifdef MSG_NOSIGNAL
+#define RT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define RT_SEND_FLAGS 0
+#endif
+
+Message::Message(uint32_t type)
+    : type(type), pos(0), bad(false) {}
+
+void Message::Clear(uint32_t t) {
+    type = t;
+    data.clear();
+    pos = 0;
+    bad = false;
+}
+
+void Message::PutInt(uint32_t v) {
+    uint32_t n = htonl(v);
+    PutBytes((const unsigned char*)&n, 4);
+}
+
+void Message::PutLong(uint64_t v) {
+    PutInt(uint32_t(v >> 32));
+    PutInt(uint32_t(v & 0xffffffff));
+}
+
+void Message::PutFloat(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    PutInt(bits);
+}
+
+void Message::PutBytes(const unsigned char* b, unsigned int n) {
+    data.insert(data.end(), b, b + n);
+}
+
+uint32_t Message::GetInt() {
+    uint32_t n = 0;
+    GetBytes((unsigned char*)&n, 4);
+    return ntohl(n);
+}
+
+uint64_t Message::GetLong() {
+    uint64_t hi = GetInt();
+    uint64_t lo = GetInt();
+    return (hi << 32) | lo;
+}
+
+float Message::GetFloat() {
+    uint32_t bits = GetInt();
+    float v;
+    memcpy(&v, &bits, 4);
+    return v;
+}
+
+void Message::GetBytes(unsigned char* b, unsigned int n) {
+    if (pos + n > data.size()) {
+        bad = true;
+        memset(b, 0, n);
+        return;
+    }
+    memcpy(b, &data[pos], n);
+    pos += n;
+}
+
+bool Message::AtEnd() const {
+    return pos >= data.size();
+}
+
+Socket::Socket(int fd) : fd(fd), limit(DEFAULT_MESSAGE_LIMIT) {
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+Socket::~Socket() {
+    close(fd);
+}
+
+int Socket::GetDescriptor() const {
+    return fd;
+}
+
+void Socket::SetMessageLimit(uint32_t bytes) {
+    limit = bytes;
+}
+
+void Socket::SetTimeout(unsigned int seconds) {
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Splits "tcp:host:port" / "unix:/path" into its parts.
+static bool ParseAddress(string address, string& kind, string& host, string& port) {
+    string::size_type c = address.find(':');
+    if (c == string::npos)
+        return false;
+    kind = address.substr(0, c);
+    string rest = address.substr(c + 1);
+    if (kind == "unix") {
+        host = rest;
+        return !host.empty();
+    }
+    if (kind != "tcp")
+        return false;
+    string::size_type c2 = rest.rfind(':');
+    if (c2 == string::npos) {
+        host = "";
+        port = rest;
+    } else {
+        host = rest.substr(0, c2);
+        port = rest.substr(c2 + 1);
+    }
+    if (host == "*")
+        host = "";
+    return !port.empty();
+}
+
+Socket* Socket::Listen(string address) {
+    string kind, host, port;
+    if (!ParseAddress(address, kind, host, port)) {
+        logger.error << "Bad address " << address << logger.end;
+        return NULL;
+    }
+
+    if (kind == "unix") {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, host.c_str(), sizeof(sa.sun_path) - 1);
+        unlink(host.c_str());
+        if (fd < 0 ||
+            bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+            listen(fd, 16) < 0) {
+            logger.error << "Could not listen on " << address << logger.end;
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        return new Socket(fd);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res) != 0) {
+        logger.error << "Could not resolve " << address << logger.end;
+        return NULL;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int one = 1;
+    if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd < 0 ||
+        bind(fd, res->ai_addr, res->ai_addrlen) < 0 ||
+        listen(fd, 16) < 0) {
+        logger.error << "Could not listen on " << address << logger.end;
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return NULL;
+    }
+    freeaddrinfo(res);
+    return new Socket(fd);
+}
+
+Socket* Socket::Connect(string address) {
+    string kind, host, port;
+    if (!ParseAddress(address, kind, host, port)) {
+        logger.error << "Bad address " << address << logger.end;
+        return NULL;
+    }
+
+    if (kind == "unix") {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, host.c_str(), sizeof(sa.sun_path) - 1);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        return new Socket(fd);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.empty() ? "localhost" : host.c_str(), port.c_str(), &hints, &res) != 0)
+        return NULL;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return NULL;
+    }
+    freeaddrinfo(res);
+
+    // tiles are small request/response pairs
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return new Socket(fd);
+}
+
+Socket* Socket::Accept() {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0)
+        return NULL;
+    return new Socket(c);
+}
+
+static bool SendAll(int fd, const unsigned char* b, unsigned int n) {
+    while (n > 0) {
+        ssize_t r = send(fd, b, n, RT_SEND_FLAGS);
+        if (r <= 0)
+            return false;
+        b += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool ReceiveAll(int fd, unsigned char* b, unsigned int n) {
+    while (n > 0) {
+        ssize_t r = recv(fd, b, n, 0);
+        if (r <= 0)
+            return false;
+        b += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool Socket::Send(const Message& m) {
+    uint32_t header[2];
+    header[0] = htonl(m.type);
+    header[1] = htonl(m.data.size());
+    if (!SendAll(fd, (const unsigned char*)header, sizeof(header)))
+        return false;
+    if (m.data.empty())
+        return true;
+    return SendAll(fd, &m.data[0], m.data.size());
+}
+
+bool Socket::Receive(Message& m) {
+    uint32_t header[2];
+    if (!ReceiveAll(fd, (unsigned char*)header, sizeof(header)))
+        return false;
+    uint32_t size = ntohl(header[1]);
+    if (size > limit)
+        return false;
+    m.Clear(ntohl(header[0]));
+    m.data.resize(size);
+    if (m.data.empty())
+        return true;
+    return ReceiveAll(fd, &m.data[0], m.data.size());
+}
+
+int Socket::ReceiveReady(Message& m) {
+    for (;;) {
+        // the header first, then exactly the body it announces, so the
+        // next message is left in the kernel
+        unsigned int need = HEADER_SIZE;
+        if (inbox.size() >= HEADER_SIZE) {
+            uint32_t header[2];
+            memcpy(header, &inbox[0], HEADER_SIZE);
+            uint32_t size = ntohl(header[1]);
+            if (size > limit)
+                return -1;
+            need = HEADER_SIZE + size;
+            if (inbox.size() == need) {
+                m.Clear(ntohl(header[0]));
+                m.data.assign(inbox.begin() + HEADER_SIZE, inbox.end());
+                inbox.clear();
+                return 1;
+            }
+        }
+
+        unsigned int have = inbox.size();
+        inbox.resize(need);
+        ssize_t r = recv(fd, &inbox[have], need - have, MSG_DONTWAIT);
+        if (r <= 0) {
+            inbox.resize(have);
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return 0;
+            return -1;
+        }
+        inbox.resize(have + r);
+    }
+}
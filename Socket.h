@@ -0,0 +1,93 @@
+#ifndef _RT_SOCKET_H_
+#define _RT_SOCKET_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * A typed, length prefixed message. Integers and floats are stored in
+ * network byte order so tracer nodes of any endianness can talk.
+ *
+ * Reading past the end sets bad instead of throwing; check it after
+ * parsing a message.
+ */
+class Message {
+public:
+    uint32_t type;
+    vector<unsigned char> data;
+    unsigned int pos;
+    bool bad;
+
+    Message(uint32_t type = 0);
+
+    void Clear(uint32_t type);
+
+    void PutInt(uint32_t v);
+    void PutLong(uint64_t v);
+    void PutFloat(float v);
+    void PutBytes(const unsigned char* b, unsigned int n);
+
+    uint32_t GetInt();
+    uint64_t GetLong();
+    float GetFloat();
+    void GetBytes(unsigned char* b, unsigned int n);
+
+    bool AtEnd() const;
+};
+
+/**
+ * Stream socket carrying Messages. Addresses are either
+ * "tcp:host:port" or "unix:/path"; a listening tcp address may leave
+ * out the host ("tcp:7000").
+ *
+ * Send and Receive block, up to the timeout if one is set.
+ * ReceiveReady never blocks; it keeps a partial message in the socket
+ * until the rest has arrived, so one peer stalling mid message can
+ * not hold up a poll loop serving several.
+ */
+class Socket {
+    int fd;
+    uint32_t limit;
+    vector<unsigned char> inbox; // header and body received so far
+
+    Socket(int fd);
+public:
+    ~Socket();
+
+    static Socket* Listen(string address);
+    static Socket* Connect(string address);
+
+    Socket* Accept();
+
+    /**
+     * Incoming messages larger than this are refused and fail the
+     * connection, before anything is allocated for them. Defaults to
+     * DEFAULT_MESSAGE_LIMIT.
+     */
+    void SetMessageLimit(uint32_t bytes);
+    static const uint32_t DEFAULT_MESSAGE_LIMIT = 1 << 20;
+
+    /**
+     * Send and Receive fail instead of waiting longer than this for
+     * the peer, 0 waits forever.
+     */
+    void SetTimeout(unsigned int seconds);
+
+    bool Send(const Message& m);
+    bool Receive(Message& m);
+
+    /**
+     * Reads whatever has arrived without blocking.
+     *
+     * @return 1 with a whole message in m, 0 if it has not all arrived
+     * yet, -1 if the connection is closed or sent something too large
+     */
+    int ReceiveReady(Message& m);
+
+    int GetDescriptor() const;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include "TileStream.h"
+#include "FramePattern.h"
+
+#include <Logging/Logger.h>
+#include <sys/types.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <csignal>
+#endif
+
+static const char MAGIC[8] = {'R','T','T','I','L','E','S',0};
+static const unsigned int VERSION = 1;
+
+TileStream::TileStream()
+    : file(NULL), piped(false), frameFile(NULL), frameWidth(0), frameHeader(0),
+      failed(false), pool(0), queued(0), run(false), tiles(0), height(0) {}
+
+TileStream::~TileStream() {
+    if (run)
+        Close();
+}
+
+bool TileStream::Open(string target) {
+    piped = false;
+    pattern.clear();
+    if (target == "-")
+        file = stdout;
+    else if (target[0] == '|') {
+#ifndef _WIN32
+        file = popen(target.c_str() + 1, "w");
+        piped = true;
+#endif
+    } else if (target.size() > 4 && target.compare(target.size() - 4, 4, ".ppm") == 0) {
+        if (!ValidFramePattern(target)) {
+            logger.error << "Tile stream " << target
+                         << " needs one frame number like %04u" << logger.end;
+            return false;
+        }
+        pattern = target;
+    } else
+        file = fopen(target.c_str(), "wb");
+
+    if (!file && pattern.empty()) {
+        logger.error << "Could not open tile stream " << target << logger.end;
+        return false;
+    }
+#ifndef _WIN32
+    // a consumer that goes away fails the writes instead of killing us
+    if (file == stdout || piped)
+        signal(SIGPIPE, SIG_IGN);
+#endif
+    if (file) {
+        unsigned int header[2] = { VERSION, 3 };
+        fwrite(MAGIC, 1, sizeof(MAGIC), file);
+        fwrite(header, sizeof(header), 1, file);
+    }
+    failed = false;
+    queued = 0;
+    tiles = 0;
+    run = true;
+    Start();
+    return true;
+}
+
+void TileStream::Close() {
+    lock.Lock();
+    run = false;
+    lock.Unlock();
+    Wait();
+
+    if (frameFile)
+        fclose(frameFile);
+    frameFile = NULL;
+    if (!file)
+        return;
+    int err;
+    if (file == stdout)
+        err = fflush(file);
+#ifndef _WIN32
+    else if (piped)
+        err = pclose(file);
+#endif
+    else
+        err = fclose(file);
+    if (err != 0 && !failed)
+        logger.error << "Could not write tile stream" << logger.end;
+    file = NULL;
+}
+
+unsigned long TileStream::Tiles() {
+    lock.Lock();
+    unsigned long n = tiles;
+    lock.Unlock();
+    return n;
+}
+
+void TileStream::Reserve(unsigned int chunks, unsigned int bytes) {
+    // more never fit in the queue
+    chunks = min((unsigned long)chunks, MAX_QUEUED / max(1u, bytes) + 1);
+    Chunks made;
+    lock.Lock();
+    unsigned int missing = chunks > pool ? chunks - pool : 0;
+    pool += missing;
+    for (Chunks::iterator itr = spare.begin(); itr != spare.end(); itr++)
+        itr->rgb.reserve(bytes);
+    lock.Unlock();
+
+    // chunks out in the queue grow once more at most, when next used
+    for (unsigned int i=0;i<missing;i++) {
+        made.push_back(Chunk());
+        made.back().rgb.reserve(bytes);
+    }
+    lock.Lock();
+    spare.splice(spare.end(), made);
+    lock.Unlock();
+}
+
+void TileStream::BeginFrame(unsigned int frame, unsigned int width, unsigned int height) {
+    this->height = height;
+    Chunks chunk(1);
+    unsigned int* r = chunk.front().record;
+    r[0] = FRAME;
+    r[1] = frame;
+    r[2] = width;
+    r[3] = height;
+    r[4] = 0;
+    Submit(chunk);
+}
+
+void TileStream::EndFrame(unsigned int frame, bool canceled) {
+    Chunks chunk(1);
+    unsigned int* r = chunk.front().record;
+    r[0] = END;
+    r[1] = frame;
+    r[2] = canceled;
+    r[3] = 0;
+    r[4] = 0;
+    Submit(chunk);
+}
+
+void TileStream::Add(EmptyTextureResourcePtr tex,
+                     unsigned int x0, unsigned int y0,
+                     unsigned int x1, unsigned int y1) {
+    Chunks chunk;
+    lock.Lock();
+    while ((queued > MAX_QUEUED || (pool && spare.empty())) && !failed) {
+        lock.Unlock();
+        Thread::Sleep(1000);
+        lock.Lock();
+    }
+    if (!failed && !spare.empty())
+        chunk.splice(chunk.begin(), spare, spare.begin());
+    bool drop = failed;
+    lock.Unlock();
+    if (drop)
+        return;
+    if (chunk.empty())
+        chunk.push_back(Chunk());
+
+    // texture rows go bottom up
+    Chunk& c = chunk.front();
+    c.record[0] = TILE;
+    c.record[1] = x0;
+    c.record[2] = height - y1;
+    c.record[3] = x1;
+    c.record[4] = height - y0;
+    c.rgb.resize((x1 - x0) * (y1 - y0) * 3);
+    unsigned char* p = &c.rgb[0];
+    for (unsigned int v=y1;v-- > y0;) {
+        for (unsigned int u=x0;u<x1;u++) {
+            *p++ = (*tex)(u,v,0);
+            *p++ = (*tex)(u,v,1);
+            *p++ = (*tex)(u,v,2);
+        }
+    }
+    Submit(chunk);
+}
+
+void TileStream::Submit(Chunks& chunk) {
+    lock.Lock();
+    queued += chunk.front().rgb.size();
+    queue.splice(queue.end(), chunk);
+    lock.Unlock();
+}
+
+// a raw stream is given up on, a PPM file only for the rest of its frame
+void TileStream::Fail(string what) {
+    logger.error << "Could not write " << what << logger.end;
+    if (frameFile) {
+        fclose(frameFile);
+        frameFile = NULL;
+        return;
+    }
+    lock.Lock();
+    failed = true;
+    lock.Unlock();
+}
+
+void TileStream::WriteChunk(const Chunk& chunk) {
+    const unsigned int* r = chunk.record;
+    if (file) {
+        if (failed)
+            return;
+        bool ok = fwrite(r, sizeof(chunk.record), 1, file) == 1 &&
+            (chunk.rgb.empty() ||
+             fwrite(&chunk.rgb[0], 1, chunk.rgb.size(), file) == chunk.rgb.size());
+        // so the consumer sees the frame end without waiting for the next
+        if (ok && r[0] == END)
+            ok = fflush(file) == 0;
+        if (!ok)
+            Fail("tile stream");
+        return;
+    }
+
+    string name;
+    switch (r[0]) {
+    case FRAME:
+        if (frameFile)
+            fclose(frameFile);
+        name = FrameFileName(pattern, r[1]);
+        frameFile = fopen(name.c_str(), "wb");
+        if (!frameFile) {
+            logger.error << "Could not open " << name << logger.end;
+            break;
+        }
+        // the full size up front, so tiles can be written anywhere
+        fprintf(frameFile, "P6\n%u %u\n255\n", r[2], r[3]);
+        frameHeader = ftello(frameFile);
+        frameWidth = r[2];
+        if (r[2] && r[3] &&
+            (fseeko(frameFile, frameHeader + (off_t)r[2] * r[3] * 3 - 1, SEEK_SET) != 0 ||
+             fputc(0, frameFile) == EOF))
+            Fail(name);
+        break;
+    case TILE:
+        if (frameFile)
+            WriteTile(chunk);
+        break;
+    case END:
+        if (frameFile && fclose(frameFile) != 0)
+            logger.error << "Could not write tile stream frame " << r[1] << logger.end;
+        frameFile = NULL;
+        break;
+    }
+}
+
+void TileStream::WriteTile(const Chunk& chunk) {
+    const unsigned int* r = chunk.record;
+    unsigned int w = (r[3] - r[1]) * 3;
+    for (unsigned int y=r[2];y<r[4];y++) {
+        off_t at = frameHeader + ((off_t)y * frameWidth + r[1]) * 3;
+        if (fseeko(frameFile, at, SEEK_SET) != 0 ||
+            fwrite(&chunk.rgb[(y - r[2]) * w], 1, w, frameFile) != w) {
+            Fail("tile stream frame");
+            return;
+        }
+    }
+}
+
+void TileStream::Run() {
+    for (;;) {
+        lock.Lock();
+        if (queue.empty()) {
+            bool done = !run;
+            lock.Unlock();
+            if (done)
+                return;
+            Thread::Sleep(1000);
+            continue;
+        }
+        Chunks chunk;
+        chunk.splice(chunk.begin(), queue, queue.begin());
+        lock.Unlock();
+
+        WriteChunk(chunk.front());
+
+        lock.Lock();
+        queued -= chunk.front().rgb.size();
+        if (chunk.front().record[0] == TILE) {
+            tiles++;
+            spare.splice(spare.end(), chunk);
+        }
+        lock.Unlock();
+    }
+}
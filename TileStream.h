@@ -0,0 +1,106 @@
+#ifndef _RT_TILE_STREAM_H_
+#define _RT_TILE_STREAM_H_
+
+#include <Core/Thread.h>
+#include <Core/Mutex.h>
+#include <Resources/EmptyTextureResource.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <cstdio>
+
+using namespace OpenEngine::Core;
+using namespace OpenEngine::Resources;
+
+using namespace std;
+
+/**
+ * Writes the tiles of each frame as they are finished, so a consumer
+ * can start on a frame before it is done and the writer never holds a
+ * whole frame. The target is one of
+ *
+ *   -            a raw tile stream on stdout
+ *   |command     a raw tile stream into the command's stdin
+ *   name%04u.ppm a PPM file per frame, its tiles written in place; the
+ *                pattern is checked, see FramePattern.h
+ *   anything     a raw tile stream into that file or named pipe
+ *
+ * The raw stream is the magic and a version, then records of five
+ * unsigned ints in host byte order:
+ *
+ *   FRAME  frame width height 0  a frame begins
+ *   TILE   x0 y0 x1 y1           followed by (x1-x0)*(y1-y0) RGB pixels
+ *   END    frame canceled 0 0    the frame is done
+ *
+ * Coordinates and pixel rows go top down, like in a PPM. Tiles come in
+ * the order they were finished; a canceled or cropped frame has tiles
+ * only where it was traced.
+ *
+ * Tiles are copied into recycled chunks and written by the stream's
+ * own thread. When the target falls behind by more than MAX_QUEUED
+ * bytes, Add() waits for it. Once Reserve() has set up a pool of
+ * chunks, Add() also waits for a free chunk rather than allocating one.
+ */
+class TileStream : public Thread {
+public:
+    enum Kind { FRAME = 1, TILE, END };
+
+private:
+    static const unsigned long MAX_QUEUED = 64 << 20;
+
+    struct Chunk {
+        unsigned int record[5];
+        vector<unsigned char> rgb;
+    };
+    typedef list<Chunk> Chunks;
+
+    FILE* file;      // raw stream
+    bool piped;
+    string pattern;  // of PPM files, when not a raw stream
+    FILE* frameFile;
+    unsigned int frameWidth;
+    long frameHeader;
+    bool failed;
+
+    Chunks queue;
+    Chunks spare;
+    unsigned int pool;  // tile chunks made by Reserve()
+    unsigned long queued;  // bytes of pixels in the queue
+    Mutex lock;
+    bool run;
+    unsigned long tiles;
+    unsigned int height;  // of the frame being added
+
+    void Submit(Chunks& chunk);
+    void WriteChunk(const Chunk& chunk);
+    void WriteTile(const Chunk& chunk);
+    void Fail(string what);
+
+public:
+    TileStream();
+    ~TileStream();
+
+    bool Open(string target);
+
+    // writes what is queued and closes the target
+    void Close();
+
+    // a pool of chunks for tiles of up to bytes of pixels each
+    void Reserve(unsigned int chunks, unsigned int bytes);
+
+    // called by the tracer thread around the tiles of a frame
+    void BeginFrame(unsigned int frame, unsigned int width, unsigned int height);
+    void EndFrame(unsigned int frame, bool canceled);
+
+    // copies [x0,x1) x [y0,y1) of tex, in texture coordinates, from
+    // any thread
+    void Add(EmptyTextureResourcePtr tex,
+             unsigned int x0, unsigned int y0,
+             unsigned int x1, unsigned int y1);
+
+    unsigned long Tiles();
+
+    void Run();
+};
+
+#endif
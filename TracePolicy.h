@@ -0,0 +1,70 @@
+#ifndef _RT_TRACE_POLICY_H_
+#define _RT_TRACE_POLICY_H_
+
+#include "Profiler.h"
+
+/**
+ * Compile time switches for the tracing kernel. TraceRay, NearestShape,
+ * the shadow ray tests and the shading kernels are instantiated once
+ * per policy, so the variant that traces normal frames has no debug or
+ * bookkeeping branches left in it.
+ *
+ *   VERBOSE    log every intersection and shading term
+ *   COLLECT    hand the rays of the path back to the caller
+ *   STATS      ray log records and profiler phase sums
+ *   MAX_DEPTH  hard bound on the recursion, whatever maxDepth is set to
+ *
+ * INDEX selects the policy's row in the kernel tables.
+ */
+struct FastTrace {
+    static const unsigned int INDEX = 0;
+    static const bool VERBOSE = false;
+    static const bool COLLECT = false;
+    static const bool STATS = false;
+    static const int MAX_DEPTH = 16;
+};
+
+// frames traced while rays are recorded or phases profiled
+struct StatsTrace {
+    static const unsigned int INDEX = 1;
+    static const bool VERBOSE = false;
+    static const bool COLLECT = false;
+    static const bool STATS = true;
+    static const int MAX_DEPTH = 16;
+};
+
+// the ray path drawn by the debug render node, short enough to see
+struct CollectTrace {
+    static const unsigned int INDEX = 2;
+    static const bool VERBOSE = false;
+    static const bool COLLECT = true;
+    static const bool STATS = false;
+    static const int MAX_DEPTH = 8;
+};
+
+// the marked pixel with debugging on, short enough to read the log
+struct DebugTrace {
+    static const unsigned int INDEX = 3;
+    static const bool VERBOSE = true;
+    static const bool COLLECT = true;
+    static const bool STATS = true;
+    static const int MAX_DEPTH = 8;
+};
+
+static const unsigned int TRACE_POLICIES = 4;
+
+// A Profiler::Sum if the policy keeps statistics, nothing otherwise.
+template <bool STATS>
+class PhaseSum {
+    Profiler::Sum sum;
+public:
+    PhaseSum(Profiler::Phase phase) : sum(phase) {}
+};
+
+template <>
+class PhaseSum<false> {
+public:
+    PhaseSum(Profiler::Phase) {}
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include "Upscale.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+// relative depth difference at which a sample counts half
+static const float DEPTH_SIGMA = 0.05;
+
+void Upscale(EmptyTextureResourcePtr src, const float* depth,
+             EmptyTextureResourcePtr dst) {
+    unsigned int sw = src->GetWidth(), sh = src->GetHeight();
+    unsigned int dw = dst->GetWidth(), dh = dst->GetHeight();
+    float sx = float(sw) / dw;
+    float sy = float(sh) / dh;
+
+    for (unsigned int v=0;v<dh;v++) {
+        float fy = max(0.0f, (v + 0.5f) * sy - 0.5f);
+        unsigned int y0 = min((unsigned int)fy, sh - 1);
+        unsigned int y1 = min(y0 + 1, sh - 1);
+        float ty = fy - y0;
+
+        for (unsigned int u=0;u<dw;u++) {
+            float fx = max(0.0f, (u + 0.5f) * sx - 0.5f);
+            unsigned int x0 = min((unsigned int)fx, sw - 1);
+            unsigned int x1 = min(x0 + 1, sw - 1);
+            float tx = fx - x0;
+
+            unsigned int xs[4] = { x0, x1, x0, x1 };
+            unsigned int ys[4] = { y0, y0, y1, y1 };
+            float w[4] = { (1-tx)*(1-ty), tx*(1-ty), (1-tx)*ty, tx*ty };
+
+            if (depth) {
+                // the closest sample decides which surface we are on
+                unsigned int ref = 0;
+                for (unsigned int k=1;k<4;k++)
+                    if (w[k] > w[ref])
+                        ref = k;
+                float dRef = depth[ys[ref]*sw + xs[ref]];
+                for (unsigned int k=0;k<4;k++) {
+                    float d = depth[ys[k]*sw + xs[k]];
+                    if ((d < 0) != (dRef < 0)) {
+                        w[k] *= 0.001f;
+                        continue;
+                    }
+                    if (dRef > 0) {
+                        float rel = fabs(d - dRef) / dRef / DEPTH_SIGMA;
+                        w[k] /= 1 + rel*rel;
+                    }
+                }
+            }
+
+            float sum = w[0] + w[1] + w[2] + w[3];
+            for (unsigned int c=0;c<3;c++) {
+                float col = 0;
+                for (unsigned int k=0;k<4;k++)
+                    col += w[k] * (*src)(xs[k],ys[k],c);
+                (*dst)(u,v,c) = (unsigned char)(col / sum + 0.5f);
+            }
+        }
+    }
+}
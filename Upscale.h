@@ -0,0 +1,21 @@
+#ifndef _RT_UPSCALE_H_
+#define _RT_UPSCALE_H_
+
+#include <Resources/EmptyTextureResource.h>
+
+using namespace OpenEngine::Resources;
+
+/**
+ * Joint bilateral upsampling of a traced frame into a larger texture.
+ * Each destination pixel blends the four nearest source pixels
+ * bilinearly, but weights down those whose view depth differs from
+ * the closest one's, so object edges stay sharp instead of bleeding
+ * into the background.
+ *
+ * depth holds one view depth per source pixel (< 0 on a miss), or is
+ * NULL for plain bilinear filtering.
+ */
+void Upscale(EmptyTextureResourcePtr src, const float* depth,
+             EmptyTextureResourcePtr dst);
+
+#endif
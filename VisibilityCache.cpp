@@ -0,0 +1,116 @@
+#include "VisibilityCache.h"
+
+#include <cmath>
+
+VisibilityCache::VisibilityCache(unsigned int sizeLog2, float cellSize)
+    : mask((1 << sizeLog2) - 1)
+    , cellSize(cellSize)
+    , epoch(1)
+    , sceneEpoch(1) {
+    Entry e;
+    e.x = e.y = e.z = 0;
+    e.light = 0;
+    e.object = 0;
+    e.epoch = 0;
+    e.vis = 0;
+    entries.resize(mask + 1, e);
+    ResetStats();
+}
+
+void VisibilityCache::Cell(Vector<3,float> p, int& x, int& y, int& z) const {
+    x = int(floorf(p[0] / cellSize));
+    y = int(floorf(p[1] / cellSize));
+    z = int(floorf(p[2] / cellSize));
+}
+
+unsigned int VisibilityCache::Slot(int x, int y, int z, unsigned int light, unsigned int object) const {
+    unsigned int h = (unsigned int)(x) * 73856093u
+        ^ (unsigned int)(y) * 19349663u
+        ^ (unsigned int)(z) * 83492791u
+        ^ light * 2654435761u
+        ^ object * 40503u;
+    return h & mask;
+}
+
+unsigned int VisibilityCache::ValidSince(unsigned int light) const {
+    if (light < lightEpochs.size())
+        return max(sceneEpoch, lightEpochs[light]);
+    return sceneEpoch;
+}
+
+bool VisibilityCache::Lookup(Vector<3,float> p, unsigned int light, unsigned int object, float& vis) {
+    int x,y,z;
+    Cell(p,x,y,z);
+    unsigned int slot = Slot(x,y,z,light,object);
+    Stripe& stripe = stripes[slot % STRIPES];
+
+    stripe.lock.Lock();
+    const Entry& e = entries[slot];
+    bool hit = e.epoch >= ValidSince(light) &&
+        e.x == x && e.y == y && e.z == z &&
+        e.light == light && e.object == object;
+    if (hit) {
+        vis = e.vis;
+        stripe.hits++;
+    } else
+        stripe.misses++;
+    stripe.lock.Unlock();
+    return hit;
+}
+
+void VisibilityCache::Store(Vector<3,float> p, unsigned int light, unsigned int object, float vis) {
+    int x,y,z;
+    Cell(p,x,y,z);
+    unsigned int slot = Slot(x,y,z,light,object);
+    Stripe& stripe = stripes[slot % STRIPES];
+
+    // direct mapped, a colliding key simply replaces the old entry
+    stripe.lock.Lock();
+    Entry& e = entries[slot];
+    e.x = x;
+    e.y = y;
+    e.z = z;
+    e.light = light;
+    e.object = object;
+    e.epoch = epoch;
+    e.vis = vis;
+    stripe.lock.Unlock();
+}
+
+void VisibilityCache::InvalidateAll() {
+    sceneEpoch = ++epoch;
+}
+
+void VisibilityCache::InvalidateLight(unsigned int light) {
+    if (light >= lightEpochs.size())
+        lightEpochs.resize(light + 1, 0);
+    lightEpochs[light] = ++epoch;
+}
+
+void VisibilityCache::SetCellSize(float size) {
+    cellSize = size;
+    InvalidateAll();
+}
+
+float VisibilityCache::GetCellSize() const {
+    return cellSize;
+}
+
+unsigned int VisibilityCache::Hits() const {
+    unsigned int n = 0;
+    for (unsigned int i=0;i<STRIPES;i++)
+        n += stripes[i].hits;
+    return n;
+}
+
+unsigned int VisibilityCache::Misses() const {
+    unsigned int n = 0;
+    for (unsigned int i=0;i<STRIPES;i++)
+        n += stripes[i].misses;
+    return n;
+}
+
+void VisibilityCache::ResetStats() {
+    for (unsigned int i=0;i<STRIPES;i++)
+        stripes[i].hits = stripes[i].misses = 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _RT_VISIBILITY_CACHE_H_
+#define _RT_VISIBILITY_CACHE_H_
+
+#include <Math/Vector.h>
+#include <Core/Mutex.h>
+#include <vector>
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Core;
+
+using namespace std;
+
+/**
+ * World space cache of light visibility. Entries live in a hashed
+ * grid keyed by the cell of the shading point, the light and the
+ * index of the object that was hit, so the shadow rays of a static scene only have
+ * to be traced once no matter how the camera moves.
+ *
+ * All entries are dropped with InvalidateAll() when geometry moves,
+ * and the entries of a single light with InvalidateLight().
+ *
+ * Lookup() and Store() may be called from several tracing threads;
+ * the table is locked in stripes.
+ */
+class VisibilityCache {
+    struct Entry {
+        int x,y,z;
+        unsigned int light;
+        unsigned int object;
+        unsigned int epoch;
+        float vis;
+    };
+
+    static const unsigned int STRIPES = 64;
+
+    struct Stripe {
+        Mutex lock;
+        unsigned int hits;
+        unsigned int misses;
+    };
+
+    vector<Entry> entries;
+    Stripe stripes[STRIPES];
+    unsigned int mask;
+    float cellSize;
+
+    // entries stored before the last invalidation of the scene or of
+    // their light are stale
+    unsigned int epoch;
+    unsigned int sceneEpoch;
+    vector<unsigned int> lightEpochs;
+
+    void Cell(Vector<3,float> p, int& x, int& y, int& z) const;
+    unsigned int Slot(int x, int y, int z, unsigned int light, unsigned int object) const;
+    unsigned int ValidSince(unsigned int light) const;
+
+public:
+    VisibilityCache(unsigned int sizeLog2 = 18, float cellSize = 0.25);
+
+    bool Lookup(Vector<3,float> p, unsigned int light, unsigned int object, float& vis);
+    void Store(Vector<3,float> p, unsigned int light, unsigned int object, float vis);
+
+    void InvalidateAll();
+    void InvalidateLight(unsigned int light);
+
+    void SetCellSize(float size);
+    float GetCellSize() const;
+
+    unsigned int Hits() const;
+    unsigned int Misses() const;
+    void ResetStats();
+};
+
+#endif
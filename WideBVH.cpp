@@ -0,0 +1,135 @@
+#include "WideBVH.h"
+#include "BVH.h"
+
+static float Area(const Vector<3,float>& bmin, const Vector<3,float>& bmax) {
+    Vector<3,float> d = bmax - bmin;
+    return 2 * (d[0]*d[1] + d[1]*d[2] + d[2]*d[0]);
+}
+
+void WideBVH::Build(const BVH& tree) {
+    nodes.clear();
+    prims.clear();
+    sources.clear();
+    if (tree.nodes.empty())
+        return;
+    nodes.reserve(tree.nodes.size() / 4 + 1);
+    sources.reserve(tree.nodes.size() / 4 + 1);
+    nodes.push_back(Node());
+    sources.push_back(Source());
+    Collapse(tree, 0, 0);
+}
+
+void WideBVH::Refit(const BVH& tree) {
+    for (unsigned int i=0;i<nodes.size();i++)
+        Quantise(nodes[i], tree, sources[i]);
+}
+
+void WideBVH::Collapse(const BVH& tree, unsigned int binary, unsigned int wide) {
+    const BVH::Node& parent = tree.nodes[binary];
+
+    // open the largest inner child until all slots are taken
+    Source source;
+    unsigned int* slots = source.slots;
+    unsigned int n = 0;
+    if (parent.count)
+        slots[n++] = binary;
+    else {
+        slots[n++] = binary + 1;
+        slots[n++] = parent.start;
+    }
+    while (n < WIDTH) {
+        int best = -1;
+        float bestArea = -1;
+        for (unsigned int k=0;k<n;k++) {
+            const BVH::Node& c = tree.nodes[slots[k]];
+            float a = Area(c.bmin, c.bmax);
+            if (!c.count && a > bestArea) {
+                best = k;
+                bestArea = a;
+            }
+        }
+        if (best < 0)
+            break;
+        unsigned int open = slots[best];
+        slots[best] = open + 1;
+        slots[n++] = tree.nodes[open].start;
+    }
+    source.parent = binary;
+    source.used = n;
+
+    Node node;
+    node.innerMask = 0;
+    node.childBase = nodes.size();
+    node.primBase = prims.size();
+
+    unsigned int inner[WIDTH];
+    unsigned int nInner = 0;
+    for (unsigned int k=0;k<WIDTH;k++) {
+        node.count[k] = 0;
+        if (k >= n)
+            continue;
+        const BVH::Node& c = tree.nodes[slots[k]];
+        if (c.count) {
+            node.count[k] = c.count;
+            for (unsigned int i=0;i<c.count;i++)
+                prims.push_back(tree.prims[c.start + i]);
+        } else {
+            node.innerMask |= 1 << k;
+            inner[nInner++] = slots[k];
+        }
+    }
+    Quantise(node, tree, source);
+    nodes[wide] = node;
+    sources[wide] = source;
+
+    // the inner children side by side, then each of their subtrees
+    for (unsigned int i=0;i<nInner;i++) {
+        nodes.push_back(Node());
+        sources.push_back(Source());
+    }
+    for (unsigned int i=0;i<nInner;i++)
+        Collapse(tree, inner[i], node.childBase + i);
+}
+
+// The boxes of a node's slots relative to its own, from the binary
+// nodes it was collapsed from.
+void WideBVH::Quantise(Node& node, const BVH& tree, const Source& source) {
+    const BVH::Node& parent = tree.nodes[source.parent];
+
+    // quanta of a power of two, so 255 of them cover the node
+    for (unsigned int a=0;a<3;a++) {
+        float extent = parent.bmax[a] - parent.bmin[a];
+        int e;
+        frexpf(extent / 255, &e);
+        e = max(-120, min(120, e));
+        if (parent.bmin[a] + ldexpf(255.0f, e) < parent.bmax[a])
+            e++;
+        node.origin[a] = parent.bmin[a];
+        node.exponent[a] = e;
+    }
+
+    for (unsigned int k=0;k<WIDTH;k++) {
+        if (k >= source.used) {
+            for (unsigned int a=0;a<3;a++) {
+                node.lo[a][k] = 255;
+                node.hi[a][k] = 0;
+            }
+            continue;
+        }
+        const BVH::Node& c = tree.nodes[source.slots[k]];
+
+        // round outwards, and past float rounding of the decoded plane
+        for (unsigned int a=0;a<3;a++) {
+            float o = node.origin[a];
+            float scale = ldexpf(1.0f, node.exponent[a]);
+            int lo = max(0, min(255, (int)floorf((c.bmin[a] - o) / scale)));
+            int hi = max(0, min(255, (int)ceilf((c.bmax[a] - o) / scale)));
+            while (lo > 0 && o + lo * scale > c.bmin[a])
+                lo--;
+            while (hi < 255 && o + hi * scale < c.bmax[a])
+                hi++;
+            node.lo[a][k] = lo;
+            node.hi[a][k] = hi;
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#ifndef _RT_WIDE_BVH_H_
+#define _RT_WIDE_BVH_H_
+
+#include <Math/Vector.h>
+#include <Shapes/Ray.h>
+#include <vector>
+#include <cmath>
+
+#include "AlignedAllocator.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace OpenEngine::Math;
+using namespace OpenEngine::Shapes;
+
+using namespace std;
+
+class BVH;
+
+/**
+ * Compressed 8-wide copy of a BVH, the one rays traverse. Each node
+ * holds the boxes of up to eight children quantised to 8 bits per
+ * plane, relative to the node's own box, so a node is 80 bytes where
+ * eight binary nodes take 256. The node array starts on a cache line,
+ * so no node spans more than two.
+ *
+ * The inner children of a node are stored next to each other from
+ * childBase on, and the object indices of its leaf children from
+ * primBase on, in slot order. Empty slots have inverted boxes, which
+ * no ray hits.
+ *
+ * A refit keeps the collapsed topology and only quantises the new
+ * boxes again, from the binary nodes each wide node was made of.
+ */
+class WideBVH {
+public:
+    static const unsigned int WIDTH = 8;
+
+    // up to seven siblings wait on each of BVH::STACK_SIZE levels
+    static const unsigned int STACK_SIZE = 7 * 96 + 1;
+
+    struct Node {
+        float origin[3];            // the node's box minimum
+        signed char exponent[3];    // a quantum is 2^exponent
+        unsigned char innerMask;    // slots holding inner nodes
+        unsigned int childBase;
+        unsigned int primBase;
+        unsigned char count[WIDTH]; // objects of each leaf child
+        unsigned char lo[3][WIDTH];
+        unsigned char hi[3][WIDTH];
+    };
+
+    // a child waiting on the traversal stack, count is 0 for nodes
+    struct Entry {
+        unsigned int index;
+        unsigned int count;
+        float t;
+    };
+
+    // the binary nodes a wide node was collapsed from, for Refit()
+    struct Source {
+        unsigned int parent;
+        unsigned int slots[WIDTH];
+        unsigned int used;  // slots taken, from the first
+    };
+
+    static const size_t NODE_ALIGN = 64;
+    typedef vector<Node, AlignedAllocator<Node, NODE_ALIGN> > NodeArray;
+
+    NodeArray nodes;
+    vector<unsigned int> prims;  // object indices
+    vector<Source> sources;      // one per node
+
+    // collapses a built tree
+    void Build(const BVH& tree);
+
+    // requantises the boxes of a refitted tree, whose topology is the
+    // one it was built from
+    void Refit(const BVH& tree);
+
+    // Tests the ray against all children of a node at once. Returns a
+    // bit per child hit before maxT, with its entry distance in t.
+    static unsigned int HitChildren(const Node& node, const Ray& r,
+                                    const Vector<3,float>& invDir,
+                                    float maxT, float t[WIDTH]);
+
+    // the box of one child, widened to whole quanta
+    static void ChildBox(const Node& node, unsigned int k,
+                         Vector<3,float>& bmin, Vector<3,float>& bmax);
+
+    // Pushes the hit children, the nearest last so it is popped first.
+    static unsigned int Push(const Node& node, unsigned int hits,
+                             const float t[WIDTH], Entry* stack, unsigned int sp);
+
+    static bool Valid(const Node& node, unsigned int k) {
+        return (node.innerMask >> k & 1) || node.count[k];
+    }
+
+private:
+    void Collapse(const BVH& tree, unsigned int binary, unsigned int wide);
+    static void Quantise(Node& node, const BVH& tree, const Source& source);
+};
+
+inline unsigned int WideBVH::HitChildren(const Node& node, const Ray& r,
+                                         const Vector<3,float>& invDir,
+                                         float maxT, float t[WIDTH]) {
+    // the near plane of each slab is the low one unless the ray runs
+    // backwards along the axis; empty slots come out with t0 > t1
+#ifdef __SSE2__
+    __m128 t0[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 t1[2] = { _mm_set1_ps(maxT), _mm_set1_ps(maxT) };
+    __m128i zero = _mm_setzero_si128();
+    for (unsigned int a=0;a<3;a++) {
+        bool back = invDir[a] < 0;
+        __m128 scale = _mm_set1_ps(ldexpf(1.0f, node.exponent[a]));
+        __m128 offset = _mm_set1_ps(node.origin[a] - r.origin[a]);
+        __m128 inv = _mm_set1_ps(invDir[a]);
+        __m128i qn = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)
+                                       (back ? node.hi[a] : node.lo[a])), zero);
+        __m128i qf = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)
+                                       (back ? node.lo[a] : node.hi[a])), zero);
+        for (unsigned int h=0;h<2;h++) {
+            __m128i n = h ? _mm_unpackhi_epi16(qn, zero) : _mm_unpacklo_epi16(qn, zero);
+            __m128i f = h ? _mm_unpackhi_epi16(qf, zero) : _mm_unpacklo_epi16(qf, zero);
+            __m128 tn = _mm_mul_ps(_mm_add_ps(offset, _mm_mul_ps(_mm_cvtepi32_ps(n), scale)), inv);
+            __m128 tf = _mm_mul_ps(_mm_add_ps(offset, _mm_mul_ps(_mm_cvtepi32_ps(f), scale)), inv);
+            // a NaN from a ray in the plane leaves the interval as it was
+            t0[h] = _mm_max_ps(tn, t0[h]);
+            t1[h] = _mm_min_ps(tf, t1[h]);
+        }
+    }
+    _mm_storeu_ps(t, t0[0]);
+    _mm_storeu_ps(t + 4, t0[1]);
+    return _mm_movemask_ps(_mm_cmple_ps(t0[0], t1[0])) |
+        _mm_movemask_ps(_mm_cmple_ps(t0[1], t1[1])) << 4;
+#else
+    float t1[WIDTH];
+    for (unsigned int k=0;k<WIDTH;k++) {
+        t[k] = 0;
+        t1[k] = maxT;
+    }
+    for (unsigned int a=0;a<3;a++) {
+        bool back = invDir[a] < 0;
+        float scale = ldexpf(1.0f, node.exponent[a]);
+        float offset = node.origin[a] - r.origin[a];
+        const unsigned char* qn = back ? node.hi[a] : node.lo[a];
+        const unsigned char* qf = back ? node.lo[a] : node.hi[a];
+        for (unsigned int k=0;k<WIDTH;k++) {
+            float tn = (offset + qn[k] * scale) * invDir[a];
+            float tf = (offset + qf[k] * scale) * invDir[a];
+            t[k] = tn > t[k] ? tn : t[k];
+            t1[k] = tf < t1[k] ? tf : t1[k];
+        }
+    }
+    unsigned int hits = 0;
+    for (unsigned int k=0;k<WIDTH;k++)
+        if (t[k] <= t1[k])
+            hits |= 1 << k;
+    return hits;
+#endif
+}
+
+inline void WideBVH::ChildBox(const Node& node, unsigned int k,
+                              Vector<3,float>& bmin, Vector<3,float>& bmax) {
+    for (unsigned int a=0;a<3;a++) {
+        float scale = ldexpf(1.0f, node.exponent[a]);
+        bmin[a] = node.origin[a] + node.lo[a][k] * scale;
+        bmax[a] = node.origin[a] + node.hi[a][k] * scale;
+    }
+}
+
+inline unsigned int WideBVH::Push(const Node& node, unsigned int hits,
+                                  const float t[WIDTH], Entry* stack, unsigned int sp) {
+    unsigned int first = sp;
+    unsigned int inner = node.childBase;
+    unsigned int prim = node.primBase;
+    for (unsigned int k=0;k<WIDTH;k++) {
+        bool isInner = node.innerMask >> k & 1;
+        if ((hits >> k & 1) && (isInner || node.count[k])) {
+            Entry e;
+            e.index = isInner ? inner : prim;
+            e.count = node.count[k];
+            e.t = t[k];
+            // insertion sort, farthest at the bottom
+            unsigned int i = sp++;
+            for (;i>first && stack[i-1].t < e.t;i--)
+                stack[i] = stack[i-1];
+            stack[i] = e;
+        }
+        inner += isInner;
+        prim += node.count[k];
+    }
+    return sp;
+}
+
+#endif
@@ -0,0 +1,18 @@
+; moves the first sphere of the scene in a circle, one turn in four
+; seconds of animation:
+;   RayTracer --sequence 100 --script data/orbit.scm
+
+(define orbit-center (rt-sphere-center 0))
+(define orbit-radius 5)
+(define orbit-time 0)
+
+(define orbit
+  (lambda (n)
+    (set! orbit-time (+ orbit-time (/ n 1000000)))
+    (let ((a (* orbit-time (/ 3.14159265 2))))
+      (rt-move-sphere 0
+                      (+ (car orbit-center) (* orbit-radius (sin a)))
+                      (cadr orbit-center)
+                      (+ (caddr orbit-center) (* orbit-radius (- (cos a) 1)))))))
+
+(add-to-process 'orbit orbit)
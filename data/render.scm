@@ -0,0 +1,59 @@
+; Render control on top of the rt-* bindings, loaded after init.scm
+
+(define quality-presets
+  '((draft   (max-depth . 1) (shadow-probe-grid . 1) (shadow-refine-grid . 1)
+             (render-scale . 0.5) (denoise . #f))
+    (preview (max-depth . 3) (shadow-probe-grid . 2) (shadow-refine-grid . 2)
+             (render-scale . 1.0) (denoise . #f))
+    (smooth  (max-depth . 5) (shadow-probe-grid . 2) (shadow-refine-grid . 1)
+             (render-scale . 1.0) (denoise . #t))
+    (final   (max-depth . 5) (shadow-probe-grid . 2) (shadow-refine-grid . 4)
+             (render-scale . 1.0) (denoise . #f))))
+
+(define rt-quality
+  (lambda (name)
+    (let ((preset (assoc name quality-presets)))
+      (if preset
+          (begin
+            (map (lambda (s) (rt-set (car s) (cdr s))) (cdr preset))
+            #t)
+          #f))))
+
+(define rt-stat
+  (lambda (name)
+    (cdr (assoc name (rt-stats)))))
+
+; Renders one file per value of a setting and prints the trace time
+; of each, e.g. (rt-sweep 'max-depth '(1 2 3 4 5) "depth")
+(define rt-sweep
+  (lambda (setting values prefix)
+    (map (lambda (v)
+           (let ((file (string-append prefix "-" (number->string v) ".ppm")))
+             (rt-set setting v)
+             (rt-render-to-file file)
+             (display file)
+             (display " ")
+             (display (rt-stat 'trace-time))
+             (newline)
+             (cons v (rt-stat 'trace-time))))
+         values)))
+
+; Renders a frame with each BVH builder and prints its build time,
+; SAH cost and the trace time of the frame, e.g. (rt-bvh-report "bvh")
+(define rt-bvh-report
+  (lambda (prefix)
+    (map (lambda (b)
+           (let ((file (string-append prefix "-" (symbol->string b) ".ppm")))
+             (rt-set 'bvh-builder b)
+             (rt-render-to-file file)
+             (display b)
+             (display " build ")
+             (display (rt-stat 'bvh-build-time))
+             (display " cost ")
+             (display (rt-stat 'bvh-sah-cost))
+             (display " trace ")
+             (display (rt-stat 'trace-time))
+             (newline)
+             (list b (rt-stat 'bvh-build-time) (rt-stat 'bvh-sah-cost)
+                   (rt-stat 'trace-time))))
+         '(sah lbvh))))
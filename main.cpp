@@ -28,6 +28,8 @@
 #include <Script/ScriptBridge.h>
 
 #include "RayTracer.h"
+#include "SequenceRenderer.h"
+#include "RenderScript.h"
 
 
 #include <Display/QtEnvironment.h>
@@ -62,6 +64,11 @@
 #include <Resources/EmptyTextureResource.h>
 #include "KeyRepeater.h"
 
+#ifdef RT_DISTRIBUTED
+#include "RenderCoordinator.h"
+#include "RenderWorker.h"
+#endif
+
 // name spaces that we will be using.
 // this combined with the above imports is almost the same as
 // fx. import OpenEngine.Logging.*; in Java.
@@ -87,31 +94,117 @@ public:
     }
 };
 
-class RTHandler : public IListener<KeyboardEventArg> {
+// runs the script's process hooks with the time step of each frame
+class SequenceAnimator : public IListener<SequenceFrameArg> {
+    RenderScript& script;
+public:
+    SequenceAnimator(RenderScript& script) : script(script) {}
+    void Handle(SequenceFrameArg arg) {
+        script.Process((unsigned int)(arg.dt * 1e6));
+    }
+};
+
+// Toggles are attached to the keyboard itself, so holding a key does
+// not flip them back and forth; only the mark moves on repeated keys,
+// see MarkHandler.
+class RTHandler : public IListener<KeyboardEventArg>
+                , public IListener<MouseMovedEventArg> {
     RayTracer& rt;
+    bool crop;
+
 public:
-    RTHandler(RayTracer& rt) : rt(rt) {}
+    RTHandler(RayTracer& rt) : rt(rt), crop(false) {}
+
+    // a crop window around the mark, which follows it
+    void UpdateCrop() {
+        const unsigned int size = 64;
+        if (!crop) {
+            rt.ClearCrop();
+            return;
+        }
+        unsigned int x0 = rt.markX > size/2 ? rt.markX - size/2 : 0;
+        unsigned int y0 = rt.markY > size/2 ? rt.markY - size/2 : 0;
+        rt.SetCrop(x0, y0, x0 + size, y0 + size);
+    }
+
     void Handle(KeyboardEventArg arg) {
         if (arg.type == EVENT_RELEASE)
             return;
-        if (arg.sym == KEY_LEFT) {
-            rt.markX--;
-        }
-        else if (arg.sym == KEY_RIGHT) {
-            rt.markX++;
-        }
-        else if (arg.sym == KEY_UP) {
-            rt.markY++;
-        }
-        else if (arg.sym == KEY_DOWN) {
-            rt.markY--;
+        if (arg.sym == KEY_c) {
+            crop = !crop;
+            UpdateCrop();
+            logger.info << "Crop window: "
+                        << (crop ? "on" : "off") << logger.end;
         }
         else if (arg.sym == KEY_p) {
             rt.markDebug = true;
             rt.GetRayTracerDebugNode()->markDebug = true;
         }
+        else if (arg.sym == KEY_v) {
+            rt.visibilityCaching = !rt.visibilityCaching;
+            logger.info << "Visibility cache: "
+                        << (rt.visibilityCaching ? "on" : "off") << logger.end;
+        }
+        else if (arg.sym == KEY_t) {
+            rt.temporal = !rt.temporal;
+            logger.info << "Temporal reprojection: "
+                        << (rt.temporal ? "on" : "off") << logger.end;
+        }
+        else if (arg.sym == KEY_r) {
+            // full, half and quarter trace resolution
+            rt.renderScale = (rt.renderScale > 0.75) ? 0.5
+                : (rt.renderScale > 0.375) ? 0.25 : 1.0;
+            logger.info << "Render scale: " << rt.renderScale << logger.end;
+        }
+        else if (arg.sym == KEY_g) {
+            rt.firstHitCaching = !rt.firstHitCaching;
+            logger.info << "First hit caching: "
+                        << (rt.firstHitCaching ? "on" : "off") << logger.end;
+        }
+        else if (arg.sym == KEY_b) {
+            rt.secondarySorting = !rt.secondarySorting;
+            logger.info << "Secondary ray sorting: "
+                        << (rt.secondarySorting ? "on" : "off") << logger.end;
+        }
+        else if (arg.sym == KEY_o) {
+            const char* names[] = {"rows", "center", "mouse", "mark", "error"};
+            rt.tileOrder = RayTracer::TileOrder((rt.tileOrder + 1) % 5);
+            logger.info << "Tile order: " << names[rt.tileOrder] << logger.end;
+        }
 
     }
+
+    // the trace texture sits in the top left corner, bottom row up
+    void Handle(MouseMovedEventArg arg) {
+        EmptyTextureResourcePtr tex = rt.GetTexture();
+        if (arg.x < 0 || arg.y < 0 ||
+            arg.x >= int(tex->GetWidth()) || arg.y >= int(tex->GetHeight()))
+            return;
+        rt.SetFocus(arg.x, tex->GetHeight() - 1 - arg.y);
+    }
+};
+
+// the arrow keys move the mark, repeated while held
+class MarkHandler : public IListener<KeyboardEventArg> {
+    RayTracer& rt;
+    RTHandler& handler;
+public:
+    MarkHandler(RayTracer& rt, RTHandler& handler) : rt(rt), handler(handler) {}
+    void Handle(KeyboardEventArg arg) {
+        if (arg.type == EVENT_RELEASE)
+            return;
+        if (arg.sym == KEY_LEFT)
+            rt.markX--;
+        else if (arg.sym == KEY_RIGHT)
+            rt.markX++;
+        else if (arg.sym == KEY_UP)
+            rt.markY++;
+        else if (arg.sym == KEY_DOWN)
+            rt.markY--;
+        else
+            return;
+        handler.UpdateCrop();
+    }
 };
 
 
@@ -244,14 +337,68 @@ void SetupDebugging(Config&);
 void SetupRayTracer(Config&);
 void SetupOpenCL(Config&);
 void SetupOpenCLhpp(Config&);
+bool MakeBricks(string file, unsigned long spheres);
 
 int main(int argc, char** argv) {
-    // Setup logging facilities.
-    Logger::AddLogger(new StreamLogger(&std::cout));
+    // --sequence <frames> renders an animation to frame*.ppm and exits
+    // --script <file> runs a render control script next to the viewer
+    // --record-rays <file> logs every traced ray
+    // --replay <file> benchmarks the rays of a log against the scene and exits
+    // --profile <pattern> writes a phase timeline per frame, e.g. prof%04u.json
+    // --bricks <file> traces the spheres of a brick file along with the scene
+    // --brick-budget <MB> memory the bricks may take
+    // --make-bricks <file> writes a field of --brick-spheres <n> spheres and exits
+    // --stream-tiles <target> writes tiles as they finish, - for stdout
+    unsigned int sequenceFrames = 0;
+    string script, recordRays, replay, profile, brickFile, makeBricks, streamTiles;
+    unsigned int brickBudget = 0;
+    unsigned long brickSpheres = 16000000;
+    for (int i=1;i+1<argc;i++) {
+        if (string(argv[i]) == "--sequence")
+            sequenceFrames = atoi(argv[i+1]);
+        if (string(argv[i]) == "--script")
+            script = argv[i+1];
+        if (string(argv[i]) == "--record-rays")
+            recordRays = argv[i+1];
+        if (string(argv[i]) == "--replay")
+            replay = argv[i+1];
+        if (string(argv[i]) == "--profile")
+            profile = argv[i+1];
+        if (string(argv[i]) == "--bricks")
+            brickFile = argv[i+1];
+        if (string(argv[i]) == "--brick-budget")
+            brickBudget = atoi(argv[i+1]);
+        if (string(argv[i]) == "--make-bricks")
+            makeBricks = argv[i+1];
+        if (string(argv[i]) == "--brick-spheres")
+            brickSpheres = strtoul(argv[i+1], NULL, 10);
+        if (string(argv[i]) == "--stream-tiles")
+            streamTiles = argv[i+1];
+    }
+
+    // Setup logging facilities, away from a tile stream on stdout.
+    Logger::AddLogger(new StreamLogger(streamTiles == "-" ? &std::cerr : &std::cout));
 
     // Print usage info.
     logger.info << "========= Running OpenEngine Test Project =========" << logger.end;
 
+    if (!makeBricks.empty())
+        return MakeBricks(makeBricks, brickSpheres) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    string listen;
+#ifdef RT_DISTRIBUTED
+    for (int i=1;i+1<argc;i++) {
+        string arg = argv[i];
+        if (arg == "--worker") {
+            // headless render node, no engine or display needed
+            RenderWorker worker(argv[i+1]);
+            worker.Run();
+            return EXIT_SUCCESS;
+        }
+        if (arg == "--listen")
+            listen = argv[i+1];
+    }
+#endif
 
 
 
@@ -265,6 +412,57 @@ int main(int argc, char** argv) {
     SetupRendering(config);
     SetupScene(config);
     SetupRayTracer(config);
+
+#ifdef RT_DISTRIBUTED
+    if (!listen.empty())
+        config.rt->SetCoordinator(new RenderCoordinator(listen));
+#endif
+
+    if (brickBudget > 0)
+        config.rt->brickBudget = brickBudget;
+    if (!brickFile.empty() && !config.rt->OpenBricks(brickFile)) {
+        delete engine;
+        delete config.scene;
+        return EXIT_FAILURE;
+    }
+
+    if (!replay.empty()) {
+        bool ok = config.rt->ReplayRays(replay);
+
+        delete engine;
+        delete config.scene;
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (!recordRays.empty())
+        config.rt->RecordRays(recordRays);
+    if (!profile.empty() && !config.rt->ProfileFrames(profile)) {
+        delete engine;
+        delete config.scene;
+        return EXIT_FAILURE;
+    }
+    if (!streamTiles.empty())
+        config.rt->StreamTiles(streamTiles);
+
+    if (sequenceFrames > 0) {
+        SequenceRenderer sequence(config.rt);
+        RenderScript* animation = NULL;
+        SequenceAnimator* animator = NULL;
+        if (!script.empty()) {
+            animation = new RenderScript(config.rt);
+            animation->Load(script);
+            animator = new SequenceAnimator(*animation);
+            sequence.AnimateEvent().Attach(*animator);
+        }
+        sequence.Render(0, sequenceFrames - 1);
+        config.rt->CloseOutputs();
+        delete animator;
+        delete animation;
+
+        delete engine;
+        delete config.scene;
+        return EXIT_SUCCESS;
+    }
     
     //SetupOpenCL(config);
     //SetupOpenCLhpp(config);
@@ -274,6 +472,12 @@ int main(int argc, char** argv) {
 
     config.rt->Start(); 
 
+    RenderScript* renderScript = NULL;
+    if (!script.empty()) {
+        renderScript = new RenderScript(config.rt);
+        renderScript->RunFile(script);
+    }
+
     // Start up the engine.
     engine->Start();
 
@@ -571,8 +775,72 @@ void SetupRayTracer(Config& config) {
     config.keyboard->KeyEvent().Attach(*krp);
 
     RTHandler* rt_h = new RTHandler(*config.rt);
-    krp->KeyEvent().Attach(*rt_h);
+    config.keyboard->KeyEvent().Attach(*rt_h);
+    config.mouse->MouseMovedEvent().Attach(*rt_h);
 
+    MarkHandler* mark_h = new MarkHandler(*config.rt, *rt_h);
+    krp->KeyEvent().Attach(*mark_h);
+
+}
+
+// A field of small spheres on the ground plane around the scene, cut
+// into square cells of one brick each. Written cell by cell, so it
+// may hold far more spheres than fit in memory.
+bool MakeBricks(string file, unsigned long spheres) {
+    const float CELL = 12;
+    const float GROUND = -20;
+
+    vector<ShadeMaterial> materials;
+    Vector<4,float> colors[4] = {
+        Vector<4,float>(0.8,0.2,0.2,1), Vector<4,float>(0.2,0.7,0.3,1),
+        Vector<4,float>(0.9,0.8,0.2,1), Vector<4,float>(0.3,0.3,0.8,1)
+    };
+    for (unsigned int i=0;i<4;i++) {
+        ShadeMaterial m;
+        m.diffuse = colors[i];
+        m.specular = Vector<4,float>(i == 3 ? 1 : 0);
+        m.shininess = 20;
+        m.reflection = i == 3 ? 0.5 : 0;
+        m.refraction = 1;
+        m.kind = ShadeMaterial::DIFFUSE;
+        if (i == 3)
+            m.kind |= ShadeMaterial::SPECULAR | ShadeMaterial::REFLECT;
+        materials.push_back(m);
+    }
+
+    BrickStore::Writer writer;
+    if (!writer.Open(file, materials))
+        return false;
+
+    unsigned long cells = (spheres + BrickStore::BRICK_SIZE - 1) / BrickStore::BRICK_SIZE;
+    unsigned int side = (unsigned int)ceil(sqrt((double)cells));
+    unsigned int seed = 1;
+    vector<BrickStore::Sphere> brick;
+    for (unsigned long c=0;c<cells;c++) {
+        float x0 = ((float)(c % side) - side * 0.5f) * CELL;
+        float z0 = ((float)(c / side) - side * 0.5f) * CELL - 100;
+        unsigned long n = min((unsigned long)BrickStore::BRICK_SIZE,
+                              spheres - c * BrickStore::BRICK_SIZE);
+        brick.resize(n);
+        for (unsigned int i=0;i<n;i++) {
+            BrickStore::Sphere& s = brick[i];
+            seed = seed * 1664525 + 1013904223;
+            s.radius = 0.1 + (seed >> 8) / 16777216.0f * 0.3;
+            seed = seed * 1664525 + 1013904223;
+            s.center[0] = x0 + (seed >> 8) / 16777216.0f * CELL;
+            seed = seed * 1664525 + 1013904223;
+            s.center[2] = z0 + (seed >> 8) / 16777216.0f * CELL;
+            s.center[1] = GROUND + s.radius;
+            s.material = seed >> 30;
+        }
+        if (!writer.Add(brick))
+            return false;
+    }
+    if (!writer.Close())
+        return false;
+    logger.info << "Wrote " << spheres << " spheres in " << cells
+                << " bricks to " << file << logger.end;
+    return true;
 }
 
 // void SetupOpenCLhpp(Config& config) {